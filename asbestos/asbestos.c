@@ -1,8 +1,12 @@
+#include <time.h>
 #define DEFAULT_CHANNEL instr
 #include "debug.h"
 #include "asbestos/asbestos.h"
+#include "asbestos/cache.h"
 #include "asbestos/gen.h"
+#include "asbestos/flat.h"
 #include "asbestos/frame.h"
+#include "asbestos/native.h"
 #include "emu/cpu.h"
 #include "emu/interrupt.h"
 #include "util/list.h"
@@ -14,27 +18,95 @@ static void fiber_block_free(struct asbestos *asbestos, struct fiber_block *bloc
 static void fiber_free_jetsam(struct asbestos *asbestos);
 static void fiber_resize_hash(struct asbestos *asbestos, size_t new_size);
 
+static uint64_t fiber_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+#ifdef FIBER_PROFILE
+// Add a block's runs to the hot list. Blocks are added when they're retired
+// and again when the list is read, so code that's been invalidated and
+// recompiled adds up under one address.
+static void fiber_profile_hot(struct asbestos_profile *profile, struct fiber_block *block) {
+    uint64_t runs = __atomic_load_n(&block->runs, __ATOMIC_RELAXED);
+    unsigned i;
+    for (i = 0; i < profile->hot_count; i++) {
+        if (profile->hot[i].addr == block->addr)
+            break;
+    }
+    if (i < profile->hot_count) {
+        runs += profile->hot[i].runs;
+    } else if (profile->hot_count < FIBER_PROFILE_HOT_BLOCKS) {
+        profile->hot_count++;
+    } else {
+        i--;
+        if (runs <= profile->hot[i].runs)
+            return;
+    }
+    while (i > 0 && profile->hot[i - 1].runs < runs) {
+        profile->hot[i] = profile->hot[i - 1];
+        i--;
+    }
+    profile->hot[i].addr = block->addr;
+    profile->hot[i].end_addr = block->end_addr;
+    profile->hot[i].runs = runs;
+    profile->hot[i].is_trace = block->is_trace;
+}
+#endif
+
+static uint64_t fiber_generation;
+static uint64_t fiber_next_generation(void) {
+    return __atomic_add_fetch(&fiber_generation, 1, __ATOMIC_SEQ_CST);
+}
+
 struct asbestos *asbestos_new(struct mmu *mmu) {
+    fiber_flat_init();
     struct asbestos *asbestos = calloc(1, sizeof(struct asbestos));
     asbestos->mmu = mmu;
+    asbestos->generation = fiber_next_generation();
     fiber_resize_hash(asbestos, FIBER_INITIAL_HASH_SIZE);
     asbestos->page_hash = calloc(FIBER_PAGE_HASH_SIZE, sizeof(*asbestos->page_hash));
     list_init(&asbestos->jetsam);
     lock_init(&asbestos->lock);
-    wrlock_init(&asbestos->jetsam_lock);
+    lock_init(&asbestos->chain_lock);
     return asbestos;
 }
 
+#ifdef FIBER_PROFILE
+static void fiber_profile_dump(struct asbestos *asbestos) {
+    struct asbestos_profile profile;
+    asbestos_get_profile(asbestos, &profile);
+    if (profile.dispatches == 0)
+        return;
+    printk("jit profile: %llu dispatches, %llu cache hits, %llu hash hits, %llu compiles, %llu traces, %llu locks\n",
+            (unsigned long long) profile.dispatches, (unsigned long long) profile.cache_hits,
+            (unsigned long long) profile.hash_hits, (unsigned long long) profile.compiles,
+            (unsigned long long) profile.trace_compiles, (unsigned long long) profile.locks);
+    printk("jit profile: %llu invalidations of %llu blocks, %zu blocks in %zu/%zu buckets, longest chain %zu\n",
+            (unsigned long long) profile.invalidations, (unsigned long long) profile.invalidated_blocks,
+            profile.blocks, profile.hash_buckets_used, profile.hash_size, profile.hash_chain_max);
+    for (unsigned i = 0; i < profile.hot_count; i++) {
+        printk("jit profile: %08x-%08x%s %llu\n", profile.hot[i].addr, profile.hot[i].end_addr,
+                profile.hot[i].is_trace ? " trace" : "", (unsigned long long) profile.hot[i].runs);
+    }
+    printk("jit profile: %llu tlb accesses, %llu misses, %llu victim hits\n",
+            (unsigned long long) profile.tlb_accesses, (unsigned long long) profile.tlb_misses,
+            (unsigned long long) profile.tlb_victim_hits);
+}
+#endif
+
 void asbestos_free(struct asbestos *asbestos) {
-    for (size_t i = 0; i < asbestos->hash_size; i++) {
-        struct fiber_block *block, *tmp;
-        if (list_null(&asbestos->hash[i]))
-            continue;
-        list_for_each_entry_safe(&asbestos->hash[i], block, tmp, chain) {
+#ifdef FIBER_PROFILE
+    fiber_profile_dump(asbestos);
+#endif
+    for (size_t i = 0; i < asbestos->hash->size; i++) {
+        struct fiber_block *block;
+        while ((block = asbestos->hash->buckets[i]) != NULL)
             fiber_block_free(asbestos, block);
-        }
     }
     fiber_free_jetsam(asbestos);
+    fiber_cache_free(asbestos);
     free(asbestos->page_hash);
     free(asbestos->hash);
     free(asbestos);
@@ -45,8 +117,24 @@ static inline struct list *blocks_list(struct asbestos *asbestos, page_t page, i
     return &asbestos->page_hash[page % FIBER_PAGE_HASH_SIZE].blocks[i];
 }
 
-void asbestos_invalidate_range(struct asbestos *absestos, page_t start, page_t end) {
-    lock(&absestos->lock);
+// Disconnect the block and put it on the jetsam list. Must be called with the
+// lock, and the caller has to bump the generation afterwards.
+static void fiber_block_retire(struct asbestos *asbestos, struct fiber_block *block) {
+    // before disconnecting, so anyone who gets chain_lock after that sees it
+    // and doesn't chain it again
+    __atomic_store_n(&block->is_jetsam, true, __ATOMIC_RELAXED);
+    fiber_block_disconnect(asbestos, block);
+    block->jetsam_epoch = asbestos->epoch;
+    block->jetsam_time = fiber_now_ns();
+    list_add(&asbestos->jetsam, &block->jetsam);
+    asbestos->reclaim.retired++;
+#ifdef FIBER_PROFILE
+    fiber_profile_hot(&asbestos->profile, block);
+#endif
+}
+
+static void fiber_invalidate_range(struct asbestos *absestos, page_t start, page_t end) {
+    bool invalidated = false;
     struct fiber_block *block, *tmp;
     for (page_t page = start; page < end; page++) {
         for (int i = 0; i <= 1; i++) {
@@ -54,71 +142,146 @@ void asbestos_invalidate_range(struct asbestos *absestos, page_t start, page_t e
             if (list_null(blocks))
                 continue;
             list_for_each_entry_safe(blocks, block, tmp, page[i]) {
-                fiber_block_disconnect(absestos, block);
-                block->is_jetsam = true;
-                list_add(&absestos->jetsam, &block->jetsam);
+                fiber_block_retire(absestos, block);
+                invalidated = true;
+#ifdef FIBER_PROFILE
+                absestos->profile.invalidated_blocks++;
+#endif
             }
         }
     }
-    unlock(&absestos->lock);
+    fiber_cache_invalidate(absestos, start, end);
+    if (invalidated) {
+        __atomic_store_n(&absestos->generation, fiber_next_generation(), __ATOMIC_SEQ_CST);
+#ifdef FIBER_PROFILE
+        absestos->profile.invalidations++;
+#endif
+    }
+}
+
+void asbestos_invalidate_range(struct asbestos *asbestos, page_t start, page_t end) {
+    lock(&asbestos->lock);
+    fiber_invalidate_range(asbestos, start, end);
+    unlock(&asbestos->lock);
 }
 
 void asbestos_invalidate_page(struct asbestos *asbestos, page_t page) {
     asbestos_invalidate_range(asbestos, page, page + 1);
 }
+
+void asbestos_invalidate_write(struct asbestos *asbestos, page_t start, page_t end) {
+    struct mmu_ops *ops = asbestos->mmu->ops;
+    lock(&asbestos->lock);
+    // with the lock, so nothing can be compiled from the page in between
+    if (ops->unprotect_code != NULL) {
+        for (page_t page = start; page < end; page++)
+            ops->unprotect_code(asbestos->mmu, page);
+    }
+    fiber_invalidate_range(asbestos, start, end);
+    unlock(&asbestos->lock);
+}
+
+// Done before reading any code from the pages a block starting at ip can be
+// in, so a write that happens while it's being compiled still invalidates it
+static void fiber_protect_code(struct asbestos *asbestos, addr_t ip) {
+    struct mmu_ops *ops = asbestos->mmu->ops;
+    if (ops->protect_code == NULL)
+        return;
+    for (page_t page = PAGE(ip); page <= PAGE(ip) + 1 && page < MEM_PAGES; page++)
+        ops->protect_code(asbestos->mmu, page);
+}
+
 void asbestos_invalidate_all(struct asbestos *asbestos) {
     asbestos_invalidate_range(asbestos, 0, MEM_PAGES);
 }
 
+static void fiber_hash_add(struct fiber_hash *hash, struct fiber_block *block) {
+    struct fiber_block **bucket = &hash->buckets[block->addr % hash->size];
+    __atomic_store_n(&block->chain, *bucket, __ATOMIC_RELEASE);
+    __atomic_store_n(bucket, block, __ATOMIC_RELEASE);
+}
+
+static void fiber_hash_remove(struct fiber_hash *hash, struct fiber_block *block) {
+    // block->chain stays as it is, since a reader could be looking at block
+    struct fiber_block **link = &hash->buckets[block->addr % hash->size];
+    while (*link != NULL) {
+        if (*link == block) {
+            __atomic_store_n(link, block->chain, __ATOMIC_RELEASE);
+            return;
+        }
+        link = &(*link)->chain;
+    }
+}
+
 static void fiber_resize_hash(struct asbestos *asbestos, size_t new_size) {
     TRACE_(verbose, "%d resizing hash to %lu, using %lu bytes for gadgets\n", current_pid(), new_size, asbestos->mem_used);
-    struct list *new_hash = calloc(new_size, sizeof(struct list));
-    for (size_t i = 0; i < asbestos->hash_size; i++) {
-        if (list_null(&asbestos->hash[i]))
-            continue;
-        struct fiber_block *block, *tmp;
-        list_for_each_entry_safe(&asbestos->hash[i], block, tmp, chain) {
-            list_remove(&block->chain);
-            list_init_add(&new_hash[block->addr % new_size], &block->chain);
+    struct fiber_hash *new_hash = calloc(1, sizeof(struct fiber_hash) + new_size * sizeof(struct fiber_block *));
+    new_hash->size = new_size;
+    struct fiber_hash *old_hash = asbestos->hash;
+    if (old_hash != NULL) {
+        // A reader on the old table can follow a moved block into the new
+        // one and miss the block it wanted. That's fine, it'll just retry
+        // with the lock.
+        for (size_t i = 0; i < old_hash->size; i++) {
+            struct fiber_block *block;
+            while ((block = old_hash->buckets[i]) != NULL) {
+                __atomic_store_n(&old_hash->buckets[i], block->chain, __ATOMIC_RELEASE);
+                fiber_hash_add(new_hash, block);
+            }
         }
+        old_hash->jetsam = asbestos->hash_jetsam;
+        old_hash->jetsam_epoch = asbestos->epoch;
+        asbestos->hash_jetsam = old_hash;
     }
-    free(asbestos->hash);
-    asbestos->hash = new_hash;
-    asbestos->hash_size = new_size;
+    __atomic_store_n(&asbestos->hash, new_hash, __ATOMIC_RELEASE);
 }
 
 static void fiber_insert(struct asbestos *asbestos, struct fiber_block *block) {
     asbestos->mem_used += block->used;
     asbestos->num_blocks++;
     // target an average hash chain length of 1-2
-    if (asbestos->num_blocks >= asbestos->hash_size * 2)
-        fiber_resize_hash(asbestos, asbestos->hash_size * 2);
+    if (asbestos->num_blocks >= asbestos->hash->size * 2)
+        fiber_resize_hash(asbestos, asbestos->hash->size * 2);
 
-    list_init_add(&asbestos->hash[block->addr % asbestos->hash_size], &block->chain);
+    fiber_hash_add(asbestos->hash, block);
     list_init_add(blocks_list(asbestos, PAGE(block->addr), 0), &block->page[0]);
     if (PAGE(block->addr) != PAGE(block->end_addr))
         list_init_add(blocks_list(asbestos, PAGE(block->end_addr), 1), &block->page[1]);
 }
 
+// Doesn't need asbestos->lock, but the caller must be in an epoch. Without
+// the lock this can miss a block that's being moved, but it never returns the
+// wrong one.
 static struct fiber_block *fiber_lookup(struct asbestos *asbestos, addr_t addr) {
-    struct list *bucket = &asbestos->hash[addr % asbestos->hash_size];
-    if (list_null(bucket))
-        return NULL;
-    struct fiber_block *block;
-    list_for_each_entry(bucket, block, chain) {
+    struct fiber_hash *hash = __atomic_load_n(&asbestos->hash, __ATOMIC_ACQUIRE);
+    struct fiber_block *block = __atomic_load_n(&hash->buckets[addr % hash->size], __ATOMIC_ACQUIRE);
+    while (block != NULL) {
         if (block->addr == addr)
             return block;
+        block = __atomic_load_n(&block->chain, __ATOMIC_ACQUIRE);
     }
     return NULL;
 }
 
-static struct fiber_block *fiber_block_compile(addr_t ip, struct tlb *tlb) {
+static struct fiber_block *fiber_block_compile(addr_t ip, struct tlb *tlb, bool trace) {
     struct gen_state state;
-    TRACE("%d %08x --- compiling:\n", current_pid(), ip);
+    TRACE("%d %08x --- compiling%s:\n", current_pid(), ip, trace ? " trace" : "");
     gen_start(ip, &state);
+    state.trace = trace;
+    bool cache = !trace && fiber_cache_enabled();
+    if (cache)
+        state.host_pointer = calloc(state.capacity, sizeof(bool));
     while (true) {
         if (!gen_step(&state, tlb))
             break;
+        if (trace) {
+            // gen_trace_in_window keeps traces inside 2 pages the same way
+            if (!gen_trace_in_window(&state, state.ip) || state.size >= FIBER_TRACE_MAX_SIZE) {
+                gen_exit(&state);
+                break;
+            }
+            continue;
+        }
         // no block should span more than 2 pages
         // guarantee this by limiting total block size to 1 page
         // guarantee that by stopping as soon as there's less space left than
@@ -130,8 +293,21 @@ static struct fiber_block *fiber_block_compile(addr_t ip, struct tlb *tlb) {
         }
     }
     gen_end(&state);
-    assert(state.ip - ip <= PAGE_SIZE);
+    assert(trace || state.ip - ip <= PAGE_SIZE);
+#ifdef FIBER_PROFILE
+    // always called with the lock
+    struct asbestos_profile *profile = &tlb->mmu->asbestos->profile;
+    if (trace)
+        profile->trace_compiles++;
+    else
+        profile->compiles++;
+#endif
     state.block->used = state.capacity;
+    if (cache) {
+        if (state.host_pointer != NULL)
+            fiber_cache_store(tlb->mmu->asbestos, state.block, state.host_pointer);
+        free(state.host_pointer);
+    }
     return state.block;
 }
 
@@ -141,8 +317,9 @@ static void fiber_block_disconnect(struct asbestos *asbestos, struct fiber_block
     if (asbestos != NULL) {
         asbestos->mem_used -= block->used;
         asbestos->num_blocks--;
+        fiber_hash_remove(asbestos->hash, block);
+        lock(&asbestos->chain_lock);
     }
-    list_remove(&block->chain);
     for (int i = 0; i <= 1; i++) {
         list_remove(&block->page[i]);
         list_remove_safe(&block->jumps_from_links[i]);
@@ -150,38 +327,200 @@ static void fiber_block_disconnect(struct asbestos *asbestos, struct fiber_block
         struct fiber_block *prev_block, *tmp;
         list_for_each_entry_safe(&block->jumps_from[i], prev_block, tmp, jumps_from_links[i]) {
             if (prev_block->jump_ip[i] != NULL)
-                *prev_block->jump_ip[i] = prev_block->old_jump_ip[i];
+                __atomic_store_n(prev_block->jump_ip[i], prev_block->old_jump_ip[i], __ATOMIC_RELAXED);
             list_remove(&prev_block->jumps_from_links[i]);
         }
     }
+    for (unsigned i = 0; i < block->side_exits_count; i++)
+        list_remove_safe(&block->side_exits[i].link);
+    struct fiber_exit *exit, *tmp;
+    list_for_each_entry_safe(&block->jumps_from_side, exit, tmp, link) {
+        __atomic_store_n(exit->jump_ip, exit->old_jump_ip, __ATOMIC_RELAXED);
+        list_remove(&exit->link);
+    }
+    if (asbestos != NULL)
+        unlock(&asbestos->chain_lock);
+}
+
+static void fiber_block_release(struct fiber_block *block) {
+    native_free(block);
+    free(block);
 }
 
 static void fiber_block_free(struct asbestos *asbestos, struct fiber_block *block) {
     fiber_block_disconnect(asbestos, block);
-    free(block);
+    fiber_block_release(block);
 }
 
 static void fiber_free_jetsam(struct asbestos *asbestos) {
     struct fiber_block *block, *tmp;
     list_for_each_entry_safe(&asbestos->jetsam, block, tmp, jetsam) {
         list_remove(&block->jetsam);
-        free(block);
+        fiber_block_release(block);
+    }
+    while (asbestos->hash_jetsam != NULL) {
+        struct fiber_hash *hash = asbestos->hash_jetsam;
+        asbestos->hash_jetsam = hash->jetsam;
+        free(hash);
+    }
+}
+
+static bool fiber_has_jetsam(struct asbestos *asbestos) {
+    return !list_empty(&asbestos->jetsam) || asbestos->hash_jetsam != NULL;
+}
+
+static uint64_t fiber_epoch_enter(struct asbestos *asbestos) {
+    while (true) {
+        uint64_t epoch = __atomic_load_n(&asbestos->epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&asbestos->active[epoch % 2], 1, __ATOMIC_SEQ_CST);
+        // if the epoch moved on before we were counted, whoever moved it
+        // might not have seen us
+        if (__atomic_load_n(&asbestos->epoch, __ATOMIC_SEQ_CST) == epoch)
+            return epoch;
+        __atomic_sub_fetch(&asbestos->active[epoch % 2], 1, __ATOMIC_SEQ_CST);
     }
 }
 
+static void fiber_epoch_exit(struct asbestos *asbestos, uint64_t epoch) {
+    __atomic_sub_fetch(&asbestos->active[epoch % 2], 1, __ATOMIC_SEQ_CST);
+}
+
+// Free whatever no thread can be looking at anymore. Must be called with the
+// lock, and outside of an epoch, or the epoch may never advance.
+static void fiber_reclaim(struct asbestos *asbestos) {
+    if (!fiber_has_jetsam(asbestos))
+        return;
+    uint64_t epoch = asbestos->epoch;
+    if (__atomic_load_n(&asbestos->active[(epoch + 1) % 2], __ATOMIC_SEQ_CST) == 0)
+        __atomic_store_n(&asbestos->epoch, ++epoch, __ATOMIC_SEQ_CST);
+
+    uint64_t now = 0;
+    struct fiber_block *block, *tmp;
+    list_for_each_entry_safe(&asbestos->jetsam, block, tmp, jetsam) {
+        if (block->jetsam_epoch + 2 > epoch)
+            continue;
+        if (now == 0)
+            now = fiber_now_ns();
+        uint64_t latency = now - block->jetsam_time;
+        asbestos->reclaim.freed++;
+        asbestos->reclaim.latency_total_ns += latency;
+        if (latency > asbestos->reclaim.latency_max_ns)
+            asbestos->reclaim.latency_max_ns = latency;
+        list_remove(&block->jetsam);
+        fiber_block_release(block);
+    }
+    struct fiber_hash **hash = &asbestos->hash_jetsam;
+    while (*hash != NULL) {
+        struct fiber_hash *old_hash = *hash;
+        if (old_hash->jetsam_epoch + 2 > epoch) {
+            hash = &old_hash->jetsam;
+            continue;
+        }
+        *hash = old_hash->jetsam;
+        free(old_hash);
+    }
+}
+
+void asbestos_get_reclaim_stats(struct asbestos *asbestos, struct asbestos_reclaim_stats *stats) {
+    lock(&asbestos->lock);
+    *stats = asbestos->reclaim;
+    unlock(&asbestos->lock);
+}
+
+#ifdef FIBER_PROFILE
+void asbestos_get_profile(struct asbestos *asbestos, struct asbestos_profile *profile) {
+    lock(&asbestos->lock);
+    *profile = asbestos->profile;
+    profile->blocks = asbestos->num_blocks;
+    profile->hash_size = asbestos->hash->size;
+    profile->hash_buckets_used = 0;
+    profile->hash_chain_max = 0;
+    for (size_t i = 0; i < asbestos->hash->size; i++) {
+        size_t chain = 0;
+        for (struct fiber_block *block = asbestos->hash->buckets[i]; block != NULL; block = block->chain) {
+            chain++;
+            fiber_profile_hot(profile, block);
+        }
+        if (chain != 0)
+            profile->hash_buckets_used++;
+        if (chain > profile->hash_chain_max)
+            profile->hash_chain_max = chain;
+    }
+    unlock(&asbestos->lock);
+}
+#endif
+
+// Whether the exit of last_block that got us here can be chained to block.
+// Checked without the lock so the lock only has to be taken once per edge.
+static bool fiber_block_can_chain(struct fiber_block *last_block, struct fiber_block *block) {
+    for (int i = 0; i <= 1; i++) {
+        if (last_block->jump_ip[i] != NULL &&
+                (__atomic_load_n(last_block->jump_ip[i], __ATOMIC_RELAXED) & 0xffffffff) == block->addr)
+            return true;
+    }
+    for (unsigned i = 0; i < last_block->side_exits_count; i++) {
+        if ((__atomic_load_n(last_block->side_exits[i].jump_ip, __ATOMIC_RELAXED) & 0xffffffff) == block->addr)
+            return true;
+    }
+    return false;
+}
+
 int fiber_enter(struct fiber_block *block, struct fiber_frame *frame, struct tlb *tlb);
 
+// Replace a block that's been run a lot with a trace starting at the same
+// address. Returns the block to run.
+static struct fiber_block *fiber_promote(struct asbestos *asbestos, struct fiber_block *block, struct tlb *tlb) {
+    lock(&asbestos->lock);
+#ifdef FIBER_PROFILE
+    __atomic_fetch_add(&asbestos->profile.locks, 1, __ATOMIC_RELAXED);
+#endif
+    if (!block->is_jetsam) {
+        fiber_protect_code(asbestos, block->addr);
+        struct fiber_block *trace = fiber_block_compile(block->addr, tlb, true);
+        fiber_block_retire(asbestos, block);
+        fiber_insert(asbestos, trace);
+        __atomic_store_n(&asbestos->generation, fiber_next_generation(), __ATOMIC_SEQ_CST);
+        block = trace;
+    } else {
+        // another thread could have beaten us to it
+        struct fiber_block *current = fiber_lookup(asbestos, block->addr);
+        if (current != NULL)
+            block = current;
+    }
+    unlock(&asbestos->lock);
+    return block;
+}
+
 static inline size_t fiber_cache_hash(addr_t ip) {
     return (ip ^ (ip >> 12)) % FIBER_CACHE_SIZE;
 }
 
+// Dispatch state for the current thread. It's kept between calls to
+// cpu_step_to_interrupt so coming back from a syscall doesn't have to allocate
+// anything or start with a cold cache. The cache and the return cache point
+// into blocks, so they're only valid as long as the asbestos generation they
+// were filled under is current.
+static __thread struct {
+    uint64_t generation;
+    struct fiber_block *cache[FIBER_CACHE_SIZE];
+    struct fiber_frame frame;
+} fiber_local;
+
 static int cpu_step_to_interrupt(struct cpu_state *cpu, struct tlb *tlb) {
     struct asbestos *asbestos = cpu->mmu->asbestos;
-    read_wrlock(&asbestos->jetsam_lock);
-
-    struct fiber_block **cache = calloc(FIBER_CACHE_SIZE, sizeof(*cache));
-    struct fiber_frame *frame = malloc(sizeof(struct fiber_frame));
-    memset(frame, 0, sizeof(*frame));
+    uint64_t epoch = fiber_epoch_enter(asbestos);
+
+    // must be checked inside the epoch, otherwise blocks could be freed right
+    // after
+    uint64_t generation = __atomic_load_n(&asbestos->generation, __ATOMIC_SEQ_CST);
+    if (fiber_local.generation != generation) {
+        memset(fiber_local.cache, 0, sizeof(fiber_local.cache));
+        memset(fiber_local.frame.ret_cache, 0, sizeof(fiber_local.frame.ret_cache));
+        fiber_local.generation = generation;
+    }
+    struct fiber_block **cache = fiber_local.cache;
+    struct fiber_frame *frame = &fiber_local.frame;
+    frame->last_block = NULL;
     frame->cpu = *cpu;
     assert(asbestos->mmu == cpu->mmu);
 
@@ -190,41 +529,82 @@ static int cpu_step_to_interrupt(struct cpu_state *cpu, struct tlb *tlb) {
         addr_t ip = frame->cpu.eip;
         size_t cache_index = fiber_cache_hash(ip);
         struct fiber_block *block = cache[cache_index];
+#ifdef FIBER_PROFILE
+        __atomic_fetch_add(&asbestos->profile.dispatches, 1, __ATOMIC_RELAXED);
+        if (block != NULL && block->addr == ip)
+            __atomic_fetch_add(&asbestos->profile.cache_hits, 1, __ATOMIC_RELAXED);
+#endif
         if (block == NULL || block->addr != ip) {
-            lock(&asbestos->lock);
             block = fiber_lookup(asbestos, ip);
-            if (block == NULL) {
-                block = fiber_block_compile(ip, tlb);
-                fiber_insert(asbestos, block);
+            if (block == NULL || __atomic_load_n(&block->is_jetsam, __ATOMIC_RELAXED)) {
+                lock(&asbestos->lock);
+#ifdef FIBER_PROFILE
+                __atomic_fetch_add(&asbestos->profile.locks, 1, __ATOMIC_RELAXED);
+#endif
+                block = fiber_lookup(asbestos, ip);
+                if (block == NULL) {
+                    fiber_protect_code(asbestos, ip);
+                    block = fiber_cache_load(asbestos, ip);
+                    if (block == NULL)
+                        block = fiber_block_compile(ip, tlb, false);
+                    fiber_insert(asbestos, block);
+                }
+                unlock(&asbestos->lock);
             } else {
                 TRACE("%d %08x --- missed cache\n", current_pid(), ip);
+#ifdef FIBER_PROFILE
+                __atomic_fetch_add(&asbestos->profile.hash_hits, 1, __ATOMIC_RELAXED);
+#endif
             }
             cache[cache_index] = block;
-            unlock(&asbestos->lock);
+        }
+        if (!block->is_trace) {
+            int hot_count = __atomic_load_n(&block->hot_count, __ATOMIC_RELAXED) - 1;
+            __atomic_store_n(&block->hot_count, hot_count, __ATOMIC_RELAXED);
+            if (hot_count <= 0) {
+                block = fiber_promote(asbestos, block, tlb);
+                cache[cache_index] = block;
+                // the old block was just retired, so there's nothing to chain from
+                frame->last_block = NULL;
+            }
         }
         struct fiber_block *last_block = frame->last_block;
-        if (last_block != NULL &&
-                (last_block->jump_ip[0] != NULL ||
-                 last_block->jump_ip[1] != NULL)) {
-            lock(&asbestos->lock);
+#ifdef FIBER_PROFILE
+        __atomic_fetch_add(&block->runs, 1, __ATOMIC_RELAXED);
+        // nothing gets chained, so every block comes back here to be counted
+        last_block = NULL;
+#endif
+        // Leave backward jumps into blocks that aren't traces yet unchained,
+        // so loops keep coming back here to be counted until they're hot.
+        if (last_block != NULL && (block->is_trace || block->addr > last_block->addr) &&
+                fiber_block_can_chain(last_block, block)) {
+            lock(&asbestos->chain_lock);
             // can't mint new pointers to a block that has been marked jetsam
             // and is thus assumed to have no pointers left
-            if (!last_block->is_jetsam && !block->is_jetsam) {
+            if (!__atomic_load_n(&last_block->is_jetsam, __ATOMIC_RELAXED) &&
+                    !__atomic_load_n(&block->is_jetsam, __ATOMIC_RELAXED)) {
                 for (int i = 0; i <= 1; i++) {
                     if (last_block->jump_ip[i] != NULL &&
                             (*last_block->jump_ip[i] & 0xffffffff) == block->addr) {
-                        *last_block->jump_ip[i] = (unsigned long) block->code;
+                        __atomic_store_n(last_block->jump_ip[i], (unsigned long) block->code, __ATOMIC_RELEASE);
                         list_add(&block->jumps_from[i], &last_block->jumps_from_links[i]);
                     }
                 }
+                for (unsigned i = 0; i < last_block->side_exits_count; i++) {
+                    struct fiber_exit *exit = &last_block->side_exits[i];
+                    if ((*exit->jump_ip & 0xffffffff) == block->addr) {
+                        __atomic_store_n(exit->jump_ip, (unsigned long) block->code, __ATOMIC_RELEASE);
+                        list_add(&block->jumps_from_side, &exit->link);
+                    }
+                }
             }
 
-            unlock(&asbestos->lock);
+            unlock(&asbestos->chain_lock);
         }
         frame->last_block = block;
 
         // block may be jetsam, but that's ok, because it can't be freed until
-        // every thread on this asbestos is not executing anything
+        // this thread leaves the epoch
 
         TRACE("%d %08x --- cycle %ld\n", current_pid(), ip, frame->cpu.cycle);
 
@@ -236,9 +616,7 @@ static int cpu_step_to_interrupt(struct cpu_state *cpu, struct tlb *tlb) {
         *cpu = frame->cpu;
     }
 
-    free(frame);
-    free(cache);
-    read_wrunlock(&asbestos->jetsam_lock);
+    fiber_epoch_exit(asbestos, epoch);
     return interrupt;
 }
 
@@ -267,17 +645,14 @@ int cpu_run_to_interrupt(struct cpu_state *cpu, struct tlb *tlb) {
     cpu->trapno = interrupt;
 
     struct asbestos *asbestos = cpu->mmu->asbestos;
+#ifdef FIBER_PROFILE
+    __atomic_fetch_add(&asbestos->profile.tlb_accesses, tlb->stats.accesses, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&asbestos->profile.tlb_misses, tlb->stats.misses, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&asbestos->profile.tlb_victim_hits, tlb->stats.victim_hits, __ATOMIC_RELAXED);
+    tlb->stats = (struct tlb_stats) {};
+#endif
     lock(&asbestos->lock);
-    if (!list_empty(&asbestos->jetsam)) {
-        // write-lock the jetsam_lock to wait until other asbestos threads get
-        // to this point, so they will all clear out their block pointers
-        // TODO: use RCU for better performance
-        unlock(&asbestos->lock);
-        write_wrlock(&asbestos->jetsam_lock);
-        lock(&asbestos->lock);
-        fiber_free_jetsam(asbestos);
-        write_wrunlock(&asbestos->jetsam_lock);
-    }
+    fiber_reclaim(asbestos);
     unlock(&asbestos->lock);
 
     return interrupt;
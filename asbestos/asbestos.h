@@ -8,6 +8,62 @@
 #define FIBER_INITIAL_HASH_SIZE (1 << 10)
 #define FIBER_CACHE_SIZE (1 << 10)
 #define FIBER_PAGE_HASH_SIZE (1 << 10)
+// how many times a block runs before it's recompiled as a trace
+#define FIBER_TRACE_THRESHOLD 2000
+
+// Blocks hashed by address. This can be read without asbestos->lock from
+// inside an epoch (see below): writers publish pointers with release stores,
+// leave the chain pointer of a removed block alone, and put old tables and
+// removed blocks on jetsam lists instead of freeing them.
+struct fiber_hash {
+    size_t size;
+    struct fiber_hash *jetsam;
+    uint64_t jetsam_epoch;
+    struct fiber_block *buckets[];
+};
+
+struct asbestos_reclaim_stats {
+    uint64_t retired;
+    uint64_t freed;
+    // time between a block being invalidated and being freed
+    uint64_t latency_total_ns;
+    uint64_t latency_max_ns;
+};
+
+#ifdef FIBER_PROFILE
+#define FIBER_PROFILE_HOT_BLOCKS 16
+// Counters kept in builds with the jit_profile option, for tuning the sizes
+// above and finding the hot spots in guest code. Every block goes back to the
+// dispatcher in these builds, so it can count how many times each one runs.
+struct asbestos_profile {
+    uint64_t dispatches;
+    uint64_t cache_hits; // found in the dispatch cache
+    uint64_t hash_hits; // found in the hash
+    uint64_t compiles;
+    uint64_t trace_compiles;
+    uint64_t locks; // times the dispatcher took lock, what threads contend on
+    uint64_t invalidations; // invalidated ranges that had blocks in them
+    uint64_t invalidated_blocks;
+    // summed over every thread's TLB
+    uint64_t tlb_accesses;
+    uint64_t tlb_misses;
+    uint64_t tlb_victim_hits; // misses that were found in the victim table
+
+    // the rest is filled in by asbestos_get_profile
+    size_t blocks;
+    size_t hash_size;
+    size_t hash_buckets_used;
+    size_t hash_chain_max;
+    // most run blocks first
+    struct {
+        addr_t addr;
+        addr_t end_addr;
+        uint64_t runs;
+        bool is_trace;
+    } hot[FIBER_PROFILE_HOT_BLOCKS];
+    unsigned hot_count;
+};
+#endif
 
 struct asbestos {
     // there is one asbestos per address space
@@ -15,30 +71,64 @@ struct asbestos {
     size_t mem_used;
     size_t num_blocks;
 
-    struct list *hash;
-    size_t hash_size;
+    // access atomically
+    struct fiber_hash *hash;
+    // tables replaced by resizing, freed along with jetsam blocks
+    struct fiber_hash *hash_jetsam;
+
+    // Changes whenever blocks are invalidated, so threads know to drop their
+    // dispatch caches. Unique across all asbestos instances. Access atomically.
+    uint64_t generation;
 
-    // list of fiber_blocks that should be freed soon (at the next RCU grace
-    // period, if we had such a thing)
+    // list of fiber_blocks that should be freed soon, once every thread that
+    // could have seen them has left the epoch they were removed in
     struct list jetsam;
 
+    // Epoch-based reclamation. Threads executing blocks count themselves in
+    // active[epoch % 2] for the epoch they entered in. The epoch can only
+    // advance when nobody is left in the one before it, so something removed
+    // in epoch n can be freed once the epoch reaches n + 2. Nobody ever waits
+    // for this to happen. Access atomically, epoch only changes with lock.
+    uint64_t epoch;
+    unsigned active[2];
+    struct asbestos_reclaim_stats reclaim; // locked by lock
+#ifdef FIBER_PROFILE
+    struct asbestos_profile profile; // counters are updated atomically
+#endif
+
     // A way to look up blocks in a page
     struct {
         struct list blocks[2];
     } *page_hash;
 
+    // blocks saved on disk, see cache.c. locked by lock
+    struct fiber_cache *cache;
+
     lock_t lock;
-    wrlock_t jetsam_lock;
+    // Locks the lists of jumps chained between blocks, so chaining doesn't
+    // have to wait for whoever is compiling with lock. Taken after lock when
+    // both are needed.
+    lock_t chain_lock;
 };
 
 // this is roughly the average number of instructions in a basic block according to anonymous sources
 // times 4, roughly the average number of gadgets/parameters in an instruction, according to anonymous sources
 #define FIBER_BLOCK_INITIAL_CAPACITY 16
 
+// An extra exit from the middle of a trace, chained the same way as the
+// jump_ip exits at the end of a block
+struct fiber_exit {
+    unsigned long *jump_ip;
+    unsigned long old_jump_ip;
+    // link in jumps_from_side of the block this jumps to
+    struct list link;
+};
+
 struct fiber_block {
     addr_t addr;
     addr_t end_addr;
     size_t used;
+    unsigned size; // of code, in words
 
     // pointers to the ip values in the last gadget
     unsigned long *jump_ip[2];
@@ -46,9 +136,14 @@ struct fiber_block {
     unsigned long old_jump_ip[2];
     // blocks that jump to this block
     struct list jumps_from[2];
+    // trace side exits, stored after code
+    struct fiber_exit *side_exits;
+    unsigned side_exits_count;
+    // side exits that jump to this block
+    struct list jumps_from_side;
 
-    // hashtable bucket links
-    struct list chain;
+    // hashtable bucket link, access atomically
+    struct fiber_block *chain;
     // list of blocks in a page
     struct list page[2];
     // links for jumps_from
@@ -56,6 +151,21 @@ struct fiber_block {
     // links for free list
     struct list jetsam;
     bool is_jetsam;
+    uint64_t jetsam_epoch;
+    uint64_t jetsam_time;
+    // built by following branches past the end of the first basic block
+    bool is_trace;
+    // Counted down every time the dispatcher runs the block, when it runs out
+    // the block is replaced with a trace. Updated racily, it's only a
+    // heuristic.
+    int hot_count;
+    // host code that some runs of gadgets in a trace were replaced with, see
+    // native.c. NULL when there isn't any.
+    void *native;
+    struct native_chunk *native_chunk;
+#ifdef FIBER_PROFILE
+    uint64_t runs; // access atomically
+#endif
 
     unsigned long code[];
 };
@@ -70,5 +180,13 @@ void asbestos_free(struct asbestos *asbestos);
 void asbestos_invalidate_range(struct asbestos *asbestos, page_t start, page_t end);
 void asbestos_invalidate_page(struct asbestos *asbestos, page_t page);
 void asbestos_invalidate_all(struct asbestos *asbestos);
+// Same as asbestos_invalidate_range, for pages that are about to be written
+// to, so anything mmu_ops.protect_code did to them is undone first
+void asbestos_invalidate_write(struct asbestos *asbestos, page_t start, page_t end);
+
+void asbestos_get_reclaim_stats(struct asbestos *asbestos, struct asbestos_reclaim_stats *stats);
+#ifdef FIBER_PROFILE
+void asbestos_get_profile(struct asbestos *asbestos, struct asbestos_profile *profile);
+#endif
 
 #endif
@@ -0,0 +1,563 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if __APPLE__
+#include <dlfcn.h>
+#include <mach-o/getsect.h>
+#endif
+#define DEFAULT_CHANNEL instr
+#include "debug.h"
+#include "asbestos/cache.h"
+#include "asbestos/gen.h"
+#include "util/list.h"
+#include "util/sync.h"
+
+// Translated blocks from read-only pages of files are kept around per page of
+// code, keyed by the file the page was mapped from, the offset in that file,
+// the page it was mapped at (since the code has guest addresses in it), and a
+// hash of the page's contents. Every asbestos with the same page mapped shares
+// the same entry, so a process that runs a binary some other process already
+// ran gets its blocks by copying instead of decoding. Each asbestos only has a
+// reference to the entry, and invalidating the page just drops it, so nobody
+// else is affected. Entries nobody is using are kept around for a while for
+// the next process.
+//
+// This is only done with ish -j, since everything compiled goes through
+// fiber_cache_lock and every file page that gets run is hashed. The entries
+// are also saved there one file per page, in a directory named after a hash
+// of ish's own code, because code[] is full of pointers to gadgets and
+// helpers. Pointers into ish's code are saved relative to where its text
+// starts, and stay that way in memory until a block is copied out, so a file
+// can be mapped and used as is. gen.c keeps track of which words those are as
+// it emits them, since an immediate or other argument could happen to look
+// like one.
+
+#define FIBER_CACHE_MAGIC 0x48435349 // ISCH
+#define FIBER_CACHE_PAGES (1 << 6)
+#define FIBER_CACHE_SHARED_PAGES (1 << 10)
+// how much memory can be used by entries that no asbestos is using
+#define FIBER_CACHE_UNUSED_MAX (16 << 20)
+
+struct fiber_cache_header {
+    uint32_t magic;
+    page_t page;
+    uint64_t hash; // of the page contents
+};
+
+struct fiber_cache_record {
+    addr_t addr;
+    addr_t end_addr;
+    uint32_t size;
+    uint32_t jump_ip[2];
+    uint32_t block_patch_ip;
+    // followed by uint64_t code[size], then a uint64_t bitmap of which words
+    // of code are pointers into ish
+};
+
+// Shared by everyone with the page mapped, protected by fiber_cache_lock
+struct fiber_cache_page {
+    struct mmu_file_page file;
+    page_t page;
+    uint64_t hash;
+    unsigned refcount;
+    bool dirty;
+    // records, in the same format as the file. Points into mapping if the
+    // page was read from a file and nothing has been added since.
+    char *data;
+    size_t size;
+    size_t capacity;
+    void *mapping;
+    size_t mapping_size;
+    // sorted by address
+    struct fiber_cache_index {
+        addr_t addr;
+        uint32_t offset;
+    } *index;
+    unsigned index_size;
+    unsigned index_capacity;
+    struct fiber_cache_page *next;
+    // in fiber_cache_unused if refcount is 0
+    struct list unused;
+};
+
+// A copy of a page's records waiting for fiber_cache_writer, sorted by
+// address so reading them back doesn't need to sort
+struct fiber_cache_pending {
+    struct mmu_file_page file;
+    page_t page;
+    uint64_t hash;
+    char *data;
+    size_t size;
+    struct list queue;
+};
+
+// One asbestos's references to shared pages
+struct fiber_cache_ref {
+    page_t page;
+    // NULL if the page isn't from a file, in which case it's only here so that
+    // isn't checked again
+    struct fiber_cache_page *shared;
+    struct fiber_cache_ref *next;
+};
+
+struct fiber_cache {
+    struct fiber_cache_ref *pages[FIBER_CACHE_PAGES];
+};
+
+extern int current_pid(void);
+
+static char *fiber_cache_dir;
+// ish's code, found by fiber_cache_find_text
+static char *text_start, *text_end;
+
+static lock_t fiber_cache_lock = LOCK_INITIALIZER;
+static struct fiber_cache_page *fiber_cache_shared[FIBER_CACHE_SHARED_PAGES];
+static struct list fiber_cache_unused = {&fiber_cache_unused, &fiber_cache_unused};
+static size_t fiber_cache_unused_size;
+
+// Files are written by their own thread, since pages get released with
+// asbestos->lock and often the mem lock held, and nobody should wait on the
+// disk for that
+static lock_t fiber_cache_write_lock = LOCK_INITIALIZER;
+static cond_t fiber_cache_write_cond = COND_INITIALIZER;
+static struct list fiber_cache_pending = {&fiber_cache_pending, &fiber_cache_pending};
+static bool fiber_cache_writing;
+static void *fiber_cache_writer(void *unused);
+
+static uint64_t fiber_cache_hash(const void *data, size_t size) {
+    // FNV-1a, a word at a time
+    uint64_t hash = 0xcbf29ce484222325;
+    const uint64_t *words = data;
+    for (size_t i = 0; i < size / sizeof(uint64_t); i++)
+        hash = (hash ^ words[i]) * 0x100000001b3;
+    return hash;
+}
+
+#if !__APPLE__
+// defined by ELF linkers
+extern char __executable_start[], etext[];
+#endif
+
+static void fiber_cache_find_text(void) {
+#if __APPLE__
+    // Mach-O linkers don't define anything like etext, so look up the text
+    // section of whichever image this is in
+    Dl_info info;
+    unsigned long size = 0;
+    if (dladdr((void *) fiber_cache_find_text, &info) != 0)
+        text_start = (char *) getsectiondata(info.dli_fbase, "__TEXT", "__text", &size);
+    if (text_start == NULL)
+        die("can't find the __text section");
+    text_end = text_start + size;
+#else
+    text_start = __executable_start;
+    text_end = etext;
+#endif
+}
+
+int fiber_cache_init(const char *dir) {
+    fiber_cache_find_text();
+    uint64_t build = fiber_cache_hash(text_start, (text_end - text_start) & ~7ul);
+    size_t size = strlen(dir) + 18;
+    char *path = malloc(size);
+    if (path == NULL)
+        return -1;
+    snprintf(path, size, "%s/%016llx", dir, (unsigned long long) build);
+    if ((mkdir(dir, 0777) < 0 && errno != EEXIST) || (mkdir(path, 0777) < 0 && errno != EEXIST)) {
+        free(path);
+        return -1;
+    }
+    fiber_cache_dir = path;
+
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, fiber_cache_writer, NULL) != 0)
+        die("could not create jit cache writer thread");
+    pthread_detach(writer);
+    return 0;
+}
+
+bool fiber_cache_enabled(void) {
+    return fiber_cache_dir != NULL;
+}
+
+static size_t fiber_cache_record_size(uint32_t size) {
+    return sizeof(struct fiber_cache_record) + (size + (size + 63) / 64) * sizeof(uint64_t);
+}
+
+// Add where ish starts to every pointer into ish in a block copied from a
+// record
+static void fiber_cache_relocate(struct fiber_block *block, struct fiber_cache_record *record) {
+    uint64_t *relocs = (uint64_t *) (record + 1) + record->size;
+    for (uint32_t i = 0; i < (record->size + 63) / 64; i++) {
+        for (uint64_t bits = relocs[i]; bits != 0; bits &= bits - 1)
+            block->code[i * 64 + __builtin_ctzll(bits)] += (unsigned long) text_start;
+    }
+}
+
+static void fiber_cache_path(struct mmu_file_page *file, page_t page, char *path, size_t size) {
+    snprintf(path, size, "%s/%016llx-%llx-%05x", fiber_cache_dir,
+            (unsigned long long) file->file, (unsigned long long) file->offset, page);
+}
+
+static int fiber_cache_index_compare(const void *a, const void *b) {
+    addr_t x = ((const struct fiber_cache_index *) a)->addr;
+    addr_t y = ((const struct fiber_cache_index *) b)->addr;
+    return x < y ? -1 : x > y;
+}
+
+static struct fiber_cache_index *fiber_cache_find(struct fiber_cache_page *entry, addr_t addr) {
+    struct fiber_cache_index key = {.addr = addr};
+    return bsearch(&key, entry->index, entry->index_size, sizeof(*entry->index), fiber_cache_index_compare);
+}
+
+static bool fiber_cache_index_reserve(struct fiber_cache_page *entry) {
+    if (entry->index_size < entry->index_capacity)
+        return true;
+    unsigned capacity = entry->index_capacity ? entry->index_capacity * 2 : 64;
+    struct fiber_cache_index *index = realloc(entry->index, capacity * sizeof(*index));
+    if (index == NULL)
+        return false;
+    entry->index = index;
+    entry->index_capacity = capacity;
+    return true;
+}
+
+// Check the records and sort them. Anything after a record that doesn't make
+// sense is dropped.
+static void fiber_cache_index(struct fiber_cache_page *entry) {
+    bool sorted = true;
+    size_t offset = 0;
+    while (offset + sizeof(struct fiber_cache_record) <= entry->size) {
+        struct fiber_cache_record *record = (void *) (entry->data + offset);
+        if (record->size == 0 || record->size > entry->size ||
+                offset + fiber_cache_record_size(record->size) > entry->size ||
+                PAGE(record->addr) != entry->page || PAGE(record->end_addr) != entry->page ||
+                record->end_addr < record->addr ||
+                record->jump_ip[0] >= record->size || record->jump_ip[1] >= record->size ||
+                record->block_patch_ip >= record->size)
+            break;
+        if (!fiber_cache_index_reserve(entry))
+            break;
+        if (entry->index_size > 0 && entry->index[entry->index_size - 1].addr > record->addr)
+            sorted = false;
+        entry->index[entry->index_size++] = (struct fiber_cache_index) {record->addr, offset};
+        offset += fiber_cache_record_size(record->size);
+    }
+    entry->size = offset;
+    if (!sorted)
+        qsort(entry->index, entry->index_size, sizeof(*entry->index), fiber_cache_index_compare);
+}
+
+static void fiber_cache_read(struct fiber_cache_page *entry) {
+    char path[4096];
+    fiber_cache_path(&entry->file, entry->page, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) < 0 || statbuf.st_size < (off_t) sizeof(struct fiber_cache_header))
+        goto out;
+    void *mapping = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED)
+        goto out;
+    struct fiber_cache_header *header = mapping;
+    if (header->magic != FIBER_CACHE_MAGIC || header->page != entry->page || header->hash != entry->hash) {
+        munmap(mapping, statbuf.st_size);
+        goto out;
+    }
+    entry->mapping = mapping;
+    entry->mapping_size = statbuf.st_size;
+    entry->data = (char *) (header + 1);
+    entry->size = statbuf.st_size - sizeof(*header);
+    fiber_cache_index(entry);
+out:
+    close(fd);
+}
+
+static void fiber_cache_write(struct fiber_cache_pending *pending) {
+    char path[4096];
+    fiber_cache_path(&pending->file, pending->page, path, sizeof(path));
+    // write somewhere else and rename, so nobody ever reads half a file
+    char tmp_path[4096 + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+    int fd = mkstemp(tmp_path);
+    if (fd < 0)
+        return;
+    struct fiber_cache_header header = {
+        .magic = FIBER_CACHE_MAGIC,
+        .page = pending->page,
+        .hash = pending->hash,
+    };
+    bool ok = write(fd, &header, sizeof(header)) == sizeof(header) &&
+        write(fd, pending->data, pending->size) == (ssize_t) pending->size;
+    close(fd);
+    if (!ok || rename(tmp_path, path) < 0)
+        unlink(tmp_path);
+}
+
+static void *fiber_cache_writer(void *unused) {
+    lock(&fiber_cache_write_lock);
+    for (;;) {
+        while (list_empty(&fiber_cache_pending))
+            wait_for_ignore_signals(&fiber_cache_write_cond, &fiber_cache_write_lock, NULL);
+        struct fiber_cache_pending *pending = list_first_entry(&fiber_cache_pending, struct fiber_cache_pending, queue);
+        list_remove(&pending->queue);
+        fiber_cache_writing = true;
+        unlock(&fiber_cache_write_lock);
+        fiber_cache_write(pending);
+        free(pending->data);
+        free(pending);
+        lock(&fiber_cache_write_lock);
+        fiber_cache_writing = false;
+        notify(&fiber_cache_write_cond);
+    }
+    return NULL;
+}
+
+// Must be called with fiber_cache_lock
+static void fiber_cache_queue_write(struct fiber_cache_page *entry) {
+    struct fiber_cache_pending *pending = malloc(sizeof(*pending));
+    if (pending == NULL)
+        return;
+    pending->data = malloc(entry->size);
+    if (pending->data == NULL) {
+        free(pending);
+        return;
+    }
+    pending->file = entry->file;
+    pending->page = entry->page;
+    pending->hash = entry->hash;
+    pending->size = 0;
+    for (unsigned i = 0; i < entry->index_size; i++) {
+        struct fiber_cache_record *record = (void *) (entry->data + entry->index[i].offset);
+        size_t record_size = fiber_cache_record_size(record->size);
+        memcpy(pending->data + pending->size, record, record_size);
+        pending->size += record_size;
+    }
+    lock(&fiber_cache_write_lock);
+    list_add_tail(&fiber_cache_pending, &pending->queue);
+    notify(&fiber_cache_write_cond);
+    unlock(&fiber_cache_write_lock);
+}
+
+void fiber_cache_sync(void) {
+    if (!fiber_cache_enabled())
+        return;
+    lock(&fiber_cache_write_lock);
+    while (!list_empty(&fiber_cache_pending) || fiber_cache_writing)
+        wait_for_ignore_signals(&fiber_cache_write_cond, &fiber_cache_write_lock, NULL);
+    unlock(&fiber_cache_write_lock);
+}
+
+static size_t fiber_cache_shared_hash(struct mmu_file_page *file, page_t page, uint64_t hash) {
+    return (file->file ^ file->offset ^ page ^ hash) % FIBER_CACHE_SHARED_PAGES;
+}
+
+static size_t fiber_cache_page_memory(struct fiber_cache_page *entry) {
+    return sizeof(*entry) + entry->capacity + entry->mapping_size + entry->index_capacity * sizeof(*entry->index);
+}
+
+static void fiber_cache_page_free(struct fiber_cache_page *entry) {
+    struct fiber_cache_page **link = &fiber_cache_shared[fiber_cache_shared_hash(&entry->file, entry->page, entry->hash)];
+    while (*link != entry)
+        link = &(*link)->next;
+    *link = entry->next;
+    free(entry->index);
+    if (entry->mapping != NULL)
+        munmap(entry->mapping, entry->mapping_size);
+    else
+        free(entry->data);
+    free(entry);
+}
+
+// Find or create the shared entry for a page, with a new reference
+static struct fiber_cache_page *fiber_cache_page_get(struct mmu_file_page *file, page_t page) {
+    uint64_t hash = fiber_cache_hash(file->data, PAGE_SIZE);
+    struct fiber_cache_page **bucket = &fiber_cache_shared[fiber_cache_shared_hash(file, page, hash)];
+    for (struct fiber_cache_page *entry = *bucket; entry != NULL; entry = entry->next) {
+        if (entry->page == page && entry->hash == hash &&
+                entry->file.file == file->file && entry->file.offset == file->offset) {
+            if (entry->refcount++ == 0) {
+                list_remove(&entry->unused);
+                fiber_cache_unused_size -= fiber_cache_page_memory(entry);
+            }
+            return entry;
+        }
+    }
+
+    struct fiber_cache_page *entry = calloc(1, sizeof(*entry));
+    if (entry == NULL)
+        return NULL;
+    entry->file = *file;
+    entry->file.data = NULL; // only good as long as it's mapped
+    entry->page = page;
+    entry->hash = hash;
+    entry->refcount = 1;
+    fiber_cache_read(entry);
+    entry->next = *bucket;
+    *bucket = entry;
+    return entry;
+}
+
+static void fiber_cache_page_release(struct fiber_cache_page *entry) {
+    if (--entry->refcount > 0)
+        return;
+    if (entry->dirty)
+        fiber_cache_queue_write(entry);
+    entry->dirty = false;
+    list_add(&fiber_cache_unused, &entry->unused);
+    fiber_cache_unused_size += fiber_cache_page_memory(entry);
+    // throw out whatever was used longest ago
+    while (fiber_cache_unused_size > FIBER_CACHE_UNUSED_MAX) {
+        struct fiber_cache_page *oldest = list_entry(fiber_cache_unused.prev, struct fiber_cache_page, unused);
+        list_remove(&oldest->unused);
+        fiber_cache_unused_size -= fiber_cache_page_memory(oldest);
+        fiber_cache_page_free(oldest);
+    }
+}
+
+static struct fiber_cache_page *fiber_cache_page(struct asbestos *asbestos, page_t page) {
+    if (asbestos->cache == NULL) {
+        asbestos->cache = calloc(1, sizeof(struct fiber_cache));
+        if (asbestos->cache == NULL)
+            return NULL;
+    }
+    struct fiber_cache_ref **bucket = &asbestos->cache->pages[page % FIBER_CACHE_PAGES];
+    for (struct fiber_cache_ref *ref = *bucket; ref != NULL; ref = ref->next) {
+        if (ref->page == page)
+            return ref->shared;
+    }
+
+    struct fiber_cache_ref *ref = calloc(1, sizeof(*ref));
+    if (ref == NULL)
+        return NULL;
+    ref->page = page;
+    struct mmu *mmu = asbestos->mmu;
+    struct mmu_file_page file;
+    if (mmu->ops->file_page != NULL && mmu->ops->file_page(mmu, page, &file))
+        ref->shared = fiber_cache_page_get(&file, page);
+    ref->next = *bucket;
+    *bucket = ref;
+    return ref->shared;
+}
+
+struct fiber_block *fiber_cache_load(struct asbestos *asbestos, addr_t ip) {
+    if (fiber_cache_dir == NULL)
+        return NULL;
+    struct fiber_block *block = NULL;
+    lock(&fiber_cache_lock);
+    struct fiber_cache_page *entry = fiber_cache_page(asbestos, PAGE(ip));
+    if (entry == NULL)
+        goto out;
+    struct fiber_cache_index *found = fiber_cache_find(entry, ip);
+    if (found == NULL)
+        goto out;
+    struct fiber_cache_record *record = (void *) (entry->data + found->offset);
+    block = gen_copy(record->addr, record->end_addr, (unsigned long *) (record + 1), record->size,
+            record->jump_ip, record->block_patch_ip);
+    fiber_cache_relocate(block, record);
+    TRACE("%d %08x --- loaded from cache\n", current_pid(), ip);
+out:
+    unlock(&fiber_cache_lock);
+    return block;
+}
+
+void fiber_cache_store(struct asbestos *asbestos, struct fiber_block *block, const bool *host_pointer) {
+    if (fiber_cache_dir == NULL || block->is_trace || PAGE(block->addr) != PAGE(block->end_addr))
+        return;
+    lock(&fiber_cache_lock);
+    struct fiber_cache_page *entry = fiber_cache_page(asbestos, PAGE(block->addr));
+    // another process could have compiled the same block since this one
+    // missed
+    if (entry == NULL || fiber_cache_find(entry, block->addr) != NULL)
+        goto out;
+    if (!fiber_cache_index_reserve(entry))
+        goto out;
+
+    size_t size = block->size;
+    size_t record_size = fiber_cache_record_size(size);
+    if (entry->size + record_size > entry->capacity) {
+        size_t capacity = entry->capacity ? entry->capacity : 1024;
+        while (entry->size + record_size > capacity)
+            capacity *= 2;
+        // a mapped file can't grow, so it gets copied the first time
+        char *data = entry->mapping != NULL ? malloc(capacity) : realloc(entry->data, capacity);
+        if (data == NULL)
+            goto out;
+        if (entry->mapping != NULL) {
+            memcpy(data, entry->data, entry->size);
+            munmap(entry->mapping, entry->mapping_size);
+            entry->mapping = NULL;
+            entry->mapping_size = 0;
+        }
+        entry->data = data;
+        entry->capacity = capacity;
+    }
+
+    struct fiber_cache_record *record = (void *) (entry->data + entry->size);
+    memset(record, 0, record_size);
+    record->addr = block->addr;
+    record->end_addr = block->end_addr;
+    record->size = size;
+    for (int i = 0; i <= 1; i++) {
+        if (block->jump_ip[i] != NULL)
+            record->jump_ip[i] = block->jump_ip[i] - block->code;
+    }
+    uint64_t *code = (uint64_t *) (record + 1);
+    uint64_t *relocs = code + size;
+    for (size_t i = 0; i < size; i++) {
+        unsigned long word = block->code[i];
+        if (word == (unsigned long) block)
+            record->block_patch_ip = i;
+        else if (host_pointer[i]) {
+            relocs[i / 64] |= 1ull << (i % 64);
+            word -= (unsigned long) text_start;
+        }
+        code[i] = word;
+    }
+
+    // keep the index sorted
+    unsigned i = entry->index_size;
+    while (i > 0 && entry->index[i - 1].addr > block->addr)
+        i--;
+    memmove(&entry->index[i + 1], &entry->index[i], (entry->index_size - i) * sizeof(*entry->index));
+    entry->index[i] = (struct fiber_cache_index) {block->addr, entry->size};
+    entry->index_size++;
+    entry->size += record_size;
+    entry->dirty = true;
+out:
+    unlock(&fiber_cache_lock);
+}
+
+void fiber_cache_invalidate(struct asbestos *asbestos, page_t start, page_t end) {
+    if (asbestos->cache == NULL)
+        return;
+    lock(&fiber_cache_lock);
+    for (int i = 0; i < FIBER_CACHE_PAGES; i++) {
+        struct fiber_cache_ref **link = &asbestos->cache->pages[i];
+        while (*link != NULL) {
+            struct fiber_cache_ref *ref = *link;
+            if (ref->page >= start && ref->page < end) {
+                *link = ref->next;
+                if (ref->shared != NULL)
+                    fiber_cache_page_release(ref->shared);
+                free(ref);
+            } else {
+                link = &ref->next;
+            }
+        }
+    }
+    unlock(&fiber_cache_lock);
+}
+
+void fiber_cache_free(struct asbestos *asbestos) {
+    fiber_cache_invalidate(asbestos, 0, MEM_PAGES);
+    free(asbestos->cache);
+    asbestos->cache = NULL;
+}
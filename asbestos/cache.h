@@ -0,0 +1,30 @@
+#ifndef ASBESTOS_CACHE_H
+#define ASBESTOS_CACHE_H
+#include "asbestos/asbestos.h"
+
+// Cache of translated blocks from file-backed code shared between processes,
+// and saved to disk, so short lived processes don't have to decode the same
+// binaries over and over. Off unless fiber_cache_init is called (ish -j), in
+// which case load and store do nothing. Everything else must be called with
+// asbestos->lock.
+
+// Returns -1 and sets errno if the directory can't be used. Must be called
+// before anything runs.
+int fiber_cache_init(const char *dir);
+
+// Whether fiber_cache_init was called
+bool fiber_cache_enabled(void);
+// Wait for everything that's been released so far to be saved
+void fiber_cache_sync(void);
+
+// A block previously compiled at ip by this build of ish from the same bytes,
+// or NULL
+struct fiber_block *fiber_cache_load(struct asbestos *asbestos, addr_t ip);
+// Remember a block that was just compiled, before anything is chained to it.
+// host_pointer is gen_state.host_pointer.
+void fiber_cache_store(struct asbestos *asbestos, struct fiber_block *block, const bool *host_pointer);
+// Stop using pages start (inclusive) to end (exclusive)
+void fiber_cache_invalidate(struct asbestos *asbestos, page_t start, page_t end);
+void fiber_cache_free(struct asbestos *asbestos);
+
+#endif
@@ -0,0 +1,53 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <ucontext.h>
+#include "asbestos/flat.h"
+#include "emu/tlb.h"
+
+// With flat memory, read_prep and write_prep don't check anything, so an
+// access the guest isn't allowed to make faults on the host instead. If it
+// came from a gadget, every gadget register is still intact, so this can
+// pretend it was a TLB miss on an unmapped page by jumping to the same code
+// the miss handler jumps to.
+
+extern char __start_fiber_gadgets[], __stop_fiber_gadgets[];
+extern void fiber_segfault_read(void);
+extern void fiber_segfault_write(void);
+
+static struct sigaction fiber_old_segv;
+
+static void fiber_segv(int sig, siginfo_t *info, void *context) {
+    greg_t *regs = ((ucontext_t *) context)->uc_mcontext.gregs;
+    char *rip = (char *) regs[REG_RIP];
+    if (rip >= __start_fiber_gadgets && rip < __stop_fiber_gadgets) {
+        // _tlb is r12 and points to tlb->entries
+        struct tlb *tlb = (struct tlb *) (regs[REG_R12] - offsetof(struct tlb, entries));
+        uintptr_t addr = (char *) info->si_addr - tlb->flat;
+        if (addr < (1ull << 32)) {
+            tlb->segfault_addr = addr;
+            // bit 1 of the page fault error code is set for writes
+            regs[REG_RIP] = (greg_t) (regs[REG_ERR] & 2 ? fiber_segfault_write : fiber_segfault_read);
+            return;
+        }
+    }
+    // a real crash, so let whatever was there before have it when the
+    // instruction faults again
+    sigaction(SIGSEGV, &fiber_old_segv, NULL);
+}
+
+static void fiber_flat_install(void) {
+    struct sigaction action = {
+        .sa_sigaction = fiber_segv,
+        .sa_flags = SA_SIGINFO | SA_NODEFER,
+    };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &fiber_old_segv);
+}
+
+void fiber_flat_init(void) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, fiber_flat_install);
+}
@@ -0,0 +1,12 @@
+#ifndef ASBESTOS_FLAT_H
+#define ASBESTOS_FLAT_H
+
+#if MEM_FLAT
+// Catch host faults on flat guest memory coming from gadgets and turn them
+// into guest page faults. Safe to call more than once.
+void fiber_flat_init(void);
+#else
+static inline void fiber_flat_init(void) {}
+#endif
+
+#endif
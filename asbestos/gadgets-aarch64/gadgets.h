@@ -39,13 +39,19 @@ _xaddr .req x3
 .irp type, read,write
 
 .macro \type\()_prep size, id
+#ifdef FIBER_PROFILE
+    ldr x8, [_tlb, (-TLB_entries+TLB_stats_accesses)]
+    add x8, x8, 1
+    str x8, [_tlb, (-TLB_entries+TLB_stats_accesses)]
+#endif
     and w8, _addr, 0xfff
     cmp x8, (0x1000-(\size/8))
     b.hi crosspage_load_\id
     and w8, _addr, 0xfffff000
     str w8, [_tlb, (-TLB_entries+TLB_dirty_page)]
-    ubfx x9, _xaddr, 12, 10
-    eor x9, x9, _xaddr, lsr 22
+    lsr x9, _xaddr, 12
+    eor x9, x9, _xaddr, lsr (12 + TLB_BITS)
+    and x9, x9, ((1 << TLB_BITS) - 1)
     lsl x9, x9, 4
     add x9, x9, _tlb
     .ifc \type,read
@@ -17,6 +17,11 @@
 
 .extern fiber_exit
 
+#if MEM_FLAT
+# so fiber_segv can tell when a fault came from a gadget
+.section fiber_gadgets,"ax",@progbits
+#endif
+
 .macro .gadget name
     .global.name gadget_\()\name
 .endm
@@ -26,15 +31,42 @@
 .endm
 
 # memory reading and writing
+#if MEM_FLAT
+# Guest memory is all at tlb->flat plus its address, and anything that isn't
+# allowed faults on the host, which fiber_segv turns back into a jump to
+# fiber_segfault_read or fiber_segfault_write. So there's nothing to check,
+# and accesses that cross a page are just contiguous. Gadgets that hand
+# _addrq to a C helper have to probe it first, since a fault in C code can't
+# be recovered from.
+.macro read_prep size, id
+    addq -TLB_entries+TLB_flat(%_tlb), %_addrq
+.endm
+.macro write_prep size, id
+    addq -TLB_entries+TLB_flat(%_tlb), %_addrq
+.endm
+.macro write_done size, id
+.endm
+.macro read_probe size
+    movb (%_addrq), %r14b
+    movb ((\size/8)-1)(%_addrq), %r14b
+.endm
+.macro write_probe size
+    lock orb $0, (%_addrq)
+    lock orb $0, ((\size/8)-1)(%_addrq)
+.endm
+#else
 .irp type, read,write
 
 .macro \type\()_prep size, id
+#ifdef FIBER_PROFILE
+    incq -TLB_entries+TLB_stats_accesses(%_tlb)
+#endif
     movl %_addr, %r14d
     shrl $12, %r14d
-    andl $0x3ff, %r14d
     movl %_addr, %r15d
-    shrl $22, %r15d
+    shrl $(12 + TLB_BITS), %r15d
     xor %r15d, %r14d
+    andl $((1 << TLB_BITS) - 1), %r14d
     shll $4, %r14d
     movl %_addr, %r15d
     andl $0xfff, %r15d
@@ -76,6 +108,11 @@ crosspage_store_\id :
     jmp back_write_done_\id
 .popsection
 .endm
+.macro read_probe size
+.endm
+.macro write_probe size
+.endm
+#endif
 
 .macro _invoke size, reg, post, macro:vararg
     .if \size == 32
@@ -1,6 +1,8 @@
 #include <assert.h>
 #include <stdint.h>
+#include <string.h>
 #include "asbestos/gen.h"
+#include "asbestos/native.h"
 #include "emu/modrm.h"
 #include "emu/cpuid.h"
 #include "emu/fpu.h"
@@ -10,10 +12,28 @@
 static int gen_step32(struct gen_state *state, struct tlb *tlb);
 static int gen_step16(struct gen_state *state, struct tlb *tlb);
 
+static void gen_flags_step(struct gen_state *state);
+
 int gen_step(struct gen_state *state, struct tlb *tlb) {
     state->orig_ip = state->ip;
     state->orig_ip_extra = 0;
-    return gen_step32(state, tlb);
+    state->insn_flags_ip = 0;
+    state->insn_flags_neutral = false;
+    state->insn_mem = false;
+    state->insn_fuse = NULL;
+#if ENGINE_ASBESTOS_NATIVE
+    if (state->trace && state->gadget_start == NULL)
+        state->gadget_start = calloc(state->capacity, sizeof(bool));
+#endif
+    int ok = gen_step32(state, tlb);
+    gen_flags_step(state);
+    state->fuse_ip = 0;
+    if (state->insn_fuse != NULL && !state->insn_mem && state->insn_flags_ip != 0) {
+        state->fuse_gadgets = state->insn_fuse;
+        state->fuse_ip = state->insn_flags_ip;
+        state->fuse_arg = state->insn_flags_arg;
+    }
+    return ok;
 }
 
 static void gen(struct gen_state *state, unsigned long thing) {
@@ -26,27 +46,86 @@ static void gen(struct gen_state *state, unsigned long thing) {
             die("out of memory while carcinizing");
         }
         state->block = bigger_block;
+        if (state->gadget_start != NULL) {
+            bool *bigger_map = realloc(state->gadget_start, state->capacity * sizeof(bool));
+            if (bigger_map == NULL) {
+                die("out of memory while carcinizing");
+            }
+            memset(bigger_map + state->size, 0, (state->capacity - state->size) * sizeof(bool));
+            state->gadget_start = bigger_map;
+        }
+        if (state->host_pointer != NULL) {
+            bool *bigger_map = realloc(state->host_pointer, state->capacity * sizeof(bool));
+            if (bigger_map == NULL) {
+                die("out of memory while carcinizing");
+            }
+            memset(bigger_map + state->size, 0, (state->capacity - state->size) * sizeof(bool));
+            state->host_pointer = bigger_map;
+        }
     }
     assert(state->size < state->capacity);
     state->block->code[state->size++] = thing;
 }
 
-void gen_start(addr_t addr, struct gen_state *state) {
-    state->capacity = FIBER_BLOCK_INITIAL_CAPACITY;
+// a pointer to a helper, or a gadget that isn't being called
+static void gen_host(struct gen_state *state, unsigned long pointer) {
+    gen(state, pointer);
+    if (state->host_pointer != NULL)
+        state->host_pointer[state->size - 1] = true;
+}
+
+static void gen_gadget(struct gen_state *state, unsigned long gadget) {
+    gen_host(state, gadget);
+    if (state->gadget_start != NULL)
+        state->gadget_start[state->size - 1] = true;
+}
+
+static void gen_init(addr_t addr, struct gen_state *state, unsigned capacity) {
+    state->capacity = capacity;
     state->size = 0;
     state->ip = addr;
     for (int i = 0; i <= 1; i++) {
         state->jump_ip[i] = 0;
     }
     state->block_patch_ip = 0;
+    state->trace = false;
+    state->trace_branches = 0;
+    state->side_exits = 0;
+    state->max_ip = addr;
+    state->flags_ip = 0;
+    state->fuse_ip = 0;
+    state->store_end = 0;
+    state->gadget_start = NULL;
+    state->host_pointer = NULL;
 
     struct fiber_block *block = malloc(sizeof(struct fiber_block) + state->capacity * sizeof(unsigned long));
     state->block = block;
     block->addr = addr;
 }
 
+void gen_start(addr_t addr, struct gen_state *state) {
+    gen_init(addr, state, FIBER_BLOCK_INITIAL_CAPACITY);
+}
+
 void gen_end(struct gen_state *state) {
+    if (state->side_exits != 0) {
+        struct fiber_block *bigger_block = realloc(state->block, sizeof(struct fiber_block) +
+                state->size * sizeof(unsigned long) + state->side_exits * sizeof(struct fiber_exit));
+        if (bigger_block == NULL)
+            die("out of memory while carcinizing");
+        state->block = bigger_block;
+    }
     struct fiber_block *block = state->block;
+    block->size = state->size;
+    block->side_exits = (struct fiber_exit *) &block->code[state->size];
+    block->side_exits_count = state->side_exits;
+    for (unsigned i = 0; i < state->side_exits; i++) {
+        struct fiber_exit *exit = &block->side_exits[i];
+        exit->jump_ip = &block->code[state->side_exit_ip[i]];
+        exit->old_jump_ip = *exit->jump_ip;
+        list_init(&exit->link);
+    }
+    list_init(&block->jumps_from_side);
     for (int i = 0; i <= 1; i++) {
         if (state->jump_ip[i] != 0) {
             block->jump_ip[i] = &block->code[state->jump_ip[i]];
@@ -61,21 +140,49 @@ void gen_end(struct gen_state *state) {
     if (state->block_patch_ip != 0) {
         block->code[state->block_patch_ip] = (unsigned long) block;
     }
-    if (block->addr != state->ip)
-        block->end_addr = state->ip - 1;
+    addr_t end_ip = state->ip > state->max_ip ? state->ip : state->max_ip;
+    if (block->addr != end_ip)
+        block->end_addr = end_ip - 1;
     else
         block->end_addr = block->addr;
-    list_init(&block->chain);
+    block->chain = NULL;
     block->is_jetsam = false;
+    block->is_trace = state->trace;
+    block->hot_count = FIBER_TRACE_THRESHOLD;
+#ifdef FIBER_PROFILE
+    block->runs = 0;
+#endif
     for (int i = 0; i <= 1; i++) {
         list_init(&block->page[i]);
     }
+    block->native = NULL;
+    block->native_chunk = NULL;
+    if (state->gadget_start != NULL) {
+        native_compile(block, state->size, state->gadget_start);
+        free(state->gadget_start);
+        state->gadget_start = NULL;
+    }
+}
+
+struct fiber_block *gen_copy(addr_t addr, addr_t end_addr, const unsigned long *code, unsigned size,
+        const unsigned jump_ip[2], unsigned block_patch_ip) {
+    struct gen_state state;
+    gen_init(addr, &state, size);
+    memcpy(state.block->code, code, size * sizeof(unsigned long));
+    state.size = size;
+    for (int i = 0; i <= 1; i++)
+        state.jump_ip[i] = jump_ip[i];
+    state.block_patch_ip = block_patch_ip;
+    state.ip = state.max_ip = end_addr + 1;
+    gen_end(&state);
+    state.block->used = state.capacity;
+    return state.block;
 }
 
 void gen_exit(struct gen_state *state) {
     extern void gadget_exit(void);
     // in case the last instruction didn't end the block
-    gen(state, (unsigned long) gadget_exit);
+    gen_gadget(state, (unsigned long) gadget_exit);
     gen(state, state->ip);
 }
 
@@ -97,24 +204,6 @@ void gen_exit(struct gen_state *state) {
 #define READADDR _READIMM(addr_offset, 32)
 #define SEG_GS() seg_gs = true
 
-// This should stay in sync with the definition of .gadget_array in gadgets.h
-enum arg {
-    arg_reg_a, arg_reg_c, arg_reg_d, arg_reg_b, arg_reg_sp, arg_reg_bp, arg_reg_si, arg_reg_di,
-    arg_imm, arg_mem, arg_addr, arg_gs,
-    arg_count, arg_invalid,
-    // the following should not be synced with the list mentioned above (no gadgets implement them)
-    arg_modrm_val, arg_modrm_reg,
-    arg_xmm_modrm_val, arg_xmm_modrm_reg,
-    arg_mm_modrm_val, arg_mm_modrm_reg,
-    arg_mem_addr, arg_1,
-};
-
-enum size {
-    size_8, size_16, size_32,
-    size_count,
-    size_64, size_80, size_128, // bonus sizes
-};
-
 // sync with COND_LIST in control.S
 enum cond {
     cond_O, cond_B, cond_E, cond_BE, cond_S, cond_P, cond_L, cond_LE,
@@ -130,21 +219,23 @@ enum repeat {
 typedef void (*gadget_t)(void);
 
 #define GEN(thing) gen(state, (unsigned long) (thing))
-#define g(g) do { extern void gadget_##g(void); GEN(gadget_##g); } while (0)
+#define GEN_GADGET(gadget) gen_gadget(state, (unsigned long) (gadget))
+#define GEN_HOST(pointer) gen_host(state, (unsigned long) (pointer))
+#define g(g) do { extern void gadget_##g(void); GEN_GADGET(gadget_##g); } while (0)
 #define gg(_g, a) do { g(_g); GEN(a); } while (0)
 #define ggg(_g, a, b) do { g(_g); GEN(a); GEN(b); } while (0)
 #define gggg(_g, a, b, c) do { g(_g); GEN(a); GEN(b); GEN(c); } while (0)
 #define ggggg(_g, a, b, c, d) do { g(_g); GEN(a); GEN(b); GEN(c); GEN(d); } while (0)
 #define gggggg(_g, a, b, c, d, e) do { g(_g); GEN(a); GEN(b); GEN(c); GEN(d); GEN(e); } while (0)
-#define ga(g, i) do { extern gadget_t g##_gadgets[]; if (g##_gadgets[i] == NULL) UNDEFINED; GEN(g##_gadgets[i]); } while (0)
+#define ga(g, i) do { extern gadget_t g##_gadgets[]; if (g##_gadgets[i] == NULL) UNDEFINED; GEN_GADGET(g##_gadgets[i]); } while (0)
 #define gag(g, i, a) do { ga(g, i); GEN(a); } while (0)
 #define gagg(g, i, a, b) do { ga(g, i); GEN(a); GEN(b); } while (0)
 #define gz(g, z) ga(g, sz(z))
-#define h(h) gg(helper_0, h)
-#define hh(h, a) ggg(helper_1, h, a)
-#define hhh(h, a, b) gggg(helper_2, h, a, b)
-#define h_read(h, z) do { g_addr(); ggg(helper_read##z, state->orig_ip, h##z); } while (0)
-#define h_write(h, z) do { g_addr(); ggg(helper_write##z, state->orig_ip, h##z); } while (0)
+#define h(h) do { g(helper_0); GEN_HOST(h); } while (0)
+#define hh(h, a) do { g(helper_1); GEN_HOST(h); GEN(a); } while (0)
+#define hhh(h, a, b) do { g(helper_2); GEN_HOST(h); GEN(a); GEN(b); } while (0)
+#define h_read(h, z) do { g_addr(); gg(helper_read##z, state->orig_ip); GEN_HOST(h##z); } while (0)
+#define h_write(h, z) do { g_addr(); gg(helper_write##z, state->orig_ip); GEN_HOST(h##z); } while (0)
 #define UNDEFINED do { gggg(interrupt, INT_UNDEFINED, state->orig_ip, state->orig_ip); return false; } while (0)
 #define SEGFAULT do { gggg(interrupt, INT_GPF, state->orig_ip, tlb->segfault_addr); return false; } while (0)
 
@@ -201,11 +292,28 @@ static inline bool gen_op(struct gen_state *state, gadget_t *gadgets, enum arg a
     if (arg >= arg_count || gadgets[arg] == NULL) {
         UNDEFINED;
     }
+    // Storing a register leaves the value in _tmp, so loading the same
+    // register right after doesn't have to do anything. This catches a mov
+    // between registers and an op on the result, or the other way around.
+    extern gadget_t load_gadgets[], store_gadgets[];
+    if (size == size_32 && arg <= arg_reg_di) {
+        if (gadgets == load_gadgets + size_32 * arg_count && state->store_end != 0 &&
+                state->store_end == state->size && state->store_arg == arg)
+            return true;
+        if (gadgets == store_gadgets + size_32 * arg_count) {
+            GEN_GADGET(gadgets[arg]);
+            state->store_end = state->size;
+            state->store_arg = arg;
+            return true;
+        }
+    }
     if (arg == arg_mem || arg == arg_addr) {
         if (!gen_addr(state, modrm, seg_gs))
             return false;
     }
-    GEN(gadgets[arg]);
+    if (arg == arg_mem)
+        state->insn_mem = true;
+    GEN_GADGET(gadgets[arg]);
     if (arg == arg_imm)
         GEN(*imm);
     else if (arg == arg_mem)
@@ -217,27 +325,95 @@ static inline bool gen_op(struct gen_state *state, gadget_t *gadgets, enum arg a
     if (!gen_op(state, type##_gadgets, arg_##thing, &modrm, &imm, z, seg_gs, addr_offset)) return false; \
 } while (0)
 
+// Operations that set every flag go through here, so the flag updates can be
+// taken out again if the next one overwrites them. The gadget is found by
+// looking it up in the array for the size, since gen_op decides which one.
+// Only x86_64 has the noflags_ and fused_ gadgets so far, so elsewhere this
+// never happens and cmp/test never get fused either.
+#if defined(__x86_64__)
+static void gen_flags_set(struct gen_state *state, unsigned ip, gadget_t *gadgets, gadget_t *noflags) {
+    if (ip >= state->size)
+        return;
+    for (int arg = 0; arg < arg_count; arg++) {
+        if (gadgets[arg] != NULL && (unsigned long) gadgets[arg] == state->block->code[ip]) {
+            if (noflags[arg] != NULL) {
+                state->insn_flags_ip = ip;
+                state->insn_flags_arg = arg;
+                state->insn_noflags = (unsigned long) noflags[arg];
+            }
+            return;
+        }
+    }
+}
+#endif
+
+// Called after each instruction. If an instruction sets all the flags and
+// the last one to set them did nothing but neutral things in between, the
+// last one's flags are dead, so swap in its noflags_ gadget. Anything touching
+// memory stops this, since a fault there has to see the flags as they were.
+// Everything that isn't known to leave the flags alone, including the end of
+// the block, counts as reading them.
+static void gen_flags_step(struct gen_state *state) {
+    if (state->insn_mem) {
+        state->flags_ip = 0;
+        return;
+    }
+    if (state->insn_flags_ip != 0) {
+        if (state->flags_ip != 0)
+            state->block->code[state->flags_ip] = state->flags_noflags;
+        state->flags_ip = state->insn_flags_ip;
+        state->flags_noflags = state->insn_noflags;
+    } else if (!state->insn_flags_neutral) {
+        state->flags_ip = 0;
+    }
+}
+
 #define load(thing, z) op(load, thing, z)
 #define store(thing, z) op(store, thing, z)
 // load-op-store
 #define los(o, src, dst, z) load(dst, z); op(o, src, z); store(dst, z)
 #define lo(o, src, dst, z) load(dst, z); op(o, src, z)
-
-#define MOV(src, dst,z) load(src, z); store(dst, z)
-#define MOVZX(src, dst,zs,zd) load(src, zs); gz(zero_extend, zs); store(dst, zd)
-#define MOVSX(src, dst,zs,zd) load(src, zs); gz(sign_extend, zs); store(dst, zd)
+// same, for operations that set all the flags and have noflags_ versions
+#if defined(__x86_64__)
+#define opf(type, thing, z) do { \
+    extern gadget_t type##_gadgets[], noflags_##type##_gadgets[]; \
+    unsigned op_ip = state->size; \
+    op(type, thing, z); \
+    gen_flags_set(state, op_ip, type##_gadgets + sz(z) * arg_count, noflags_##type##_gadgets + sz(z) * arg_count); \
+} while (0)
+#else
+#define opf(type, thing, z) op(type, thing, z)
+#endif
+#define losf(o, src, dst, z) load(dst, z); opf(o, src, z); store(dst, z)
+#define lof(o, src, dst, z) load(dst, z); opf(o, src, z)
+// for instructions that don't touch the flags
+#define FLAGS_NEUTRAL state->insn_flags_neutral = true
+
+#define MOV(src, dst,z) load(src, z); store(dst, z); FLAGS_NEUTRAL
+#define MOVZX(src, dst,zs,zd) load(src, zs); gz(zero_extend, zs); store(dst, zd); FLAGS_NEUTRAL
+#define MOVSX(src, dst,zs,zd) load(src, zs); gz(sign_extend, zs); store(dst, zd); FLAGS_NEUTRAL
 // xchg must generate in this order to be atomic
 #define XCHG(src, dst,z) load(src, z); op(xchg, dst, z); store(src, z)
 
-#define ADD(src, dst,z) los(add, src, dst, z)
-#define OR(src, dst,z) los(or, src, dst, z)
+#define ADD(src, dst,z) losf(add, src, dst, z)
+#define OR(src, dst,z) losf(or, src, dst, z)
 #define ADC(src, dst,z) los(adc, src, dst, z)
 #define SBB(src, dst,z) los(sbb, src, dst, z)
-#define AND(src, dst,z) los(and, src, dst, z)
-#define SUB(src, dst,z) los(sub, src, dst, z)
-#define XOR(src, dst,z) los(xor, src, dst, z)
-#define CMP(src, dst,z) lo(sub, src, dst, z)
-#define TEST(src, dst,z) lo(and, src, dst, z)
+#define AND(src, dst,z) losf(and, src, dst, z)
+#define SUB(src, dst,z) losf(sub, src, dst, z)
+#define XOR(src, dst,z) losf(xor, src, dst, z)
+// these can be fused with a jcc after them, see gen_fuse_jcc
+#if defined(__x86_64__)
+#define fusable(o, z) do { \
+    extern gadget_t fused_##o##_jmp_gadgets[]; \
+    if (z == 32) \
+        state->insn_fuse = fused_##o##_jmp_gadgets; \
+} while (0)
+#else
+#define fusable(o, z) do {} while (0)
+#endif
+#define CMP(src, dst,z) lof(sub, src, dst, z); fusable(sub, z)
+#define TEST(src, dst,z) lof(and, src, dst, z); fusable(and, z)
 #define NOT(val,z) load(val,z); gz(not, z); store(val,z)
 #define NEG(val,z) imm = 0; load(imm,z); op(sub, val,z); store(val,z)
 
@@ -252,16 +428,89 @@ static inline bool gen_op(struct gen_state *state, gadget_t *gadgets, enum arg a
 
 #define fake_ip (state->ip | (1ul << 63))
 
+bool gen_trace_in_window(struct gen_state *state, addr_t ip) {
+    addr_t window = PAGE(state->block->addr) << PAGE_BITS;
+    // leave room for the longest possible instruction at the end
+    return ip - window <= 2 * PAGE_SIZE - 15;
+}
+
+// When building a trace, keep decoding along the side of a direct branch
+// that's probably going to be taken, instead of ending the block. Backward
+// conditional branches are guessed to be taken (loops) and forward ones not.
+// The other side becomes a side exit, which gets chained like a normal exit.
+// Gives up on targets it's already been to, so a loop ends up as one block
+// that chains to itself. cond is -1 for an unconditional jump.
+static bool gen_trace_branch(struct gen_state *state, int cond, addr_t to, addr_t other) {
+    if (!state->trace || state->trace_branches >= FIBER_TRACE_MAX_BRANCHES ||
+            state->size >= FIBER_TRACE_MAX_SIZE)
+        return false;
+    addr_t target = to;
+    if (cond >= 0) {
+        addr_t branch = to == state->ip ? other : to;
+        target = branch <= state->orig_ip ? branch : state->ip;
+    }
+    if (target == state->block->addr || !gen_trace_in_window(state, target))
+        return false;
+    for (unsigned i = 0; i < state->trace_branches; i++) {
+        if (state->trace_targets[i] == target)
+            return false;
+    }
+
+    if (cond >= 0) {
+        if (target == to) {
+            gag(skip, cond, 2 * sizeof(long));
+            gg(jmp, other | (1ul << 63));
+        } else {
+            gag(skipn, cond, 2 * sizeof(long));
+            gg(jmp, to | (1ul << 63));
+        }
+        state->side_exit_ip[state->side_exits++] = state->size - 1;
+    }
+    if (state->ip > state->max_ip)
+        state->max_ip = state->ip;
+    state->trace_targets[state->trace_branches++] = target;
+    state->ip = target;
+    return true;
+}
+
+// cmp/test followed by jcc is common enough to get its own gadgets, which
+// do both and save going through a gadget in between. The fused gadget
+// replaces the op gadget of the cmp, which has to be the last thing generated,
+// and takes the jump targets after its own argument.
+static bool gen_fuse_jcc(struct gen_state *state, int cond, unsigned long to, unsigned long other) {
+    if (state->fuse_ip == 0)
+        return false;
+    gadget_t fused = state->fuse_gadgets[cond * arg_count + state->fuse_arg];
+    if (fused == NULL)
+        return false;
+    if (state->fuse_ip + 1 + (state->fuse_arg == arg_imm) != state->size)
+        return false;
+    state->block->code[state->fuse_ip] = (unsigned long) fused;
+    GEN(to);
+    GEN(other);
+    return true;
+}
+
 #define jump_ips(off1, off2) \
     state->jump_ip[0] = state->size + off1; \
     if (off2 != 0) \
         state->jump_ip[1] = state->size + off2
 #define JMP(loc) load(loc, OP_SIZE); g(jmp_indir); end_block = true
-#define JMP_REL(off) gg(jmp, fake_ip + off); jump_ips(-1, 0); end_block = true
+#define JMP_REL(off) do { \
+    if (!gen_trace_branch(state, -1, state->ip + off, state->ip)) { \
+        gg(jmp, fake_ip + off); jump_ips(-1, 0); end_block = true; \
+    } \
+} while (0)
 #define JCXZ_REL(off) ggg(jcxz, fake_ip + off, fake_ip); jump_ips(-2, -1); end_block = true
-#define jcc(cc, to, else) gagg(jmp, cond_##cc, to, else); jump_ips(-2, -1); end_block = true
-#define J_REL(cc, off)  jcc(cc, fake_ip + off, fake_ip)
-#define JN_REL(cc, off) jcc(cc, fake_ip, fake_ip + off)
+#define jcc(cc, to, else) do { \
+    if (!gen_trace_branch(state, cond_##cc, to, else)) { \
+        if (!gen_fuse_jcc(state, cond_##cc, (to) | (1ul << 63), (else) | (1ul << 63))) \
+            gagg(jmp, cond_##cc, (to) | (1ul << 63), (else) | (1ul << 63)); \
+        jump_ips(-2, -1); end_block = true; \
+    } \
+} while (0)
+#define J_REL(cc, off)  jcc(cc, (addr_t) (state->ip + off), state->ip)
+#define JN_REL(cc, off) jcc(cc, state->ip, (addr_t) (state->ip + off))
 
 // state->orig_ip: for use with page fault handler;
 // -1: will be patched to block address in gen_end();
@@ -288,17 +537,20 @@ static inline bool gen_op(struct gen_state *state, gadget_t *gadgets, enum arg a
 #define SET(cc, dst) ga(set, cond_##cc); store(dst, 8)
 #define SETN(cc, dst) ga(setn, cond_##cc); store(dst, 8)
 // wins the prize for the most annoying instruction to generate
+// the skip lands right after the store, so _tmp isn't necessarily in the register
 #define CMOV(cc, src, dst,z) do { \
     gag(skipn, cond_##cc, 0); \
     int start = state->size; \
     load(src, z); store(dst, z); \
     state->block->code[start - 1] = (state->size - start) * sizeof(long); \
+    state->store_end = 0; \
 } while (0)
 #define CMOVN(cc, src, dst,z) do { \
     gag(skip, cond_##cc, 0); \
     int start = state->size; \
     load(src, z); store(dst, z); \
     state->block->code[start - 1] = (state->size - start) * sizeof(long); \
+    state->store_end = 0; \
 } while (0)
 
 #define PUSHF() g(pushf)
@@ -487,7 +739,7 @@ static inline bool gen_vec(enum arg src, enum arg dst, void (*helper)(void), gad
                 g(vec_helper_reg);
             else
                 g(vec_helper_reg_imm);
-            GEN(helper);
+            GEN_HOST(helper);
             // first byte is src, second byte is dst
             uint64_t arg;
             if (rm_is_src)
@@ -499,16 +751,16 @@ static inline bool gen_vec(enum arg src, enum arg dst, void (*helper)(void), gad
 
         case arg_mem:
             gen_addr(state, modrm, seg_gs);
-            GEN(rm_is_src ? read_mem_gadget : write_mem_gadget);
+            GEN_HOST(rm_is_src ? read_mem_gadget : write_mem_gadget);
             GEN(state->orig_ip);
-            GEN(helper);
+            GEN_HOST(helper);
             GEN(reg_offset | imm_arg);
             break;
 
         case arg_imm:
             // TODO: support immediates and opcode
             g(vec_helper_imm);
-            GEN(helper);
+            GEN_HOST(helper);
             // This is rm_opcode instead of opcode because PSRLQ is weird like that
             GEN(((uint16_t) imm) | (cpu_reg_offset(reg, modrm->rm_opcode) << 16));
             break;
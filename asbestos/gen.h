@@ -4,6 +4,29 @@
 #include "asbestos/asbestos.h"
 #include "emu/tlb.h"
 
+// Limits on how far a trace can wander. It stays inside the page it starts in
+// and the one after, so it can be invalidated like any other block.
+#define FIBER_TRACE_MAX_BRANCHES 16
+#define FIBER_TRACE_MAX_SIZE 4096
+
+// This should stay in sync with the definition of .gadget_array in gadgets.h
+enum arg {
+    arg_reg_a, arg_reg_c, arg_reg_d, arg_reg_b, arg_reg_sp, arg_reg_bp, arg_reg_si, arg_reg_di,
+    arg_imm, arg_mem, arg_addr, arg_gs,
+    arg_count, arg_invalid,
+    // the following should not be synced with the list mentioned above (no gadgets implement them)
+    arg_modrm_val, arg_modrm_reg,
+    arg_xmm_modrm_val, arg_xmm_modrm_reg,
+    arg_mm_modrm_val, arg_mm_modrm_reg,
+    arg_mem_addr, arg_1,
+};
+
+enum size {
+    size_8, size_16, size_32,
+    size_count,
+    size_64, size_80, size_128, // bonus sizes
+};
+
 struct gen_state {
     addr_t ip;
     addr_t orig_ip;
@@ -13,11 +36,55 @@ struct gen_state {
     unsigned capacity;
     unsigned jump_ip[2];
     unsigned block_patch_ip; // for call/call_indir gadgets
+
+    // follow direct branches instead of ending the block, see gen_trace_branch
+    bool trace;
+    unsigned trace_branches;
+    addr_t trace_targets[FIBER_TRACE_MAX_BRANCHES];
+    unsigned side_exit_ip[FIBER_TRACE_MAX_BRANCHES];
+    unsigned side_exits;
+    // end of the furthest instruction decoded, since ip can go backwards
+    addr_t max_ip;
+
+    // Dead flag elimination, see gen_flags_step. flags_ip is the last gadget
+    // that set all the flags where nothing has looked at them yet, and
+    // flags_noflags is the gadget to replace it with if they turn out dead.
+    unsigned flags_ip;
+    unsigned long flags_noflags;
+    // what the instruction being generated did with the flags
+    unsigned insn_flags_ip;
+    unsigned insn_flags_arg;
+    unsigned long insn_noflags;
+    bool insn_flags_neutral;
+    bool insn_mem;
+
+    // a cmp or test that a jcc right after it can be fused with, see
+    // gen_fuse_jcc
+    void (**insn_fuse)(void);
+    void (**fuse_gadgets)(void);
+    unsigned fuse_ip;
+    unsigned fuse_arg;
+
+    // where the last 32 bit register store ended and which register, so a
+    // load of it right after can be left out, see gen_op
+    unsigned store_end;
+    enum arg store_arg;
+
+    // which words of code[] are gadgets rather than their arguments, only
+    // kept for traces that native_compile will look at
+    bool *gadget_start;
+    // which words of code[] point into ish (gadgets and helpers), only kept
+    // if the caller allocates it after gen_start, see fiber_cache_store
+    bool *host_pointer;
 };
 
 void gen_start(addr_t addr, struct gen_state *state);
 void gen_exit(struct gen_state *state);
 void gen_end(struct gen_state *state);
+bool gen_trace_in_window(struct gen_state *state, addr_t ip);
+// Make a block out of code that came from one gen_end made earlier, see cache.c
+struct fiber_block *gen_copy(addr_t addr, addr_t end_addr, const unsigned long *code, unsigned size,
+        const unsigned jump_ip[2], unsigned block_patch_ip);
 
 int gen_step(struct gen_state *state, struct tlb *tlb);
 
@@ -0,0 +1,421 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "asbestos/native.h"
+#include "asbestos/gen.h"
+#include "asbestos/frame.h"
+#include "emu/cpu.h"
+#include "util/sync.h"
+
+// Hot traces get their simplest gadgets turned into real host code. A run of
+// two or more gadgets that only touch registers and the flags is copied out
+// as instructions, and the first word of the run in code[] is replaced with a
+// pointer to them. The copy follows the same rules as a gadget: it's entered
+// with _ip pointing just past it, and ends by jumping to the gadget after the
+// run. Everything else in code[] stays the way gen.c left it, so skips and
+// jumps into the middle of a run still find the original gadgets.
+
+typedef void (*gadget_t)(void);
+
+enum native_kind {
+    native_load, native_store, native_load_addr,
+    native_op, native_op_noflags,
+    native_addr, native_si,
+};
+
+struct native_gadget {
+    unsigned long gadget;
+    enum native_kind kind;
+    unsigned char op; // index into native_ops
+    unsigned char arg; // enum arg
+    unsigned char shift; // for si
+};
+
+// op r/m32, r32 and the /digit for op r/m32, imm32
+static const struct {
+    uint8_t rr;
+    uint8_t ext;
+    bool arith; // sets AF from the operands, like add and sub
+} native_ops[] = {
+    {0x01, 0, true}, // add
+    {0x29, 5, true}, // sub
+    {0x21, 4, false}, // and
+    {0x09, 1, false}, // or
+    {0x31, 6, false}, // xor
+};
+#define NATIVE_OPS (sizeof(native_ops)/sizeof(native_ops[0]))
+
+// host registers, see gadgets-x86_64/gadgets.h
+static const uint8_t native_regs[] = {
+    [arg_reg_a] = 0, [arg_reg_c] = 1, [arg_reg_d] = 2, [arg_reg_b] = 3,
+    [arg_reg_sp] = 8, [arg_reg_bp] = 5, [arg_reg_si] = 6, [arg_reg_di] = 7,
+};
+#define REG_IP 9
+#define REG_TMP 10
+#define REG_CPU 11
+#define REG_ADDR 13
+#define REG_SCRATCH 14
+
+
+static struct native_gadget native_gadgets[256];
+static unsigned native_gadgets_count;
+static pthread_once_t native_once = PTHREAD_ONCE_INIT;
+
+static void native_add(gadget_t gadget, enum native_kind kind, unsigned op, unsigned arg, unsigned shift) {
+    if (gadget == NULL)
+        return;
+    assert(native_gadgets_count < sizeof(native_gadgets)/sizeof(native_gadgets[0]));
+    native_gadgets[native_gadgets_count++] = (struct native_gadget) {
+        .gadget = (unsigned long) gadget,
+        .kind = kind, .op = op, .arg = arg, .shift = shift,
+    };
+}
+
+static int native_gadget_compare(const void *a, const void *b) {
+    unsigned long x = ((const struct native_gadget *) a)->gadget;
+    unsigned long y = ((const struct native_gadget *) b)->gadget;
+    return x < y ? -1 : x > y;
+}
+
+static void native_init(void) {
+    extern gadget_t load_gadgets[], store_gadgets[], addr_gadgets[], si_gadgets[];
+    extern gadget_t add_gadgets[], sub_gadgets[], and_gadgets[], or_gadgets[], xor_gadgets[];
+    extern gadget_t noflags_add_gadgets[], noflags_sub_gadgets[], noflags_and_gadgets[],
+           noflags_or_gadgets[], noflags_xor_gadgets[];
+    extern void gadget_load32_addr(void);
+    extern void gadget_addr_none(void);
+    gadget_t *ops[NATIVE_OPS] = {add_gadgets, sub_gadgets, and_gadgets, or_gadgets, xor_gadgets};
+    gadget_t *noflags_ops[NATIVE_OPS] = {noflags_add_gadgets, noflags_sub_gadgets,
+        noflags_and_gadgets, noflags_or_gadgets, noflags_xor_gadgets};
+
+    // only 32 bit, the other sizes would need the sign extension and
+    // partial register writes that the gadgets do
+    unsigned row = size_32 * arg_count;
+    for (unsigned arg = arg_reg_a; arg <= arg_imm; arg++) {
+        native_add(load_gadgets[row + arg], native_load, 0, arg, 0);
+        if (arg != arg_imm)
+            native_add(store_gadgets[row + arg], native_store, 0, arg, 0);
+        for (unsigned op = 0; op < NATIVE_OPS; op++) {
+            native_add(ops[op][row + arg], native_op, op, arg, 0);
+            native_add(noflags_ops[op][row + arg], native_op_noflags, op, arg, 0);
+        }
+    }
+    for (unsigned arg = arg_reg_a; arg <= arg_reg_di; arg++) {
+        native_add(addr_gadgets[arg], native_addr, 0, arg, 0);
+        for (unsigned shift = 0; shift < 4; shift++)
+            native_add(si_gadgets[arg * 4 + shift], native_si, 0, arg, shift);
+    }
+    native_add(gadget_addr_none, native_addr, 0, arg_imm, 0);
+    native_add(gadget_load32_addr, native_load_addr, 0, 0, 0);
+    qsort(native_gadgets, native_gadgets_count, sizeof(native_gadgets[0]), native_gadget_compare);
+}
+
+static const struct native_gadget *native_lookup(unsigned long gadget) {
+    struct native_gadget key = {.gadget = gadget};
+    return bsearch(&key, native_gadgets, native_gadgets_count, sizeof(native_gadgets[0]), native_gadget_compare);
+}
+
+// how many words of code[] after the gadget are its arguments
+static unsigned native_args(const struct native_gadget *g) {
+    switch (g->kind) {
+        case native_load: case native_op: case native_op_noflags:
+            return g->arg == arg_imm;
+        case native_addr:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+struct native_buf {
+    uint8_t *code;
+    size_t size;
+    size_t capacity;
+};
+
+static void emit8(struct native_buf *buf, uint8_t byte) {
+    if (buf->size >= buf->capacity) {
+        buf->capacity = buf->capacity ? buf->capacity * 2 : 256;
+        uint8_t *bigger = realloc(buf->code, buf->capacity);
+        if (bigger == NULL)
+            die("out of memory while carcinizing");
+        buf->code = bigger;
+    }
+    buf->code[buf->size++] = byte;
+}
+
+static void emit32(struct native_buf *buf, uint32_t imm) {
+    for (int i = 0; i < 4; i++)
+        emit8(buf, imm >> (i * 8));
+}
+
+static void emit_rex(struct native_buf *buf, unsigned reg, unsigned rm) {
+    if (reg >= 8 || rm >= 8)
+        emit8(buf, 0x40 | (reg >> 3) << 2 | rm >> 3);
+}
+
+// op r/m32, r32 with both in registers
+static void emit_rr(struct native_buf *buf, uint8_t opcode, unsigned reg, unsigned rm) {
+    emit_rex(buf, reg, rm);
+    emit8(buf, opcode);
+    emit8(buf, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// op r/m32, imm32
+static void emit_ri(struct native_buf *buf, uint8_t opcode, unsigned ext, unsigned rm, uint32_t imm) {
+    emit_rex(buf, 0, rm);
+    emit8(buf, opcode);
+    emit8(buf, 0xc0 | ext << 3 | (rm & 7));
+    emit32(buf, imm);
+}
+
+// op with a field of the cpu struct as r/m, which is disp32(%_cpu). opcodes
+// bigger than a byte are the two byte 0x0f ones.
+static void emit_cpu(struct native_buf *buf, unsigned opcode, unsigned reg, size_t offset) {
+    emit_rex(buf, reg, REG_CPU);
+    if (opcode > 0xff)
+        emit8(buf, opcode >> 8);
+    emit8(buf, opcode);
+    emit8(buf, 0x80 | (reg & 7) << 3 | (REG_CPU & 7));
+    emit32(buf, offset);
+}
+
+// mov or some op from a register or immediate argument into dst
+static void emit_src(struct native_buf *buf, uint8_t rr, uint8_t ri, unsigned ext, unsigned arg, uint32_t imm, unsigned dst) {
+    if (arg == arg_imm)
+        emit_ri(buf, ri, ext, dst, imm);
+    else
+        emit_rr(buf, rr, native_regs[arg], dst);
+}
+
+// Same thing as the gadget, the flag updates match _do_op in math.S
+static void native_emit(struct native_buf *buf, const struct native_gadget *g, unsigned long *args) {
+    uint32_t imm = native_args(g) ? (uint32_t) args[0] : 0;
+    switch (g->kind) {
+        case native_load:
+            emit_src(buf, 0x89, 0xc7, 0, g->arg, imm, REG_TMP);
+            break;
+        case native_store:
+            emit_rr(buf, 0x89, REG_TMP, native_regs[g->arg]);
+            break;
+        case native_load_addr:
+            emit_rr(buf, 0x89, REG_ADDR, REG_TMP);
+            break;
+
+        case native_op_noflags:
+            emit_src(buf, native_ops[g->op].rr, 0x81, native_ops[g->op].ext, g->arg, imm, REG_TMP);
+            break;
+        case native_op:
+            if (native_ops[g->op].arith) {
+                emit_src(buf, 0x89, 0xc7, 0, g->arg, imm, REG_SCRATCH);
+                emit_cpu(buf, 0x89, REG_SCRATCH, CPU_OFFSET(op1));
+                emit_cpu(buf, 0x89, REG_TMP, CPU_OFFSET(op2));
+                emit_cpu(buf, 0x81, 1, CPU_OFFSET(flags_res));
+                emit32(buf, AF_OPS);
+                emit_rr(buf, native_ops[g->op].rr, REG_SCRATCH, REG_TMP);
+                emit_cpu(buf, 0x0f90, 0, CPU_OFFSET(of)); // seto
+                emit_cpu(buf, 0x0f92, 0, CPU_OFFSET(cf)); // setc
+            } else {
+                emit_cpu(buf, 0x81, 4, CPU_OFFSET(eflags));
+                emit32(buf, ~AF_FLAG);
+                emit_cpu(buf, 0x81, 4, CPU_OFFSET(flags_res));
+                emit32(buf, ~AF_OPS);
+                emit_cpu(buf, 0xc7, 0, CPU_OFFSET(of));
+                emit32(buf, 0);
+                emit_cpu(buf, 0xc7, 0, CPU_OFFSET(cf));
+                emit32(buf, 0);
+                emit_src(buf, native_ops[g->op].rr, 0x81, native_ops[g->op].ext, g->arg, imm, REG_TMP);
+            }
+            emit_cpu(buf, 0x89, REG_TMP, CPU_OFFSET(res));
+            emit_cpu(buf, 0x81, 1, CPU_OFFSET(flags_res));
+            emit32(buf, ZF_RES|SF_RES|PF_RES);
+            break;
+
+        case native_addr:
+            emit_src(buf, 0x89, 0xc7, 0, g->arg, imm, REG_ADDR);
+            if (g->arg != arg_imm)
+                emit_ri(buf, 0x81, 0, REG_ADDR, imm);
+            break;
+        case native_si: {
+            // leal 0(%_addr,%reg,1<<shift), %_addr
+            unsigned index = native_regs[g->arg];
+            emit8(buf, 0x45 | (index >> 3) << 1);
+            emit8(buf, 0x8d);
+            emit8(buf, 0x40 | (REG_ADDR & 7) << 3 | 4);
+            emit8(buf, g->shift << 6 | (index & 7) << 3 | (REG_ADDR & 7));
+            emit8(buf, 0);
+            break;
+        }
+    }
+}
+
+// Host code for all the traces goes in chunks that are mapped twice, once
+// writable and once executable, so a trace's code can be copied in without
+// an mmap and mprotect of its own. Traces take space from the front of the
+// newest chunk, and a chunk is unmapped once every trace in it is freed,
+// which happens after nothing can be running them anymore (see
+// fiber_reclaim). The newest chunk gets reused from the front instead.
+struct native_chunk {
+    char *write;
+    char *exec;
+    size_t size;
+    size_t used;
+    unsigned traces;
+};
+#define NATIVE_CHUNK_SIZE (1 << 16)
+
+static lock_t native_lock = LOCK_INITIALIZER;
+static struct native_chunk *native_chunk;
+
+static struct native_chunk *native_chunk_new(size_t size) {
+    struct native_chunk *chunk = malloc(sizeof(struct native_chunk));
+    if (chunk == NULL)
+        return NULL;
+    *chunk = (struct native_chunk) {.size = size, .write = MAP_FAILED, .exec = MAP_FAILED};
+    int fd = memfd_create("asbestos native", MFD_CLOEXEC);
+    if (fd < 0)
+        goto fail;
+    if (ftruncate(fd, size) == 0) {
+        chunk->write = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        chunk->exec = mmap(NULL, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (chunk->write == MAP_FAILED || chunk->exec == MAP_FAILED)
+        goto fail;
+    return chunk;
+
+fail:
+    if (chunk->write != MAP_FAILED)
+        munmap(chunk->write, size);
+    if (chunk->exec != MAP_FAILED)
+        munmap(chunk->exec, size);
+    free(chunk);
+    return NULL;
+}
+
+static void native_chunk_free(struct native_chunk *chunk) {
+    munmap(chunk->write, chunk->size);
+    munmap(chunk->exec, chunk->size);
+    free(chunk);
+}
+
+// Copy code into a chunk and return where it can be run from
+static char *native_alloc(const void *code, size_t size, struct native_chunk **chunk_out) {
+    lock(&native_lock);
+    struct native_chunk *chunk = native_chunk;
+    if (chunk == NULL || chunk->used + size > chunk->size) {
+        size_t chunk_size = size > NATIVE_CHUNK_SIZE ? (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1) : NATIVE_CHUNK_SIZE;
+        chunk = native_chunk_new(chunk_size);
+        if (chunk == NULL) {
+            unlock(&native_lock);
+            return NULL;
+        }
+        // the old one goes when the last trace in it does
+        if (native_chunk != NULL && native_chunk->traces == 0)
+            native_chunk_free(native_chunk);
+        native_chunk = chunk;
+    }
+    char *native = chunk->exec + chunk->used;
+    memcpy(chunk->write + chunk->used, code, size);
+    chunk->used = (chunk->used + size + 15) & ~(size_t) 15;
+    chunk->traces++;
+    *chunk_out = chunk;
+    unlock(&native_lock);
+    return native;
+}
+
+// the end of every run, which is what gret does
+static void native_emit_ret(struct native_buf *buf, unsigned words) {
+    // addq $words*8, %_ip
+    emit8(buf, 0x49);
+    emit8(buf, 0x81);
+    emit8(buf, 0xc0 | (REG_IP & 7));
+    emit32(buf, words * 8);
+    // jmp *-8(%_ip)
+    emit8(buf, 0x41);
+    emit8(buf, 0xff);
+    emit8(buf, 0x60 | (REG_IP & 7));
+    emit8(buf, -8);
+}
+
+void native_compile(struct fiber_block *block, unsigned size, const bool *gadget_start) {
+    pthread_once(&native_once, native_init);
+
+    struct native_buf buf = {};
+    struct native_run {
+        unsigned start;
+        size_t offset;
+    } *runs = NULL;
+    unsigned runs_count = 0;
+
+    unsigned i = 0;
+    while (i < size) {
+        // Find where the run starting here ends. Only words gen.c marked as
+        // gadgets count, an immediate could equal a gadget's address.
+        unsigned end = i;
+        unsigned gadgets = 0;
+        while (end < size && gadget_start[end]) {
+            const struct native_gadget *g = native_lookup(block->code[end]);
+            if (g == NULL)
+                break;
+            unsigned next = end + 1 + native_args(g);
+            if (next > size)
+                break;
+            end = next;
+            gadgets++;
+        }
+        // there has to be a gadget to go to afterwards, and one gadget on
+        // its own isn't worth it
+        if (gadgets < 2 || end >= size || !gadget_start[end]) {
+            i = gadgets == 0 ? i + 1 : end;
+            continue;
+        }
+
+        struct native_run *bigger_runs = realloc(runs, (runs_count + 1) * sizeof(*runs));
+        if (bigger_runs == NULL)
+            die("out of memory while carcinizing");
+        runs = bigger_runs;
+        runs[runs_count++] = (struct native_run) {.start = i, .offset = buf.size};
+        unsigned k = i;
+        while (k < end) {
+            const struct native_gadget *g = native_lookup(block->code[k]);
+            native_emit(&buf, g, &block->code[k + 1]);
+            k += 1 + native_args(g);
+        }
+        native_emit_ret(&buf, end - i);
+        i = end;
+    }
+
+    if (runs_count == 0)
+        goto out;
+    char *native = native_alloc(buf.code, buf.size, &block->native_chunk);
+    if (native == NULL)
+        goto out; // the gadgets still work
+    block->native = native;
+    for (unsigned r = 0; r < runs_count; r++)
+        block->code[runs[r].start] = (unsigned long) native + runs[r].offset;
+
+out:
+    free(runs);
+    free(buf.code);
+}
+
+void native_free(struct fiber_block *block) {
+    struct native_chunk *chunk = block->native_chunk;
+    if (chunk == NULL)
+        return;
+    lock(&native_lock);
+    if (--chunk->traces == 0) {
+        if (chunk == native_chunk)
+            chunk->used = 0;
+        else
+            native_chunk_free(chunk);
+    }
+    unlock(&native_lock);
+}
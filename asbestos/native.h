@@ -0,0 +1,16 @@
+#ifndef ASBESTOS_NATIVE_H
+#define ASBESTOS_NATIVE_H
+#include <stdbool.h>
+#include "asbestos/asbestos.h"
+
+#if ENGINE_ASBESTOS_NATIVE
+// Replace runs of simple gadgets in a finished trace with host code.
+// gadget_start says which of the first size words of code[] are gadgets.
+void native_compile(struct fiber_block *block, unsigned size, const bool *gadget_start);
+void native_free(struct fiber_block *block);
+#else
+static inline void native_compile(struct fiber_block *block, unsigned size, const bool *gadget_start) {}
+static inline void native_free(struct fiber_block *block) {}
+#endif
+
+#endif
@@ -61,6 +61,13 @@ void cpu(void) {
     OFFSET(TLB, tlb, entries);
     OFFSET(TLB, tlb, dirty_page);
     OFFSET(TLB, tlb, segfault_addr);
+#if MEM_FLAT
+    OFFSET(TLB, tlb, flat);
+#endif
+#ifdef FIBER_PROFILE
+    DEFINE(TLB_stats_accesses, offsetof(struct tlb, stats.accesses));
+#endif
+    MACRO(TLB_BITS);
     OFFSET(TLB_ENTRY, tlb_entry, page);
     OFFSET(TLB_ENTRY, tlb_entry, page_if_writable);
     OFFSET(TLB_ENTRY, tlb_entry, data_minus_addr);
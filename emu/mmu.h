@@ -19,21 +19,54 @@ typedef dword_t pages_t;
 #define MEM_PAGES (1 << 20) // at least on 32-bit
 #endif
 
+#define MMU_CHANGE_LOG_SIZE 32
 struct mmu {
     struct mmu_ops *ops;
     struct asbestos *asbestos;
     uint64_t changes;
+    // If not NULL, every mapped page is also at flat plus its address, and
+    // accessing it there faults on the host if the guest access would
+    char *flat;
+    // Pages affected by the last few changes, indexed by change number mod
+    // MMU_CHANGE_LOG_SIZE, so a TLB that only missed a few can throw out just
+    // those pages
+    struct mmu_change {
+        page_t start;
+        page_t end;
+    } change_log[MMU_CHANGE_LOG_SIZE];
 };
 
 #define MEM_READ 0
 #define MEM_WRITE 1
 #define MEM_WRITE_PTRACE 2
 
+// Where a page of code came from, see mmu_ops.file_page
+struct mmu_file_page {
+    uint64_t file; // hash of something that identifies the file
+    uint64_t offset;
+    const void *data; // the page itself
+};
+
 struct mmu_ops {
     // type is MEM_READ or MEM_WRITE
     void *(*translate)(struct mmu *mmu, addr_t addr, int type);
+    // Optional. Returns true if the page is mapped from a file and can't be
+    // written to without the page being invalidated first.
+    bool (*file_page)(struct mmu *mmu, page_t page, struct mmu_file_page *file);
+    // Optional. Called with asbestos->lock before compiling code from a page,
+    // for mmus that can't otherwise tell the asbestos when the page gets
+    // written to. unprotect_code undoes it, see asbestos_invalidate_write.
+    void (*protect_code)(struct mmu *mmu, page_t page);
+    void (*unprotect_code)(struct mmu *mmu, page_t page);
 };
 
+// Must be called after changing the mapping of pages start (inclusive) to end
+// (exclusive)
+static inline void mmu_changed(struct mmu *mmu, page_t start, page_t end) {
+    mmu->change_log[mmu->changes % MMU_CHANGE_LOG_SIZE] = (struct mmu_change) {start, end};
+    mmu->changes++;
+}
+
 static inline void *mmu_translate(struct mmu *mmu, addr_t addr, int type) {
     return mmu->ops->translate(mmu, addr, type);
 }
@@ -1,19 +1,82 @@
 #include "emu/cpu.h"
 #include "emu/tlb.h"
 
+static bool tlb_same_mmu(struct tlb *tlb, struct mmu *mmu) {
+    // exec frees the old mm right before allocating the new one, so the new
+    // mmu can easily end up at the same address
+#if MEM_FLAT
+    if (tlb->flat != mmu->flat)
+        return false;
+#endif
+    return tlb->mmu == mmu;
+}
+
 void tlb_refresh(struct tlb *tlb, struct mmu *mmu) {
-    if (tlb->mmu == mmu && tlb->mem_changes == mmu->changes)
+    bool same_mmu = tlb_same_mmu(tlb, mmu);
+    if (same_mmu && tlb->mem_changes == mmu->changes)
         return;
-    tlb->mmu = mmu;
     tlb->dirty_page = TLB_PAGE_EMPTY;
-    tlb->mem_changes = mmu->changes;
-    tlb_flush(tlb);
+    if (same_mmu)
+        tlb_catch_up(tlb);
+    else {
+        tlb->mmu = mmu;
+#if MEM_FLAT
+        tlb->flat = mmu->flat;
+#endif
+        tlb_flush(tlb);
+    }
 }
 
+#define TLB_ENTRY_EMPTY ((struct tlb_entry) {.page = TLB_PAGE_EMPTY, .page_if_writable = TLB_PAGE_EMPTY})
+
 void tlb_flush(struct tlb *tlb) {
     tlb->mem_changes = tlb->mmu->changes;
     for (unsigned i = 0; i < TLB_SIZE; i++)
-        tlb->entries[i] = (struct tlb_entry) {.page = 1, .page_if_writable = 1};
+        tlb->entries[i] = TLB_ENTRY_EMPTY;
+    if (!tlb->victims_empty) {
+        for (unsigned i = 0; i < TLB_VICTIM_SIZE; i++)
+            tlb->victims[i] = TLB_ENTRY_EMPTY;
+        tlb->victims_empty = true;
+    }
+}
+
+static void tlb_flush_entries(struct tlb_entry *entries, unsigned size, page_t start, page_t end) {
+    for (unsigned i = 0; i < size; i++) {
+        if (entries[i].page != TLB_PAGE_EMPTY && PAGE(entries[i].page) >= start && PAGE(entries[i].page) < end)
+            entries[i] = TLB_ENTRY_EMPTY;
+    }
+}
+
+static void tlb_flush_range(struct tlb *tlb, page_t start, page_t end) {
+    if (end - start < TLB_SIZE) {
+        for (page_t page = start; page < end; page++) {
+            addr_t addr = page << PAGE_BITS;
+            struct tlb_entry *entry = &tlb->entries[TLB_INDEX(addr)];
+            if (entry->page == addr)
+                *entry = TLB_ENTRY_EMPTY;
+            entry = &tlb->victims[TLB_VICTIM_INDEX(addr)];
+            if (entry->page == addr)
+                *entry = TLB_ENTRY_EMPTY;
+        }
+    } else {
+        tlb_flush_entries(tlb->entries, TLB_SIZE, start, end);
+        if (!tlb->victims_empty)
+            tlb_flush_entries(tlb->victims, TLB_VICTIM_SIZE, start, end);
+    }
+}
+
+void tlb_catch_up(struct tlb *tlb) {
+    struct mmu *mmu = tlb->mmu;
+    uint64_t changes = mmu->changes;
+    if (changes - tlb->mem_changes > MMU_CHANGE_LOG_SIZE) {
+        tlb_flush(tlb);
+        return;
+    }
+    for (uint64_t change = tlb->mem_changes; change < changes; change++) {
+        struct mmu_change *log = &mmu->change_log[change % MMU_CHANGE_LOG_SIZE];
+        tlb_flush_range(tlb, log->start, log->end);
+    }
+    tlb->mem_changes = changes;
 }
 
 void tlb_free(struct tlb *tlb) {
@@ -49,16 +112,40 @@ bool __tlb_write_cross_page(struct tlb *tlb, addr_t addr, const char *value, uns
 }
 
 __no_instrument void *tlb_handle_miss(struct tlb *tlb, addr_t addr, int type) {
+#ifdef FIBER_PROFILE
+    tlb->stats.misses++;
+#endif
+    if (tlb->mmu->changes != tlb->mem_changes)
+        tlb_catch_up(tlb);
+    struct tlb_entry *tlb_ent = &tlb->entries[TLB_INDEX(addr)];
+    struct tlb_entry *victim = &tlb->victims[TLB_VICTIM_INDEX(addr)];
+    if (type == MEM_WRITE ? victim->page_if_writable == TLB_PAGE(addr) : victim->page == TLB_PAGE(addr)) {
+#ifdef FIBER_PROFILE
+        tlb->stats.victim_hits++;
+#endif
+        // swap it with whatever's in the way, which is usually the entry for
+        // the page the victim was pushed out by
+        struct tlb_entry hit = *victim;
+        if (tlb_ent->page != TLB_PAGE_EMPTY)
+            tlb->victims[TLB_VICTIM_INDEX(tlb_ent->page)] = *tlb_ent;
+        *tlb_ent = hit;
+        tlb->dirty_page = TLB_PAGE(addr);
+        return (void *) (tlb_ent->data_minus_addr + addr);
+    }
+
     char *ptr = mmu_translate(tlb->mmu, TLB_PAGE(addr), type);
     if (tlb->mmu->changes != tlb->mem_changes)
-        tlb_flush(tlb);
+        tlb_catch_up(tlb);
     if (ptr == NULL) {
         tlb->segfault_addr = addr;
         return NULL;
     }
     tlb->dirty_page = TLB_PAGE(addr);
 
-    struct tlb_entry *tlb_ent = &tlb->entries[TLB_INDEX(addr)];
+    if (tlb_ent->page != TLB_PAGE_EMPTY && tlb_ent->page != TLB_PAGE(addr)) {
+        tlb->victims[TLB_VICTIM_INDEX(tlb_ent->page)] = *tlb_ent;
+        tlb->victims_empty = false;
+    }
     tlb_ent->page = TLB_PAGE(addr);
     if (type == MEM_WRITE)
         tlb_ent->page_if_writable = tlb_ent->page;
@@ -10,24 +10,53 @@ struct tlb_entry {
     page_t page_if_writable;
     uintptr_t data_minus_addr;
 };
+// The TLB is a direct mapped table that the gadgets look in, backed by a
+// bigger table of entries that were pushed out of it, which is only looked in
+// on a miss. Both sizes can be changed with -DTLB_BITS and -DTLB_VICTIM_BITS.
+#ifndef TLB_BITS
 #define TLB_BITS 10
+#endif
 #define TLB_SIZE (1 << TLB_BITS)
+#ifndef TLB_VICTIM_BITS
+#define TLB_VICTIM_BITS (TLB_BITS + 2)
+#endif
+#define TLB_VICTIM_SIZE (1 << TLB_VICTIM_BITS)
 struct tlb {
     struct mmu *mmu;
     page_t dirty_page;
     unsigned mem_changes;
+    // set by a full flush until something gets pushed into victims, so
+    // flushing doesn't have to go through them for nothing
+    bool victims_empty;
     // this is basically one of the return values of tlb_handle_miss, tlb_{read,write}, and __tlb_{read,write}_cross_page
     // yes, this sucks
     addr_t segfault_addr;
+#if MEM_FLAT
+    // copy of mmu->flat for the gadgets
+    char *flat;
+#endif
+#ifdef FIBER_PROFILE
+    // accesses are only counted by the gadgets
+    struct tlb_stats {
+        uint64_t accesses;
+        uint64_t misses;
+        uint64_t victim_hits;
+    } stats;
+#endif
     struct tlb_entry entries[TLB_SIZE];
+    struct tlb_entry victims[TLB_VICTIM_SIZE];
 };
 
-#define TLB_INDEX(addr) (((addr >> PAGE_BITS) & (TLB_SIZE - 1)) ^ (addr >> (PAGE_BITS + TLB_BITS)))
+#define TLB_INDEX(addr) (((addr >> PAGE_BITS) ^ (addr >> (PAGE_BITS + TLB_BITS))) & (TLB_SIZE - 1))
+#define TLB_VICTIM_INDEX(addr) ((addr >> PAGE_BITS) & (TLB_VICTIM_SIZE - 1))
 #define TLB_PAGE(addr) (addr & 0xfffff000)
 #define TLB_PAGE_EMPTY 1
 void tlb_refresh(struct tlb *tlb, struct mmu *mmu);
 void tlb_free(struct tlb *tlb);
 void tlb_flush(struct tlb *tlb);
+// Throw out the entries for pages that changed since the TLB was last up to
+// date with its mmu, or everything if that was too long ago
+void tlb_catch_up(struct tlb *tlb);
 void *tlb_handle_miss(struct tlb *tlb, addr_t addr, int type);
 
 forceinline __no_instrument void *__tlb_read_ptr(struct tlb *tlb, addr_t addr) {
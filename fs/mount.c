@@ -2,6 +2,7 @@
 #include <sys/stat.h>
 #include "kernel/calls.h"
 #include "kernel/fs.h"
+#include "fs/page_cache.h"
 #include "fs/path.h"
 #include "fs/real.h"
 
@@ -184,6 +185,7 @@ dword_t sys_umount2(addr_t target_addr, dword_t flags) {
     if (err < 0)
         return err;
 
+    page_cache_drop_mount(target);
     lock(&mounts_lock);
     err = do_umount(target);
     unlock(&mounts_lock);
@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "kernel/errno.h"
+#include "kernel/fs.h"
+#include "fs/fd.h"
+#include "fs/page_cache.h"
+#include "util/list.h"
+#include "util/sync.h"
+
+// Each entry holds a reference to its data, so a mapping stays cached for a
+// while after the last process using it goes away, for the next process that
+// runs the same thing. Entries are told apart by the host file's identity
+// along with its size and modification and change times, so a file that gets
+// rewritten doesn't hand out its old contents. An entry's data also holds the
+// fd it was first mapped from, and with it the mount, so entries for a mount
+// have to be dropped before it can be unmounted.
+
+#define PAGE_CACHE_BUCKETS 256
+// how many entries nothing but the cache is using can be kept
+#define PAGE_CACHE_UNUSED_MAX 64
+
+#if __APPLE__
+#define TIMESPEC(x) st_##x##timespec
+#elif __linux__
+#define TIMESPEC(x) st_##x##tim
+#endif
+
+struct page_cache_entry {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct timespec ctime;
+    off_t size;
+    off_t offset; // in the file, of data->data
+    struct data *data;
+    struct page_cache_entry *next;
+    struct list lru;
+};
+
+static lock_t page_cache_lock = LOCK_INITIALIZER;
+static struct page_cache_entry *page_cache_buckets[PAGE_CACHE_BUCKETS];
+static struct list page_cache_lru = LIST_INITIALIZER(page_cache_lru);
+
+static unsigned page_cache_hash(dev_t dev, ino_t ino) {
+    return (unsigned) (ino ^ (dev * 31)) % PAGE_CACHE_BUCKETS;
+}
+
+static bool timespec_equal(struct timespec a, struct timespec b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static struct page_cache_entry *page_cache_find(struct stat *stat, off_t offset, size_t size) {
+    struct page_cache_entry *entry = page_cache_buckets[page_cache_hash(stat->st_dev, stat->st_ino)];
+    for (; entry != NULL; entry = entry->next) {
+        if (entry->dev == stat->st_dev && entry->ino == stat->st_ino &&
+                timespec_equal(entry->mtime, stat->TIMESPEC(m)) &&
+                timespec_equal(entry->ctime, stat->TIMESPEC(c)) &&
+                entry->size == stat->st_size &&
+                entry->offset <= offset && offset + size <= entry->offset + entry->data->size)
+            return entry;
+    }
+    return NULL;
+}
+
+static void page_cache_remove(struct page_cache_entry *entry) {
+    struct page_cache_entry **link = &page_cache_buckets[page_cache_hash(entry->dev, entry->ino)];
+    while (*link != entry)
+        link = &(*link)->next;
+    *link = entry->next;
+    list_remove(&entry->lru);
+    data_release(entry->data, 1);
+    free(entry);
+}
+
+// Drop least recently used entries that nothing else is using, past
+// PAGE_CACHE_UNUSED_MAX of them
+static void page_cache_trim(void) {
+    unsigned unused = 0;
+    struct page_cache_entry *entry, *tmp;
+    list_for_each_entry_safe(&page_cache_lru, entry, tmp, lru) {
+        if (entry->data->refcount != 1)
+            continue;
+        if (++unused <= PAGE_CACHE_UNUSED_MAX)
+            continue;
+        page_cache_remove(entry);
+    }
+}
+
+void page_cache_drop_mount(const char *point) {
+    lock(&page_cache_lock);
+    struct page_cache_entry *entry, *tmp;
+    list_for_each_entry_safe(&page_cache_lru, entry, tmp, lru) {
+        struct mount *mount = entry->data->fd->mount;
+        if (mount != NULL && strcmp(mount->point, point) == 0)
+            page_cache_remove(entry);
+    }
+    unlock(&page_cache_lock);
+}
+
+int page_cache_map(struct fd *fd, struct mem *mem, page_t start, pages_t pages, off_t offset, unsigned flags) {
+    struct stat stat;
+    if (fstat(fd->real_fd, &stat) < 0)
+        return errno_map();
+    size_t size = (size_t) pages << PAGE_BITS;
+    flags |= P_COW;
+
+    lock(&page_cache_lock);
+    struct page_cache_entry *entry = page_cache_find(&stat, offset, size);
+    if (entry != NULL) {
+        int err = pt_map_data(mem, start, pages, entry->data, offset - entry->offset, flags);
+        list_remove(&entry->lru);
+        list_add(&page_cache_lru, &entry->lru);
+        unlock(&page_cache_lock);
+        return err;
+    }
+    unlock(&page_cache_lock);
+
+    off_t real_offset = (offset / real_page_size) * real_page_size;
+    off_t correction = offset - real_offset;
+    char *memory = mmap(NULL, size + correction, PROT_READ, MAP_PRIVATE, fd->real_fd, real_offset);
+    int err = pt_map(mem, start, pages, memory, correction, flags);
+    if (err < 0)
+        return err;
+    struct data *data = mem_pt(mem, start)->data;
+    data->fd = fd_retain(fd);
+    data->file_offset = real_offset;
+
+    entry = malloc(sizeof(struct page_cache_entry));
+    if (entry == NULL)
+        return 0; // just don't cache it
+    *entry = (struct page_cache_entry) {
+        .dev = stat.st_dev,
+        .ino = stat.st_ino,
+        .mtime = stat.TIMESPEC(m),
+        .ctime = stat.TIMESPEC(c),
+        .size = stat.st_size,
+        .offset = real_offset,
+        .data = data,
+    };
+    data->refcount++;
+    lock(&page_cache_lock);
+    unsigned hash = page_cache_hash(stat.st_dev, stat.st_ino);
+    entry->next = page_cache_buckets[hash];
+    page_cache_buckets[hash] = entry;
+    list_add(&page_cache_lru, &entry->lru);
+    page_cache_trim();
+    unlock(&page_cache_lock);
+    return 0;
+}
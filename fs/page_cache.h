@@ -0,0 +1,21 @@
+#ifndef FS_PAGE_CACHE_H
+#define FS_PAGE_CACHE_H
+#include <sys/types.h>
+#include "kernel/memory.h"
+struct fd;
+
+// Read-only private mappings of the same part of the same host file are shared
+// between address spaces as one struct data, so processes running the same
+// binaries don't each map them again. Pages get mapped copy-on-write, in case
+// someone mprotects them writable later.
+
+// Same arguments as the mmap fd op, which should call this for mappings that
+// are private and not writable
+int page_cache_map(struct fd *fd, struct mem *mem, page_t start, pages_t pages, off_t offset, unsigned flags);
+
+// Forget every entry for a file on the mount at this point, so the cache's own
+// references don't keep it busy. Must be called without mounts_lock held,
+// since dropping the last reference to an fd takes it.
+void page_cache_drop_mount(const char *point);
+
+#endif
@@ -15,6 +15,7 @@
 
 #if defined(__linux__)
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #define HAVE_EPOLL 1
 #elif defined(__APPLE__)
 #include <sys/event.h>
@@ -34,6 +35,9 @@ static void *rpe_data(struct real_poll_event *rpe);
 static int rpe_events(struct real_poll_event *rpe);
 static int real_poll_wait(struct real_poll *real, struct real_poll_event *events, int max, struct timespec *timeout);
 static int real_poll_update(struct real_poll *real, int fd, int types, void *data);
+static int real_poll_notify_init(int notify[2]);
+static void real_poll_notify(int notify[2]);
+static int real_poll_notify_clear(int notify[2]);
 
 // lock order: fd, then poll
 
@@ -44,10 +48,12 @@ struct poll *poll_create(void) {
     int err = real_poll_init(&poll->real);
     if (err < 0)
         return ERR_PTR(errno_map());
+    poll->real_idle = 0;
     poll->waiters = 0;
-    poll->notify_pipe[0] = -1;
-    poll->notify_pipe[1] = -1;
+    poll->notify[0] = -1;
+    poll->notify[1] = -1;
     list_init(&poll->poll_fds);
+    list_init(&poll->ready);
     list_init(&poll->pollfd_freelist);
     lock_init(&poll->lock);
     return poll;
@@ -67,9 +73,29 @@ static struct poll_fd *poll_find_fd(struct poll *poll, struct fd *fd) {
     return NULL;
 }
 
+// Put it on the ready list so the next poll_wait checks it. Must be called
+// with the poll locked.
+static void poll_fd_queue(struct poll_fd *poll_fd) {
+    if (!list_null(&poll_fd->ready) || poll_fd->disabled)
+        return;
+    list_add_tail(&poll_fd->poll->ready, &poll_fd->ready);
+    if (poll_fd_is_real(poll_fd))
+        poll_fd->poll->real_idle--;
+}
+
+static void poll_fd_dequeue(struct poll_fd *poll_fd) {
+    list_remove(&poll_fd->ready);
+    if (poll_fd_is_real(poll_fd))
+        poll_fd->poll->real_idle++;
+}
+
 // See comment on pollfd_freelist for context
 static void poll_fd_free(struct poll_fd *poll_fd) {
     struct poll *poll = poll_fd->poll;
+    if (!list_null(&poll_fd->ready))
+        poll_fd_dequeue(poll_fd);
+    if (poll_fd_is_real(poll_fd) && !poll_fd->disabled)
+        poll->real_idle--;
     memset(poll_fd, 0xba, sizeof(*poll_fd));
     poll_fd->poll = NULL; // used to mark it as free
     list_add(&poll->pollfd_freelist, &poll_fd->fds);
@@ -100,6 +126,8 @@ int poll_add_fd(struct poll *poll, struct fd *fd, int types, union poll_fd_info
     poll_fd->types = types;
     poll_fd->info = info;
     poll_fd->triggered_types = 0;
+    poll_fd->ready.next = poll_fd->ready.prev = NULL;
+    poll_fd->disabled = false;
 
     if (poll_fd_is_real(poll_fd)) {
         err = real_poll_update(&poll->real, fd->real_fd, types, poll_fd);
@@ -108,10 +136,12 @@ int poll_add_fd(struct poll *poll, struct fd *fd, int types, union poll_fd_info
             err = errno_map();
             goto out;
         }
+        poll->real_idle++;
     }
 
     list_add(&fd->poll_fds, &poll_fd->polls);
     list_add(&poll->poll_fds, &poll_fd->fds);
+    poll_fd_queue(poll_fd);
 
     err = 0;
 out:
@@ -130,7 +160,8 @@ int poll_del_fd(struct poll *poll, struct fd *fd) {
         goto out;
     }
 
-    if (poll_fd_is_real(poll_fd)) {
+    // a disabled oneshot fd was already taken out of the real poll
+    if (poll_fd_is_real(poll_fd) && !poll_fd->disabled) {
         err = real_poll_update(&poll->real, fd->real_fd, 0, poll_fd);
         if (err < 0) {
             err = errno_map();
@@ -170,6 +201,12 @@ int poll_mod_fd(struct poll *poll, struct fd *fd, int types, union poll_fd_info
     poll_fd->types = types;
     poll_fd->info = info;
     poll_fd->triggered_types &= types;
+    if (poll_fd->disabled) {
+        poll_fd->disabled = false;
+        if (poll_fd_is_real(poll_fd))
+            poll->real_idle++;
+    }
+    poll_fd_queue(poll_fd);
 
     err = 0;
 out:
@@ -183,86 +220,162 @@ void poll_cleanup_fd(struct fd *fd) {
     struct poll_fd *poll_fd, *tmp;
     list_for_each_entry_safe(&fd->poll_fds, poll_fd, tmp, polls) {
         lock(&poll_fd->poll->lock);
-        if (poll_fd_is_real(poll_fd))
+        if (poll_fd_is_real(poll_fd) && !poll_fd->disabled)
             real_poll_update(&poll_fd->poll->real, fd->real_fd, 0, poll_fd);
         list_remove(&poll_fd->polls);
         list_remove(&poll_fd->fds);
-        unlock(&poll_fd->poll->lock);
+        struct poll *poll = poll_fd->poll;
         poll_fd_free(poll_fd);
+        unlock(&poll->lock);
     }
     unlock(&fd->poll_lock);
 }
 
 void poll_wakeup(struct fd *fd, int events) {
     struct poll_fd *poll_fd;
+    bool woke_exclusive = false;
     lock(&fd->poll_lock);
     list_for_each_entry(&fd->poll_fds, poll_fd, polls) {
         struct poll *poll = poll_fd->poll;
         lock(&poll->lock);
+        // Like Linux, of the polls added with EPOLLEXCLUSIVE, only the first
+        // one somebody is waiting on gets woken
+        bool exclusive = poll_fd->types & POLL_EXCLUSIVE;
+        if (exclusive && woke_exclusive) {
+            unlock(&poll->lock);
+            continue;
+        }
         if (poll_fd->types & POLL_EDGETRIGGERED)
             poll_fd->triggered_types &= ~events;
-        if (poll->notify_pipe[1] != -1)
-            write(poll->notify_pipe[1], "", 1);
+        poll_fd_queue(poll_fd);
+        if (poll->waiters > 0) {
+            real_poll_notify(poll->notify);
+            if (exclusive)
+                woke_exclusive = true;
+        }
         unlock(&poll->lock);
-        // oneshot?
     }
     unlock(&fd->poll_lock);
 }
 
-int poll_wait(struct poll *poll_, poll_callback_t callback, void *context, struct timespec *timeout) {
-    lock(&poll_->lock);
+// Queue the poll_fds the real poll returned, and return whether the notify fd
+// was one of them. Must be called with the poll locked.
+static bool poll_queue_real_events(struct real_poll_event *events, int count) {
+    bool notified = false;
+    for (int i = 0; i < count; i++) {
+        struct poll_fd *poll_fd = rpe_data(&events[i]);
+        if (poll_fd == NULL) {
+            notified = true;
+            continue;
+        }
+        // a NULL poll means it was freed
+        if (poll_fd->poll == NULL)
+            continue;
+        if (poll_fd->types & POLL_EDGETRIGGERED)
+            poll_fd->triggered_types &= ~rpe_events(&events[i]);
+        poll_fd_queue(poll_fd);
+    }
+    return notified;
+}
 
-    // acquire the pipe
-    if (poll_->waiters++ == 0) {
-        assert(poll_->notify_pipe[0] == -1 && poll_->notify_pipe[1] == -1);
-        if (pipe(poll_->notify_pipe) < 0) {
-            unlock(&poll_->lock);
+#define REAL_POLL_BATCH 16
+
+// Queue what the real poll has ready right now, without waiting. Must be
+// called with the poll locked.
+static int poll_collect_real(struct poll *poll) {
+    struct timespec zero = {};
+    struct real_poll_event e[REAL_POLL_BATCH];
+    // The real poll keeps reporting level-triggered fds that are still ready,
+    // including ones already on the ready list, so a full batch doesn't mean
+    // there's more to find. Stop when a batch doesn't queue anything new.
+    // Anything left over gets picked up next time, since the real poll moves
+    // what it reported to the back.
+    while (poll->real_idle > 0) {
+        int idle = poll->real_idle;
+        int count = real_poll_wait(&poll->real, e, REAL_POLL_BATCH, &zero);
+        if (count < 0)
             return errno_map();
+        poll_queue_real_events(e, count);
+        if (count < REAL_POLL_BATCH || poll->real_idle == idle)
+            break;
+    }
+    return 0;
+}
+
+// Check each poll_fd on the ready list once, and call the callback for the
+// ones with events. Must be called with the poll locked.
+static int poll_check_ready(struct poll *poll, poll_callback_t callback, void *context) {
+    int res = 0;
+    // poll_fds that are still ready get requeued after this, so they don't get
+    // checked twice
+    struct list end;
+    list_add_tail(&poll->ready, &end);
+    // and ones the callback had no room for go back at the front
+    struct list skipped;
+    list_init(&skipped);
+
+    while (poll->ready.next != &end) {
+        struct poll_fd *poll_fd = list_first_entry(&poll->ready, struct poll_fd, ready);
+        poll_fd_dequeue(poll_fd);
+        struct fd *fd = poll_fd->fd;
+        int poll_types = 0;
+        if (fd->ops->poll)
+            poll_types = fd->ops->poll(fd);
+        poll_types &= poll_fd->types | POLL_HUP | POLL_ERR;
+        if (poll_fd->types & POLL_EDGETRIGGERED)
+            poll_types &= ~poll_fd->triggered_types;
+        if (!poll_types) {
+            // it'll be queued again when something happens
+            continue;
+        }
+        if (callback(context, poll_types, poll_fd->info) != 1) {
+            list_add_tail(&skipped, &poll_fd->ready);
+            continue;
+        }
+        res++;
+
+        if (poll_fd->types & POLL_ONESHOT) {
+            // The real poll does not actually get the FDs set as oneshot, so
+            // take it out until it's modified. Only one thread can get each
+            // oneshot event since this is done with the poll locked.
+            poll_fd->disabled = true;
+            if (poll_fd_is_real(poll_fd)) {
+                real_poll_update(&poll->real, fd->real_fd, 0, poll_fd);
+                poll->real_idle--;
+            }
+        } else if (poll_fd->types & POLL_EDGETRIGGERED) {
+            poll_fd->triggered_types |= poll_types;
+        } else {
+            // level-triggered, so it'll be returned until it's not ready
+            poll_fd_queue(poll_fd);
         }
-        fcntl(poll_->notify_pipe[0], F_SETFL, O_NONBLOCK);
-        fcntl(poll_->notify_pipe[1], F_SETFL, O_NONBLOCK);
-        real_poll_update(&poll_->real, poll_->notify_pipe[0], POLL_READ, NULL);
     }
+    list_remove(&end);
+
+    while (!list_empty(&skipped)) {
+        struct poll_fd *poll_fd = list_entry(skipped.prev, struct poll_fd, ready);
+        list_remove(&poll_fd->ready);
+        list_add(&poll->ready, &poll_fd->ready);
+        if (poll_fd_is_real(poll_fd))
+            poll->real_idle--;
+    }
+    return res;
+}
+
+int poll_wait(struct poll *poll_, poll_callback_t callback, void *context, struct timespec *timeout) {
+    lock(&poll_->lock);
 
     // TODO this is pretty broken with regards to timeouts
     int res = 0;
     while (true) {
-        // check if any fds are ready
-        struct poll_fd *poll_fd, *tmp;
-        list_for_each_entry_safe(&poll_->poll_fds, poll_fd, tmp, fds) {
-            struct fd *fd = poll_fd->fd;
-            int poll_types = 0;
-            if (fd->ops->poll)
-                poll_types = fd->ops->poll(fd);
-            poll_types &= poll_fd->types | POLL_HUP | POLL_ERR;
-            if (poll_fd->types & POLL_EDGETRIGGERED) {
-                poll_types &= ~poll_fd->triggered_types;
-            }
-            if (poll_types) {
-                if (callback(context, poll_types, poll_fd->info) == 1)
-                    res++;
-
-                // The real poll does not actually get the FDs set as oneshot.
-                // But this loop is done while holding the lock, so only one
-                // thread can get each oneshot event. This doesn't solve the
-                // thundering herd problem at all, but at least the semantics
-                // are right. I'll just leave that as a TODO.
-                if (poll_fd->types & POLL_ONESHOT) {
-                    list_remove(&poll_fd->polls);
-                    list_remove(&poll_fd->fds);
-                    if (poll_fd_is_real(poll_fd)) {
-                        real_poll_update(&poll_->real, fd->real_fd, 0, NULL);
-                    }
-                    free(poll_fd);
-                }
-
-                if (poll_fd->types & POLL_EDGETRIGGERED) {
-                    poll_fd->triggered_types |= poll_types;
-                }
-            }
-        }
+        res = poll_collect_real(poll_);
+        if (res < 0)
+            break;
+        res = poll_check_ready(poll_, callback, context);
         if (res > 0)
             break;
+        if (timeout != NULL && timeout->tv_sec == 0 && timeout->tv_nsec == 0)
+            break;
 
         lock(&current->sighand->lock);
         bool signal_pending = !!(current->pending & ~current->blocked);
@@ -272,17 +385,28 @@ int poll_wait(struct poll *poll_, poll_callback_t callback, void *context, struc
             break;
         }
 
+        if (poll_->notify[0] == -1) {
+            if (real_poll_notify_init(poll_->notify) < 0) {
+                res = errno_map();
+                break;
+            }
+            real_poll_update(&poll_->real, poll_->notify[0], POLL_READ, NULL);
+        }
+
         // wait for a ready notification
+        struct poll_fd *poll_fd;
         list_for_each_entry(&poll_->poll_fds, poll_fd, fds) {
             sockrestart_begin_listen_wait(poll_fd->fd);
         }
+        poll_->waiters++;
         unlock(&poll_->lock);
         int err;
-        struct real_poll_event e[4];
+        struct real_poll_event e[REAL_POLL_BATCH];
         do {
-            err = real_poll_wait(&poll_->real, e, sizeof(e)/sizeof(e[0]), timeout);
+            err = real_poll_wait(&poll_->real, e, REAL_POLL_BATCH, timeout);
         } while (sockrestart_should_restart_listen_wait() && errno == EINTR);
         lock(&poll_->lock);
+        poll_->waiters--;
         list_for_each_entry(&poll_->poll_fds, poll_fd, fds) {
             sockrestart_end_listen_wait(poll_fd->fd);
         }
@@ -295,31 +419,12 @@ int poll_wait(struct poll *poll_, poll_callback_t callback, void *context, struc
             // timed out and still nobody is ready
             break;
         }
-
-        // dead with any edge-triggered notifications
-        for (int i = 0; i < err; i++) {
-            struct poll_fd *triggered_poll_fd = rpe_data(&e[i]);
-            if (triggered_poll_fd != NULL && triggered_poll_fd->poll != NULL &&
-                    triggered_poll_fd->types & POLL_EDGETRIGGERED) {
-                triggered_poll_fd->triggered_types &= ~rpe_events(&e[i]);
-            }
-        }
-
-        char fuck;
-        if (read(poll_->notify_pipe[0], &fuck, 1) < 0 && errno != EAGAIN) {
+        if (poll_queue_real_events(e, err) && real_poll_notify_clear(poll_->notify) < 0) {
             res = errno_map();
             break;
         }
     }
 
-    // release the pipe
-    if (--poll_->waiters == 0) {
-        close(poll_->notify_pipe[0]);
-        close(poll_->notify_pipe[1]);
-        poll_->notify_pipe[0] = -1;
-        poll_->notify_pipe[1] = -1;
-    }
-
     unlock(&poll_->lock);
     return res;
 }
@@ -340,6 +445,10 @@ void poll_destroy(struct poll *poll) {
         free(poll_fd);
     }
 
+    if (poll->notify[0] != -1)
+        close(poll->notify[0]);
+    if (poll->notify[1] != poll->notify[0])
+        close(poll->notify[1]);
     real_poll_close(&poll->real);
     free(poll);
 }
@@ -363,7 +472,7 @@ static int real_poll_wait(struct real_poll *real, struct real_poll_event *events
 }
 
 static int real_poll_update(struct real_poll *real, int fd, int types, void *data) {
-    types &= ~EPOLLONESHOT;
+    types &= ~(EPOLLONESHOT | EPOLLEXCLUSIVE);
     if (types == 0)
         return epoll_ctl(real->fd, EPOLL_CTL_DEL, fd, NULL);
     struct epoll_event epevent = {.events = types, .data.ptr = data};
@@ -376,6 +485,26 @@ static int real_poll_update(struct real_poll *real, int fd, int types, void *dat
 static void *rpe_data(struct real_poll_event *rpe) {
     return rpe->real.data.ptr;
 }
+
+static int real_poll_notify_init(int notify[2]) {
+    int fd = eventfd(0, EFD_NONBLOCK);
+    if (fd < 0)
+        return -1;
+    notify[0] = notify[1] = fd;
+    return 0;
+}
+
+static void real_poll_notify(int notify[2]) {
+    uint64_t one = 1;
+    write(notify[1], &one, sizeof(one));
+}
+
+static int real_poll_notify_clear(int notify[2]) {
+    uint64_t count;
+    if (read(notify[0], &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return -1;
+    return 0;
+}
 static int rpe_events(struct real_poll_event *rpe) {
     return rpe->real.events;
 }
@@ -418,6 +547,25 @@ static int real_poll_wait(struct real_poll *real, struct real_poll_event *events
 static void *rpe_data(struct real_poll_event *rpe) {
     return rpe->real.udata;
 }
+
+static int real_poll_notify_init(int notify[2]) {
+    if (pipe(notify) < 0)
+        return -1;
+    fcntl(notify[0], F_SETFL, O_NONBLOCK);
+    fcntl(notify[1], F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+static void real_poll_notify(int notify[2]) {
+    write(notify[1], "", 1);
+}
+
+static int real_poll_notify_clear(int notify[2]) {
+    char buf[64];
+    if (read(notify[0], buf, sizeof(buf)) < 0 && errno != EAGAIN)
+        return -1;
+    return 0;
+}
 static int rpe_events(struct real_poll_event *rpe) {
     if (rpe->real.filter == EVFILT_READ) {
         int events = 0;
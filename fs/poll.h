@@ -8,9 +8,20 @@ struct real_poll {
 
 struct poll {
     struct list poll_fds;
+    // poll_fds that might have events, so poll_wait doesn't have to look at
+    // all of them. They get put here when added or modified, by poll_wakeup,
+    // and when the real poll reports them, and stay while level-triggered
+    // events keep coming.
+    struct list ready;
     struct real_poll real;
-    int notify_pipe[2];
-    int waiters; // if nonzero, notify_pipe exists
+    // Real fds that aren't on the ready list, so poll_wait has to ask the real
+    // poll whether they have events. When this is zero it doesn't bother.
+    int real_idle;
+    // Registered in the real poll and written by poll_wakeup to wake up
+    // waiters. An eventfd where there are eventfds, otherwise a pipe. It's
+    // made the first time anyone waits and kept until poll_destroy.
+    int notify[2]; // read end, write end
+    int waiters;
 
     // This is used to solve the race/UaF described here: https://lwn.net/Articles/520012/
     // thread 1: calls poll_wait, real_poll_wait returns an event with a pointer to a poll_fd
@@ -44,6 +55,11 @@ struct poll_fd {
     // returned its bits are set here, and those bits are ignored on the next
     // call to poll_wait. The bits are cleared by poll_wakeup.
     int triggered_types;
+    // on the containing poll's ready list, or null
+    struct list ready;
+    // a oneshot event was returned, and nothing more will be until the next
+    // poll_mod_fd
+    bool disabled;
 
     // locked by containing struct fd
     struct poll *poll;
@@ -64,6 +80,7 @@ struct poll_fd {
 #define POLL_ERR 8
 #define POLL_HUP 16
 #define POLL_NVAL 32
+#define POLL_EXCLUSIVE (1 << 28)
 #define POLL_ONESHOT (1 << 30)
 #define POLL_EDGETRIGGERED (1ul << 31)
 struct poll_event {
@@ -1,6 +1,9 @@
 #include "fs/proc.h"
 #include "fs/proc/ish.h"
 #include "kernel/errno.h"
+#include "kernel/page_pool.h"
+#include "kernel/task.h"
+#include "asbestos/asbestos.h"
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -155,6 +158,51 @@ static bool proc_ish_defaults_readdir(struct proc_entry *entry, unsigned long *i
     return true;
 }
 
+static int proc_ish_show_jit(struct proc_entry *UNUSED(entry), struct proc_data *buf) {
+    struct asbestos_reclaim_stats reclaim;
+    asbestos_get_reclaim_stats(current->mem->mmu.asbestos, &reclaim);
+    proc_printf(buf, "blocks_retired %llu\n", (unsigned long long) reclaim.retired);
+    proc_printf(buf, "blocks_freed %llu\n", (unsigned long long) reclaim.freed);
+    proc_printf(buf, "free_latency_avg_ns %llu\n", (unsigned long long)
+            (reclaim.freed ? reclaim.latency_total_ns / reclaim.freed : 0));
+    proc_printf(buf, "free_latency_max_ns %llu\n", (unsigned long long) reclaim.latency_max_ns);
+#ifdef FIBER_PROFILE
+    struct asbestos_profile profile;
+    asbestos_get_profile(current->mem->mmu.asbestos, &profile);
+    proc_printf(buf, "dispatches %llu\n", (unsigned long long) profile.dispatches);
+    proc_printf(buf, "cache_hits %llu\n", (unsigned long long) profile.cache_hits);
+    proc_printf(buf, "hash_hits %llu\n", (unsigned long long) profile.hash_hits);
+    proc_printf(buf, "compiles %llu\n", (unsigned long long) profile.compiles);
+    proc_printf(buf, "trace_compiles %llu\n", (unsigned long long) profile.trace_compiles);
+    proc_printf(buf, "locks %llu\n", (unsigned long long) profile.locks);
+    proc_printf(buf, "invalidations %llu\n", (unsigned long long) profile.invalidations);
+    proc_printf(buf, "invalidated_blocks %llu\n", (unsigned long long) profile.invalidated_blocks);
+    proc_printf(buf, "tlb_accesses %llu\n", (unsigned long long) profile.tlb_accesses);
+    proc_printf(buf, "tlb_misses %llu\n", (unsigned long long) profile.tlb_misses);
+    proc_printf(buf, "tlb_victim_hits %llu\n", (unsigned long long) profile.tlb_victim_hits);
+    proc_printf(buf, "blocks %zu\n", profile.blocks);
+    proc_printf(buf, "hash_size %zu\n", profile.hash_size);
+    proc_printf(buf, "hash_buckets_used %zu\n", profile.hash_buckets_used);
+    proc_printf(buf, "hash_chain_max %zu\n", profile.hash_chain_max);
+    for (unsigned i = 0; i < profile.hot_count; i++) {
+        proc_printf(buf, "hot %08x-%08x %llu%s\n", profile.hot[i].addr, profile.hot[i].end_addr,
+                (unsigned long long) profile.hot[i].runs, profile.hot[i].is_trace ? " trace" : "");
+    }
+#endif
+    return 0;
+}
+
+static int proc_ish_show_pages(struct proc_entry *UNUSED(entry), struct proc_data *buf) {
+    struct page_pool_stats stats;
+    page_pool_get_stats(&stats);
+    proc_printf(buf, "pool_hits %llu\n", (unsigned long long) stats.hits);
+    proc_printf(buf, "pool_carved %llu\n", (unsigned long long) stats.carved);
+    proc_printf(buf, "pool_arenas %llu\n", (unsigned long long) stats.arenas);
+    proc_printf(buf, "pool_returned %llu\n", (unsigned long long) stats.returned);
+    proc_printf(buf, "pool_free_pages %llu\n", (unsigned long long) stats.free_pages);
+    return 0;
+}
+
 static int proc_ish_show_version(struct proc_entry *UNUSED(entry), struct proc_data *buf) {
     proc_printf(buf, "%s\n", proc_ish_version);
     return 0;
@@ -165,5 +213,7 @@ struct proc_children proc_ish_children = PROC_CHILDREN({
     {".defaults", S_IFDIR, .readdir = proc_ish_underlying_defaults_readdir},
     {"defaults", S_IFDIR, .readdir = proc_ish_defaults_readdir},
     {"documents", .show = proc_ish_show_documents},
+    {"jit", .show = proc_ish_show_jit},
+    {"pages", .show = proc_ish_show_pages},
     {"version", .show = proc_ish_show_version},
 });
@@ -177,13 +177,11 @@ void proc_maps_dump(struct task *task, struct proc_data *buf) {
     if (mem == NULL)
         return;
 
-    read_wrlock(&mem->lock);
+    mem_read_lock(mem);
     page_t page = 0;
     while (page < MEM_PAGES) {
         // find a region
-        while (page < MEM_PAGES && mem_pt(mem, page) == NULL) {
-            mem_next_page(mem, &page);
-        }
+        page = mem_next_mapped(mem, page);
         if (page >= MEM_PAGES)
             break;
         page_t start = page;
@@ -219,11 +217,11 @@ void proc_maps_dump(struct task *task, struct proc_data *buf) {
                 start_pt->flags & P_WRITE ? 'w' : '-',
                 start_pt->flags & P_EXEC ? 'x' : '-',
                 start_pt->flags & P_SHARED ? '-' : 'p',
-                (unsigned long) data->file_offset, // offset
+                (unsigned long) (data->fd != NULL ? data->file_offset + start_pt->offset : 0), // offset
                 0, // inode
                 path);
     }
-    read_wrunlock(&mem->lock);
+    mem_read_unlock(mem);
 }
 
 static int proc_pid_maps_show(struct proc_entry *entry, struct proc_data *buf) {
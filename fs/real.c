@@ -1,3 +1,6 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -10,12 +13,16 @@
 #include <sys/file.h>
 #include <sys/statvfs.h>
 #include <poll.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
 
 #include "debug.h"
 #include "kernel/errno.h"
 #include "kernel/calls.h"
 #include "kernel/fs.h"
 #include "fs/dev.h"
+#include "fs/page_cache.h"
 #include "fs/real.h"
 #include "fs/tty.h"
 #include "util/fchdir.h"
@@ -151,6 +158,51 @@ ssize_t realfs_pwrite(struct fd *fd, const void *buf, size_t bufsize, off_t off)
     return res;
 }
 
+#if defined(__linux__)
+// errors that mean this way of copying doesn't work for these fds
+static bool copy_unsupported(int err) {
+    return err == EINVAL || err == ENOSYS || err == EXDEV || err == EOPNOTSUPP || err == EBADF;
+}
+#endif
+
+ssize_t realfs_copy(struct fd *in, off_t_ *in_off, struct fd *out, off_t_ *out_off, size_t count) {
+#if defined(__linux__)
+    ssize_t res = -1;
+    errno = EINVAL;
+    // sendfile can read from anything that can be mmapped, but only writes at
+    // the file offset
+    if (out_off == NULL) {
+        off_t off = in_off ? *in_off : 0;
+        res = sendfile(out->real_fd, in->real_fd, in_off ? &off : NULL, count);
+        if (res >= 0 && in_off)
+            *in_off = off;
+    }
+    // copy_file_range does regular files, and splice does anything as long as
+    // one side is a pipe
+    for (int i = 0; i < 2 && res < 0 && copy_unsupported(errno); i++) {
+        loff_t real_in_off = in_off ? *in_off : 0;
+        loff_t real_out_off = out_off ? *out_off : 0;
+        if (i == 0)
+            res = copy_file_range(in->real_fd, in_off ? &real_in_off : NULL,
+                    out->real_fd, out_off ? &real_out_off : NULL, count, 0);
+        else
+            res = splice(in->real_fd, in_off ? &real_in_off : NULL,
+                    out->real_fd, out_off ? &real_out_off : NULL, count, SPLICE_F_MOVE);
+        if (res >= 0) {
+            if (in_off)
+                *in_off = real_in_off;
+            if (out_off)
+                *out_off = real_out_off;
+        }
+    }
+    if (res < 0)
+        return copy_unsupported(errno) ? _ENOSYS : errno_map();
+    return res;
+#else
+    return _ENOSYS;
+#endif
+}
+
 void realfs_opendir(struct fd *fd) {
     if (fd->dir == NULL) {
         int dirfd = dup(fd->real_fd);
@@ -250,6 +302,10 @@ int realfs_poll(struct fd *fd) {
 }
 
 int realfs_mmap(struct fd *fd, struct mem *mem, page_t start, pages_t pages, off_t offset, int prot, int flags) {
+#if !MEM_FLAT
+    if (flags & MMAP_PRIVATE && !(prot & P_WRITE))
+        return page_cache_map(fd, mem, start, pages, offset, prot);
+#endif
     int mmap_flags = 0;
     if (flags & MMAP_PRIVATE) mmap_flags |= MAP_PRIVATE;
     if (flags & MMAP_SHARED) mmap_flags |= MAP_SHARED;
@@ -260,7 +316,13 @@ int realfs_mmap(struct fd *fd, struct mem *mem, page_t start, pages_t pages, off
     off_t correction = offset - real_offset;
     char *memory = mmap(NULL, (pages * PAGE_SIZE) + correction,
             mmap_prot, mmap_flags, fd->real_fd, real_offset);
-    return pt_map(mem, start, pages, memory, correction, prot);
+    int err = pt_map(mem, start, pages, memory, correction, prot);
+    if (err < 0)
+        return err;
+    struct data *data = mem_pt(mem, start)->data;
+    data->fd = fd_retain(fd);
+    data->file_offset = real_offset;
+    return 0;
 }
 
 ssize_t realfs_readlink(struct mount *mount, const char *path, char *buf, size_t bufsize) {
@@ -32,6 +32,11 @@ int realfs_flock(struct fd *fd, int operation);
 int realfs_getpath(struct fd *fd, char *buf);
 ssize_t realfs_read(struct fd *fd, void *buf, size_t bufsize);
 ssize_t realfs_write(struct fd *fd, const void *buf, size_t bufsize);
+// Copy between two real fds without the data going through ish, for sendfile
+// and friends. NULL offsets mean use and update the file offset. Returns
+// _ENOSYS if the host can't do it for these fds, and then the caller has to
+// copy it itself.
+ssize_t realfs_copy(struct fd *in, off_t_ *in_off, struct fd *out, off_t_ *out_off, size_t count);
 
 int realfs_readdir(struct fd *fd, struct dir_entry *entry);
 unsigned long realfs_telldir(struct fd *fd);
@@ -21,6 +21,11 @@ int must_check user_write(addr_t addr, const void *buf, size_t count);
 int must_check user_read_task(struct task *task, addr_t addr, void *buf, size_t count);
 int must_check user_write_task(struct task *task, addr_t addr, const void *buf, size_t count);
 int must_check user_write_task_ptrace(struct task *task, addr_t addr, const void *buf, size_t count);
+// Gather size bytes from the buffers in an iovec into buf, or scatter them
+// from buf, with the memory lock taken once
+struct iovec_;
+int must_check user_read_iovec(const struct iovec_ *iovec, unsigned iovec_count, void *buf, size_t size);
+int must_check user_write_iovec(const struct iovec_ *iovec, unsigned iovec_count, const void *buf, size_t size);
 int must_check user_read_string(addr_t addr, char *buf, size_t max);
 int must_check user_write_string(addr_t addr, const char *buf);
 #define user_get(addr, var) user_read(addr, &(var), sizeof(var))
@@ -53,7 +58,7 @@ addr_t sys_mmap(addr_t args_addr);
 addr_t sys_mmap2(addr_t addr, dword_t len, dword_t prot, dword_t flags, fd_t fd_no, dword_t offset);
 int_t sys_munmap(addr_t addr, uint_t len);
 int_t sys_mprotect(addr_t addr, uint_t len, int_t prot);
-int_t sys_mremap(addr_t addr, dword_t old_len, dword_t new_len, dword_t flags);
+int_t sys_mremap(addr_t addr, dword_t old_len, dword_t new_len, dword_t flags, addr_t new_addr);
 dword_t sys_madvise(addr_t addr, dword_t len, dword_t advice);
 dword_t sys_mbind(addr_t addr, dword_t len, int_t mode, addr_t nodemask, dword_t maxnode, uint_t flags);
 int_t sys_mlock(addr_t addr, dword_t len);
@@ -31,6 +31,7 @@ struct epoll_event_ {
 #define EPOLL_CTL_MOD_ 3
 #define EPOLLET_ (1 << 31)
 #define EPOLLONESHOT_ (1 << 30)
+#define EPOLLEXCLUSIVE_ (1 << 28)
 
 int_t sys_epoll_ctl(fd_t epoll_f, int_t op, fd_t f, addr_t event_addr) {
     STRACE("epoll_ctl(%d, %d, %d, %#x)", epoll_f, op, f, event_addr);
@@ -56,6 +57,9 @@ int_t sys_epoll_ctl(fd_t epoll_f, int_t op, fd_t f, addr_t event_addr) {
             return _EEXIST;
         return poll_add_fd(epoll->epollfd.poll, fd, event.events, (union poll_fd_info) event.data);
     } else {
+        // like Linux, exclusive wakeups can only be asked for when adding
+        if (event.events & EPOLLEXCLUSIVE_)
+            return _EINVAL;
         return poll_mod_fd(epoll->epollfd.poll, fd, event.events, (union poll_fd_info) event.data);
     }
 }
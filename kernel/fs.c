@@ -8,6 +8,7 @@
 #include "fs/fd.h"
 #include "fs/path.h"
 #include "fs/dev.h"
+#include "fs/real.h"
 
 static struct fd *at_fd(fd_t f) {
     if (f == AT_FDCWD_)
@@ -209,15 +210,16 @@ dword_t sys_mknod(addr_t path_addr, mode_t_ mode, dev_t_ dev) {
     return sys_mknodat(AT_FDCWD_, path_addr, mode, dev);
 }
 
-static ssize_t sys_read_buf(fd_t fd_no, void *buf, size_t size) {
-    struct fd *fd = f_get(fd_no);
-    if (fd == NULL)
-        return _EBADF;
-    if (S_ISDIR(fd->type))
-        return _EISDIR;
-
+// Read at *off and advance it, or at the file offset if off is NULL
+static ssize_t fd_read_at(struct fd *fd, void *buf, size_t size, off_t_ *off) {
     ssize_t res;
-    if (fd->ops->read) {
+    if (off != NULL) {
+        if (!fd->ops->pread)
+            return _ESPIPE;
+        res = fd->ops->pread(fd, buf, size, *off);
+        if (res > 0)
+            *off += res;
+    } else if (fd->ops->read) {
         res = fd->ops->read(fd, buf, size);
     } else if (fd->ops->pread) {
         res = fd->ops->pread(fd, buf, size, fd->offset);
@@ -227,7 +229,38 @@ static ssize_t sys_read_buf(fd_t fd_no, void *buf, size_t size) {
     } else {
         return _EBADF;
     }
+    return res;
+}
 
+static ssize_t fd_write_at(struct fd *fd, const void *buf, size_t size, off_t_ *off) {
+    ssize_t res;
+    if (off != NULL) {
+        if (!fd->ops->pwrite)
+            return _ESPIPE;
+        res = fd->ops->pwrite(fd, buf, size, *off);
+        if (res > 0)
+            *off += res;
+    } else if (fd->ops->write) {
+        res = fd->ops->write(fd, buf, size);
+    } else if (fd->ops->pwrite) {
+        res = fd->ops->pwrite(fd, buf, size, fd->offset);
+        if (res > 0) {
+            fd->ops->lseek(fd, res, LSEEK_CUR);
+        }
+    } else {
+        return _EBADF;
+    }
+    return res;
+}
+
+static ssize_t sys_read_buf(fd_t fd_no, void *buf, size_t size) {
+    struct fd *fd = f_get(fd_no);
+    if (fd == NULL)
+        return _EBADF;
+    if (S_ISDIR(fd->type))
+        return _EISDIR;
+
+    ssize_t res = fd_read_at(fd, buf, size, NULL);
     if (res >= 0) {
         size_t print_size = res;
         if (print_size > 100) print_size = 100;
@@ -254,19 +287,7 @@ static ssize_t sys_write_buf(fd_t fd_no, void *buf, size_t size) {
     struct fd *fd = f_get(fd_no);
     if (fd == NULL)
         return _EBADF;
-
-    ssize_t res;
-    if (fd->ops->write) {
-        res = fd->ops->write(fd, buf, size);
-    } else if (fd->ops->pwrite) {
-        res = fd->ops->pwrite(fd, buf, size, fd->offset);
-        if (res > 0) {
-            fd->ops->lseek(fd, res, LSEEK_CUR);
-        }
-    } else {
-        return _EBADF;
-    }
-    return res;
+    return fd_write_at(fd, buf, size, NULL);
 }
 
 dword_t sys_write(fd_t fd_no, addr_t buf_addr, dword_t size) {
@@ -288,9 +309,9 @@ out:
     return res;
 }
 
-// The vector operations work by flattening the vector into a malloc buffer.
-// This at least isn't much worse than what it was before, which copied each
-// element of the vector into a malloc buffer. The perfect solution would be to
+// The vector operations work by flattening the vector into a malloc buffer,
+// which gets copied to or from the whole vector at once with
+// user_write_iovec/user_read_iovec. The perfect solution would be to
 // construct a vector with an entry for each page of the buffer. I haven't done
 // that yet because it's more work and the efficiency gain from that is dwarfed
 // by the inefficiency of the emulator.
@@ -330,17 +351,15 @@ dword_t sys_readv(fd_t fd_no, addr_t iovec_addr, dword_t iovec_count) {
         goto error;
 
     size_t offset = 0;
-    for (unsigned i = 0; i < iovec_count; i++) {
+    for (unsigned i = 0; i < iovec_count && offset < (size_t) res; i++) {
         size_t print_size = iovec[i].len;
+        if (print_size > (size_t) res - offset) print_size = res - offset;
         if (print_size > 100) print_size = 100;
         STRACE(" {\"%.*s\", %u}", print_size, buf + offset, iovec[i].len);
-
-        if (user_write(iovec[i].base, buf + offset, iovec[i].len)) {
-            res = _EFAULT;
-            goto error;
-        }
         offset += iovec[i].len;
     }
+    if (user_write_iovec(iovec, iovec_count, buf, res))
+        res = _EFAULT;
 
 error:
     free(buf);
@@ -360,14 +379,11 @@ dword_t sys_writev(fd_t fd_no, addr_t iovec_addr, dword_t iovec_count) {
         return _ENOMEM;
     }
 
-    ssize_t res = 0;
+    ssize_t res = _EFAULT;
+    if (user_read_iovec(iovec, iovec_count, buf, io_size))
+        goto error;
     size_t offset = 0;
     for (unsigned i = 0; i < iovec_count; i++) {
-        if (user_read(iovec[i].base, buf + offset, iovec[i].len)) {
-            res = _EFAULT;
-            goto error;
-        }
-
         size_t print_size = iovec[i].len;
         if (print_size > 100) print_size = 100;
         STRACE(" {\"%.*s\", %u}", print_size, buf + offset, iovec[i].len);
@@ -944,19 +960,165 @@ dword_t sys_fsync(fd_t f) {
     return err;
 }
 
-// a few stubs
-dword_t sys_sendfile(fd_t UNUSED(out_fd), fd_t UNUSED(in_fd), addr_t UNUSED(offset_addr), dword_t UNUSED(count)) {
-    return _EINVAL;
+// sendfile, splice and copy_file_range all copy between two fds without the
+// data going to userspace. Between real fds the host does the copying,
+// otherwise it goes through a buffer here.
+
+#define COPY_BUFFER_SIZE (64 << 10)
+#define MAX_RW_COUNT 0x7ffff000
+
+static ssize_t fd_copy(struct fd *in, off_t_ *in_off, struct fd *out, off_t_ *out_off, size_t count) {
+    if (count > MAX_RW_COUNT)
+        count = MAX_RW_COUNT;
+    if (in->ops->poll == realfs_poll && out->ops->poll == realfs_poll) {
+        ssize_t res = realfs_copy(in, in_off, out, out_off, count);
+        if (res != _ENOSYS)
+            return res;
+    }
+
+    size_t buf_size = count < COPY_BUFFER_SIZE ? count : COPY_BUFFER_SIZE;
+    char *buf = malloc(buf_size);
+    if (buf == NULL)
+        return _ENOMEM;
+    ssize_t res = 0;
+    size_t done = 0;
+    while (done < count) {
+        size_t chunk = count - done < buf_size ? count - done : buf_size;
+        ssize_t read_size = res = fd_read_at(in, buf, chunk, in_off);
+        if (res <= 0)
+            break;
+        ssize_t written = 0;
+        while (written < read_size) {
+            res = fd_write_at(out, buf + written, read_size - written, out_off);
+            if (res <= 0)
+                break;
+            written += res;
+        }
+        done += written;
+        if (written < read_size) {
+            // put back what didn't get written, if that's possible
+            ssize_t unwritten = read_size - written;
+            if (in_off != NULL)
+                *in_off -= unwritten;
+            else if (in->ops->lseek)
+                in->ops->lseek(in, -unwritten, LSEEK_CUR);
+            break;
+        }
+        // a pipe or socket would block on the next read
+        if ((size_t) read_size < chunk)
+            break;
+    }
+    free(buf);
+    if (done > 0)
+        return done;
+    return res;
+}
+
+static int fd_copy_mode(struct fd *fd, mode_t_ *mode) {
+    struct statbuf stat;
+    int err = fd->mount->fs->fstat(fd, &stat);
+    if (err < 0)
+        return err;
+    *mode = stat.mode;
+    return 0;
 }
-dword_t sys_sendfile64(fd_t UNUSED(out_fd), fd_t UNUSED(in_fd), addr_t UNUSED(offset_addr), dword_t UNUSED(count)) {
-    return _EINVAL;
+
+static dword_t sendfile_common(fd_t out_f, fd_t in_f, off_t_ *off, dword_t count) {
+    struct fd *in = f_get(in_f);
+    struct fd *out = f_get(out_f);
+    if (in == NULL || out == NULL)
+        return _EBADF;
+    return fd_copy(in, off, out, NULL, count);
 }
-dword_t sys_splice(fd_t UNUSED(in_fd), addr_t UNUSED(in_off_addr), fd_t UNUSED(out_fd), addr_t UNUSED(out_off_addr), dword_t UNUSED(count), dword_t UNUSED(flags)) {
-    return _EINVAL;
+
+dword_t sys_sendfile(fd_t out_f, fd_t in_f, addr_t offset_addr, dword_t count) {
+    STRACE("sendfile(%d, %d, %#x, %d)", out_f, in_f, offset_addr, count);
+    if (offset_addr == 0)
+        return sendfile_common(out_f, in_f, NULL, count);
+    sdword_t offset;
+    if (user_get(offset_addr, offset))
+        return _EFAULT;
+    off_t_ off = offset;
+    int_t res = sendfile_common(out_f, in_f, &off, count);
+    offset = off;
+    if (res >= 0 && user_put(offset_addr, offset))
+        return _EFAULT;
+    return res;
+}
+
+dword_t sys_sendfile64(fd_t out_f, fd_t in_f, addr_t offset_addr, dword_t count) {
+    STRACE("sendfile64(%d, %d, %#x, %d)", out_f, in_f, offset_addr, count);
+    if (offset_addr == 0)
+        return sendfile_common(out_f, in_f, NULL, count);
+    off_t_ off;
+    if (user_get(offset_addr, off))
+        return _EFAULT;
+    int_t res = sendfile_common(out_f, in_f, &off, count);
+    if (res >= 0 && user_put(offset_addr, off))
+        return _EFAULT;
+    return res;
 }
-dword_t sys_copy_file_range(fd_t UNUSED(in_fd), addr_t UNUSED(in_off), fd_t UNUSED(out_fd),
-        addr_t UNUSED(out_off), dword_t UNUSED(len), uint_t UNUSED(flags)) {
-    return _EPERM; // good enough for ruby
+
+// Does the part of splice and copy_file_range after the fds are checked
+static int_t copy_with_offsets(struct fd *in, addr_t in_off_addr, struct fd *out, addr_t out_off_addr, dword_t count) {
+    off_t_ in_off, out_off;
+    if (in_off_addr && user_get(in_off_addr, in_off))
+        return _EFAULT;
+    if (out_off_addr && user_get(out_off_addr, out_off))
+        return _EFAULT;
+    int_t res = fd_copy(in, in_off_addr ? &in_off : NULL, out, out_off_addr ? &out_off : NULL, count);
+    if (res >= 0) {
+        if (in_off_addr && user_put(in_off_addr, in_off))
+            return _EFAULT;
+        if (out_off_addr && user_put(out_off_addr, out_off))
+            return _EFAULT;
+    }
+    return res;
+}
+
+#define SPLICE_F_ALL_ 0xf
+
+dword_t sys_splice(fd_t in_f, addr_t in_off_addr, fd_t out_f, addr_t out_off_addr, dword_t count, dword_t flags) {
+    STRACE("splice(%d, %#x, %d, %#x, %d, %#x)", in_f, in_off_addr, out_f, out_off_addr, count, flags);
+    if (flags & ~SPLICE_F_ALL_)
+        return _EINVAL;
+    struct fd *in = f_get(in_f);
+    struct fd *out = f_get(out_f);
+    if (in == NULL || out == NULL)
+        return _EBADF;
+    mode_t_ in_mode, out_mode;
+    int err = fd_copy_mode(in, &in_mode);
+    if (err >= 0)
+        err = fd_copy_mode(out, &out_mode);
+    if (err < 0)
+        return err;
+    // one end has to be a pipe, and pipes don't have offsets
+    if (!S_ISFIFO(in_mode) && !S_ISFIFO(out_mode))
+        return _EINVAL;
+    if ((S_ISFIFO(in_mode) && in_off_addr) || (S_ISFIFO(out_mode) && out_off_addr))
+        return _ESPIPE;
+    return copy_with_offsets(in, in_off_addr, out, out_off_addr, count);
+}
+
+dword_t sys_copy_file_range(fd_t in_f, addr_t in_off_addr, fd_t out_f, addr_t out_off_addr, dword_t len, uint_t flags) {
+    STRACE("copy_file_range(%d, %#x, %d, %#x, %d, %#x)", in_f, in_off_addr, out_f, out_off_addr, len, flags);
+    if (flags != 0)
+        return _EINVAL;
+    struct fd *in = f_get(in_f);
+    struct fd *out = f_get(out_f);
+    if (in == NULL || out == NULL)
+        return _EBADF;
+    mode_t_ in_mode, out_mode;
+    int err = fd_copy_mode(in, &in_mode);
+    if (err >= 0)
+        err = fd_copy_mode(out, &out_mode);
+    if (err < 0)
+        return err;
+    if (S_ISDIR(in_mode) || S_ISDIR(out_mode))
+        return _EISDIR;
+    if (!S_ISREG(in_mode) || !S_ISREG(out_mode))
+        return _EINVAL;
+    return copy_with_offsets(in, in_off_addr, out, out_off_addr, len);
 }
 
 dword_t sys_xattr_stub(addr_t UNUSED(path_addr), addr_t UNUSED(name_addr),
@@ -3,64 +3,132 @@
 #define FUTEX_WAIT_ 0
 #define FUTEX_WAKE_ 1
 #define FUTEX_REQUEUE_ 3
+#define FUTEX_CMP_REQUEUE_ 4
+#define FUTEX_WAKE_OP_ 5
+#define FUTEX_LOCK_PI_ 6
+#define FUTEX_UNLOCK_PI_ 7
+#define FUTEX_TRYLOCK_PI_ 8
+#define FUTEX_WAIT_BITSET_ 9
+#define FUTEX_WAKE_BITSET_ 10
 #define FUTEX_PRIVATE_FLAG_ 128
-#define FUTEX_CMD_MASK_ ~(FUTEX_PRIVATE_FLAG_)
+#define FUTEX_CLOCK_REALTIME_ 256
+#define FUTEX_CMD_MASK_ ~(FUTEX_PRIVATE_FLAG_ | FUTEX_CLOCK_REALTIME_)
+
+#define FUTEX_BITSET_MATCH_ANY_ 0xffffffff
+
+// the word of a PI futex is the owner's tid plus these
+#define FUTEX_WAITERS_ 0x80000000
+#define FUTEX_OWNER_DIED_ 0x40000000
+#define FUTEX_TID_MASK_ 0x3fffffff
 
 struct futex {
     atomic_uint refcount;
     struct mem *mem;
     addr_t addr;
     struct list queue;
-    struct list chain; // locked by futex_hash_lock
+    struct list chain; // locked by the bucket's lock
 };
 
 struct futex_wait {
     cond_t cond;
     struct futex *futex; // will be changed by a requeue
+    dword_t bitset;
     struct list queue;
+    // PI waits only: who's waiting, and set by futex_unlock_pi when it hands
+    // them the lock
+    dword_t tid;
+    bool pi_owner;
 };
 
+// Each bucket has its own lock, which protects the futexes in it and their
+// queues, so threads using unrelated futexes don't get in each other's way.
 #define FUTEX_HASH_BITS 12
 #define FUTEX_HASH_SIZE (1 << FUTEX_HASH_BITS)
-static lock_t futex_lock = LOCK_INITIALIZER;
-static struct list futex_hash[FUTEX_HASH_SIZE];
+// futexes kept around by each bucket after they're done with, so waiting
+// usually doesn't need a malloc
+#define FUTEX_BUCKET_SPARES 2
+struct futex_bucket {
+    lock_t lock;
+    struct list chain;
+    struct futex *spares[FUTEX_BUCKET_SPARES];
+    unsigned spares_count;
+};
+static struct futex_bucket futex_hash[FUTEX_HASH_SIZE];
 
 static void __attribute__((constructor)) init_futex_hash(void) {
-    for (int i = 0; i < FUTEX_HASH_SIZE; i++)
-        list_init(&futex_hash[i]);
+    for (int i = 0; i < FUTEX_HASH_SIZE; i++) {
+        lock_init(&futex_hash[i].lock);
+        list_init(&futex_hash[i].chain);
+    }
 }
 
-static struct futex *futex_get_unlocked(addr_t addr) {
-    int hash = (addr ^ (unsigned long) current->mem) % FUTEX_HASH_SIZE;
-    struct list *bucket = &futex_hash[hash];
+static struct futex_bucket *futex_bucket(struct mem *mem, addr_t addr) {
+    return &futex_hash[(addr ^ (unsigned long) mem) % FUTEX_HASH_SIZE];
+}
+
+// Lock the buckets for two futexes in a consistent order, so two requeues
+// going opposite ways can't deadlock
+static void futex_lock_two(struct futex_bucket *a, struct futex_bucket *b) {
+    if (a == b) {
+        lock(&a->lock);
+    } else if (a < b) {
+        lock(&a->lock);
+        lock(&b->lock);
+    } else {
+        lock(&b->lock);
+        lock(&a->lock);
+    }
+}
+static void futex_unlock_two(struct futex_bucket *a, struct futex_bucket *b) {
+    unlock(&a->lock);
+    if (a != b)
+        unlock(&b->lock);
+}
+
+// Returns the futex for the current process at the given addr, or NULL if
+// nothing is using it
+static struct futex *futex_find_unlocked(addr_t addr) {
+    struct futex_bucket *bucket = futex_bucket(current->mem, addr);
     struct futex *futex;
-    list_for_each_entry(bucket, futex, chain) {
-        if (futex->addr == addr && futex->mem == current->mem) {
-            futex->refcount++;
+    list_for_each_entry(&bucket->chain, futex, chain) {
+        if (futex->addr == addr && futex->mem == current->mem)
             return futex;
-        }
     }
+    return NULL;
+}
 
-    futex = malloc(sizeof(struct futex));
-    if (futex == NULL) {
-        unlock(&futex_lock);
-        return NULL;
+// Must be called with the bucket for addr locked
+static struct futex *futex_get_unlocked(addr_t addr) {
+    struct futex *futex = futex_find_unlocked(addr);
+    if (futex != NULL) {
+        futex->refcount++;
+        return futex;
     }
+
+    struct futex_bucket *bucket = futex_bucket(current->mem, addr);
+    if (bucket->spares_count > 0)
+        futex = bucket->spares[--bucket->spares_count];
+    else
+        futex = malloc(sizeof(struct futex));
+    if (futex == NULL)
+        return NULL;
     futex->refcount = 1;
     futex->mem = current->mem;
     futex->addr = addr;
     list_init(&futex->queue);
-    list_add(bucket, &futex->chain);
+    list_add(&bucket->chain, &futex->chain);
     return futex;
 }
 
-// Returns the futex for the current process at the given addr, and locks it
-// Unlocked variant is available for times when you need to get two futexes at once
+// Returns the futex for the current process at the given addr, and locks its
+// bucket. Unlocked variant is available for times when you need to get two
+// futexes at once.
 static struct futex *futex_get(addr_t addr) {
-    lock(&futex_lock);
+    struct futex_bucket *bucket = futex_bucket(current->mem, addr);
+    lock(&bucket->lock);
     struct futex *futex = futex_get_unlocked(addr);
     if (futex == NULL)
-        unlock(&futex_lock);
+        unlock(&bucket->lock);
     return futex;
 }
 
@@ -68,21 +136,25 @@ static void futex_put_unlocked(struct futex *futex) {
     if (--futex->refcount == 0) {
         assert(list_empty(&futex->queue));
         list_remove(&futex->chain);
-        free(futex);
+        struct futex_bucket *bucket = futex_bucket(futex->mem, futex->addr);
+        if (bucket->spares_count < FUTEX_BUCKET_SPARES)
+            bucket->spares[bucket->spares_count++] = futex;
+        else
+            free(futex);
     }
 }
 
 // Must be called on the result of futex_get when you're done with it
 // Also has an unlocked version, for releasing the result of futex_get_unlocked
 static void futex_put(struct futex *futex) {
+    struct futex_bucket *bucket = futex_bucket(futex->mem, futex->addr);
     futex_put_unlocked(futex);
-    unlock(&futex_lock);
+    unlock(&bucket->lock);
 }
 
-static int futex_load(struct futex *futex, dword_t *out) {
-    assert(futex->mem == current->mem);
+static int futex_load(addr_t addr, dword_t *out) {
     read_wrlock(&current->mem->lock);
-    dword_t *ptr = mem_ptr(current->mem, futex->addr, MEM_READ);
+    dword_t *ptr = mem_ptr(current->mem, addr, MEM_READ);
     read_wrunlock(&current->mem->lock);
     if (ptr == NULL)
         return 1;
@@ -90,90 +162,417 @@ static int futex_load(struct futex *futex, dword_t *out) {
     return 0;
 }
 
-static int futex_wait(addr_t uaddr, dword_t val, struct timespec *timeout) {
+// Atomically replace the futex word with desired if it's expected, and set
+// *old to what it was. Returns 1 if the word can't be written.
+static int futex_cmpxchg(addr_t addr, dword_t expected, dword_t desired, dword_t *old) {
+    read_wrlock(&current->mem->lock);
+    dword_t *ptr = mem_ptr(current->mem, addr, MEM_WRITE);
+    if (ptr != NULL)
+        __atomic_compare_exchange_n(ptr, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    read_wrunlock(&current->mem->lock);
+    if (ptr == NULL)
+        return 1;
+    *old = expected;
+    return 0;
+}
+
+// Wait on the futex at uaddr until woken by a wake whose bitset has a bit in
+// common with bitset. deadline is absolute CLOCK_MONOTONIC, and can be NULL.
+static int futex_wait(addr_t uaddr, dword_t val, struct timespec *deadline, dword_t bitset) {
     struct futex *futex = futex_get(uaddr);
+    if (futex == NULL)
+        return _ENOMEM;
     int err = 0;
     dword_t tmp;
-    if (futex_load(futex, &tmp))
+    if (futex_load(uaddr, &tmp))
         err = _EFAULT;
     else if (tmp != val)
         err = _EAGAIN;
     else {
         struct futex_wait wait;
-        wait.cond = COND_INITIALIZER;
+        cond_init(&wait.cond);
         wait.futex = futex;
+        wait.bitset = bitset;
+        wait.tid = current->pid;
+        wait.pi_owner = false;
         list_add_tail(&futex->queue, &wait.queue);
-        err = wait_for(&wait.cond, &futex_lock, timeout);
-        futex = wait.futex;
+        struct futex_bucket *bucket = futex_bucket(futex->mem, futex->addr);
+        err = wait_until(&wait.cond, &bucket->lock, deadline);
+        // A requeue could have moved the wait to a futex in another bucket,
+        // which is locked by that bucket's lock. Requeueing needs the lock
+        // of the bucket it's moving from, so once the lock for where the
+        // wait is now is held, it can't move again.
+        for (;;) {
+            futex = __atomic_load_n(&wait.futex, __ATOMIC_ACQUIRE);
+            struct futex_bucket *new_bucket = futex_bucket(futex->mem, futex->addr);
+            if (new_bucket == bucket)
+                break;
+            unlock(&bucket->lock);
+            lock(&new_bucket->lock);
+            bucket = new_bucket;
+        }
         list_remove_safe(&wait.queue);
+        cond_destroy(&wait.cond);
     }
     futex_put(futex);
     STRACE("%d end futex(FUTEX_WAIT)", current->pid);
     return err;
 }
 
-static int futex_wakelike(int op, addr_t uaddr, dword_t wake_max, dword_t requeue_max, addr_t requeue_addr) {
-    struct futex *futex = futex_get(uaddr);
-
+// Wake up to wake_max waits on futex that match bitset. Must be called with
+// the futex's bucket locked.
+static unsigned futex_wake_waits(struct futex *futex, dword_t wake_max, dword_t bitset) {
     struct futex_wait *wait, *tmp;
     unsigned woken = 0;
     list_for_each_entry_safe(&futex->queue, wait, tmp, queue) {
         if (woken >= wake_max)
             break;
+        if (!(wait->bitset & bitset))
+            continue;
         notify(&wait->cond);
         list_remove(&wait->queue);
         woken++;
     }
+    return woken;
+}
+
+// Do the operation encoded in a FUTEX_WAKE_OP to the futex word at addr, and
+// return whether the old value passes the comparison also encoded in it
+static int futex_wake_op_apply(addr_t addr, dword_t encoded, bool *cmp_result) {
+    int op = (encoded >> 28) & 7;
+    int cmp = (encoded >> 24) & 15;
+    // 12-bit signed arguments
+    int_t oparg = (int_t) (encoded << 8) >> 20;
+    int_t cmparg = (int_t) (encoded << 20) >> 20;
+    if (encoded & (8 << 28))
+        oparg = 1 << (oparg & 31);
+
+    dword_t old = 0, new;
+    if (futex_load(addr, &old))
+        return _EFAULT;
+    for (;;) {
+        switch (op) {
+            case 0: new = oparg; break; // set
+            case 1: new = old + oparg; break; // add
+            case 2: new = old | oparg; break; // or
+            case 3: new = old & ~oparg; break; // andn
+            case 4: new = old ^ oparg; break; // xor
+            default: return _ENOSYS;
+        }
+        dword_t seen;
+        if (futex_cmpxchg(addr, old, new, &seen))
+            return _EFAULT;
+        if (seen == old)
+            break;
+        old = seen;
+    }
+
+    switch (cmp) {
+        case 0: *cmp_result = (int_t) old == cmparg; break;
+        case 1: *cmp_result = (int_t) old != cmparg; break;
+        case 2: *cmp_result = (int_t) old < cmparg; break;
+        case 3: *cmp_result = (int_t) old <= cmparg; break;
+        case 4: *cmp_result = (int_t) old > cmparg; break;
+        case 5: *cmp_result = (int_t) old >= cmparg; break;
+        default: return _ENOSYS;
+    }
+    return 0;
+}
+
+// val2 is how many to requeue, or for FUTEX_WAKE_OP how many to wake on
+// uaddr2. val3 is the value to compare with for FUTEX_CMP_REQUEUE, the bitset
+// for FUTEX_WAKE_BITSET, and the operation for FUTEX_WAKE_OP.
+static int futex_wakelike(int op, addr_t uaddr, dword_t wake_max, dword_t val2, addr_t uaddr2, dword_t val3) {
+    struct futex_bucket *bucket = futex_bucket(current->mem, uaddr);
+    struct futex_bucket *bucket2 = bucket;
+    bool requeue = op == FUTEX_REQUEUE_ || op == FUTEX_CMP_REQUEUE_;
+    if (requeue || op == FUTEX_WAKE_OP_)
+        bucket2 = futex_bucket(current->mem, uaddr2);
+    futex_lock_two(bucket, bucket2);
 
-    if (op == FUTEX_REQUEUE_) {
-        struct futex *futex2 = futex_get_unlocked(requeue_addr);
+    int err = 0;
+    bool wake2 = false;
+    if (op == FUTEX_CMP_REQUEUE_) {
+        dword_t val;
+        if (futex_load(uaddr, &val))
+            err = _EFAULT;
+        else if (val != val3)
+            err = _EAGAIN;
+    } else if (op == FUTEX_WAKE_OP_) {
+        err = futex_wake_op_apply(uaddr2, val3, &wake2);
+    }
+    if (err < 0) {
+        futex_unlock_two(bucket, bucket2);
+        return err;
+    }
+
+    unsigned woken = 0;
+    dword_t bitset = op == FUTEX_WAKE_BITSET_ ? val3 : FUTEX_BITSET_MATCH_ANY_;
+    // no futex means nobody's waiting, which is the common case for wakes
+    struct futex *futex = futex_find_unlocked(uaddr);
+    if (futex != NULL)
+        woken = futex_wake_waits(futex, wake_max, bitset);
+
+    if (op == FUTEX_WAKE_OP_ && wake2) {
+        struct futex *futex2 = futex_find_unlocked(uaddr2);
+        if (futex2 != NULL)
+            woken += futex_wake_waits(futex2, val2, FUTEX_BITSET_MATCH_ANY_);
+    }
+
+    if (requeue && futex != NULL && !list_empty(&futex->queue)) {
+        // keeps futex from being freed when the last wait moves off it
+        futex->refcount++;
+        struct futex *futex2 = futex_get_unlocked(uaddr2);
+        if (futex2 == NULL) {
+            futex_put_unlocked(futex);
+            futex_unlock_two(bucket, bucket2);
+            return _ENOMEM;
+        }
+        struct futex_wait *wait, *tmp;
         unsigned requeued = 0;
         list_for_each_entry_safe(&futex->queue, wait, tmp, queue) {
-            if (requeued >= requeue_max)
+            if (requeued >= val2)
                 break;
-            // sketchy as hell
+            // the wait stays asleep and gets woken by whoever wakes futex2
             list_remove(&wait->queue);
             list_add_tail(&futex2->queue, &wait->queue);
             assert(futex->refcount > 1); // should be true because this function keeps a reference
             futex->refcount--;
             futex2->refcount++;
-            wait->futex = futex2;
+            __atomic_store_n(&wait->futex, futex2, __ATOMIC_RELEASE);
             requeued++;
         }
         futex_put_unlocked(futex2);
+        futex_put_unlocked(futex);
         woken += requeued;
     }
 
-    futex_put(futex);
+    futex_unlock_two(bucket, bucket2);
     return woken;
 }
 
 int futex_wake(addr_t uaddr, dword_t wake_max) {
-    return futex_wakelike(FUTEX_WAKE_, uaddr, wake_max, 0, 0);
+    return futex_wakelike(FUTEX_WAKE_, uaddr, wake_max, 0, 0, 0);
+}
+
+static bool futex_owner_gone(dword_t tid) {
+    lock(&pids_lock);
+    bool gone = pid_get_task(tid) == NULL;
+    unlock(&pids_lock);
+    return gone;
+}
+
+// There are no priorities to inherit, so PI futexes are just the protocol:
+// the word holds the owner's tid, and FUTEX_WAITERS makes the owner unlock
+// through the kernel so it can wake someone.
+static int futex_lock_pi(addr_t uaddr, struct timespec *deadline, bool try) {
+    struct futex *futex = futex_get(uaddr);
+    if (futex == NULL)
+        return _ENOMEM;
+    struct futex_bucket *bucket = futex_bucket(futex->mem, futex->addr);
+    int err;
+    for (;;) {
+        dword_t val;
+        if (futex_load(uaddr, &val)) {
+            err = _EFAULT;
+            break;
+        }
+        dword_t owner = val & FUTEX_TID_MASK_;
+        if (owner == (dword_t) current->pid) {
+            err = _EDEADLK;
+            break;
+        }
+        dword_t seen;
+        if (owner == 0 || futex_owner_gone(owner)) {
+            // take it, and leave the waiters bit on if anyone else is waiting
+            dword_t new = current->pid;
+            if (!list_empty(&futex->queue))
+                new |= FUTEX_WAITERS_;
+            if (owner != 0)
+                new |= FUTEX_OWNER_DIED_;
+            if (futex_cmpxchg(uaddr, val, new, &seen)) {
+                err = _EFAULT;
+                break;
+            }
+            if (seen != val)
+                continue;
+            err = 0;
+            break;
+        }
+        if (try) {
+            err = _EAGAIN;
+            break;
+        }
+        if (!(val & FUTEX_WAITERS_)) {
+            if (futex_cmpxchg(uaddr, val, val | FUTEX_WAITERS_, &seen)) {
+                err = _EFAULT;
+                break;
+            }
+            if (seen != val)
+                continue;
+        }
+
+        struct futex_wait wait;
+        cond_init(&wait.cond);
+        wait.futex = futex;
+        wait.bitset = FUTEX_BITSET_MATCH_ANY_;
+        wait.tid = current->pid;
+        wait.pi_owner = false;
+        list_add_tail(&futex->queue, &wait.queue);
+        err = wait_until(&wait.cond, &bucket->lock, deadline);
+        list_remove_safe(&wait.queue);
+        cond_destroy(&wait.cond);
+        // if the lock was handed over, it's ours even if the wait timed out
+        // or got interrupted after that, and nobody else will be woken for it
+        if (wait.pi_owner) {
+            err = 0;
+            break;
+        }
+        if (err < 0)
+            break;
+    }
+    futex_put(futex);
+    return err;
+}
+
+static int futex_unlock_pi(addr_t uaddr) {
+    struct futex_bucket *bucket = futex_bucket(current->mem, uaddr);
+    lock(&bucket->lock);
+    int err = 0;
+    dword_t val, seen;
+    if (futex_load(uaddr, &val)) {
+        err = _EFAULT;
+        goto out;
+    }
+    // Hand the lock straight to the first waiter, like Linux does. If it was
+    // just unlocked and the waiter woken to take it, the waiter could give up
+    // on a timeout instead, and nobody would wake the rest of the queue.
+    struct futex *futex = futex_find_unlocked(uaddr);
+    struct futex_wait *next = NULL;
+    dword_t new = 0;
+    if (futex != NULL && !list_empty(&futex->queue)) {
+        next = list_first_entry(&futex->queue, struct futex_wait, queue);
+        new = next->tid;
+        // still someone else waiting
+        if (next->queue.next != &futex->queue)
+            new |= FUTEX_WAITERS_;
+    }
+    for (;;) {
+        if ((val & FUTEX_TID_MASK_) != (dword_t) current->pid) {
+            err = _EPERM;
+            goto out;
+        }
+        if (futex_cmpxchg(uaddr, val, new, &seen)) {
+            err = _EFAULT;
+            goto out;
+        }
+        if (seen == val)
+            break;
+        // someone set the waiters bit in between, try again with it
+        val = seen;
+    }
+    if (next != NULL) {
+        next->pi_owner = true;
+        notify(&next->cond);
+        list_remove(&next->queue);
+    }
+out:
+    unlock(&bucket->lock);
+    return err;
+}
+
+// Turn a futex timeout into an absolute CLOCK_MONOTONIC deadline. realtime
+// says the timeout is absolute CLOCK_REALTIME, and absolute says it's
+// absolute at all.
+static int futex_deadline(addr_t timeout_addr, bool absolute, bool realtime, struct timespec *deadline) {
+    struct timespec_ timeout_;
+    if (user_get(timeout_addr, timeout_))
+        return _EFAULT;
+    if (timeout_.nsec >= 1000000000)
+        return _EINVAL;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    deadline->tv_sec = timeout_.sec;
+    deadline->tv_nsec = timeout_.nsec;
+    if (absolute && !realtime)
+        return 0;
+    if (realtime) {
+        // same distance in the future, but on the monotonic clock
+        struct timespec real_now;
+        clock_gettime(CLOCK_REALTIME, &real_now);
+        deadline->tv_sec -= real_now.tv_sec;
+        deadline->tv_nsec -= real_now.tv_nsec;
+        if (deadline->tv_nsec < 0) {
+            deadline->tv_sec--;
+            deadline->tv_nsec += 1000000000;
+        }
+    }
+    deadline->tv_sec += now.tv_sec;
+    deadline->tv_nsec += now.tv_nsec;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+    return 0;
 }
 
 dword_t sys_futex(addr_t uaddr, dword_t op, dword_t val, addr_t timeout_or_val2, addr_t uaddr2, dword_t val3) {
     if (!(op & FUTEX_PRIVATE_FLAG_)) {
         STRACE("!FUTEX_PRIVATE ");
     }
-    struct timespec timeout = {0};
-    if ((op & FUTEX_CMD_MASK_) == FUTEX_WAIT_ && timeout_or_val2) {
-        struct timespec_ timeout_;
-        if (user_get(timeout_or_val2, timeout_))
-            return _EFAULT;
-        timeout.tv_sec = timeout_.sec;
-        timeout.tv_nsec = timeout_.nsec;
+    if (uaddr % sizeof(dword_t) != 0)
+        return _EINVAL;
+    int cmd = op & FUTEX_CMD_MASK_;
+    bool realtime = op & FUTEX_CLOCK_REALTIME_;
+    struct timespec deadline;
+    struct timespec *deadline_ptr = NULL;
+    if ((cmd == FUTEX_WAIT_ || cmd == FUTEX_WAIT_BITSET_ || cmd == FUTEX_LOCK_PI_) && timeout_or_val2) {
+        // FUTEX_WAIT's timeout is relative, the others are absolute, and
+        // FUTEX_LOCK_PI's is always CLOCK_REALTIME
+        bool absolute = cmd != FUTEX_WAIT_;
+        int err = futex_deadline(timeout_or_val2, absolute,
+                absolute && (realtime || cmd == FUTEX_LOCK_PI_), &deadline);
+        if (err < 0)
+            return err;
+        deadline_ptr = &deadline;
     }
-    switch (op & FUTEX_CMD_MASK_) {
+    switch (cmd) {
         case FUTEX_WAIT_:
-            STRACE("futex(FUTEX_WAIT, %#x, %d, 0x%x {%ds %dns}) = ...\n", uaddr, val, timeout_or_val2, timeout.tv_sec, timeout.tv_nsec);
-            return futex_wait(uaddr, val, timeout_or_val2 ? &timeout : NULL);
+            STRACE("futex(FUTEX_WAIT, %#x, %d, %#x) = ...\n", uaddr, val, timeout_or_val2);
+            return futex_wait(uaddr, val, deadline_ptr, FUTEX_BITSET_MATCH_ANY_);
+        case FUTEX_WAIT_BITSET_:
+            STRACE("futex(FUTEX_WAIT_BITSET, %#x, %d, %#x, %#x) = ...\n", uaddr, val, timeout_or_val2, val3);
+            if (val3 == 0)
+                return _EINVAL;
+            return futex_wait(uaddr, val, deadline_ptr, val3);
         case FUTEX_WAKE_:
             STRACE("futex(FUTEX_WAKE, %#x, %d)", uaddr, val);
-            return futex_wakelike(op & FUTEX_CMD_MASK_, uaddr, val, 0, 0);
+            return futex_wakelike(cmd, uaddr, val, 0, 0, 0);
+        case FUTEX_WAKE_BITSET_:
+            STRACE("futex(FUTEX_WAKE_BITSET, %#x, %d, %#x)", uaddr, val, val3);
+            if (val3 == 0)
+                return _EINVAL;
+            return futex_wakelike(cmd, uaddr, val, 0, 0, val3);
         case FUTEX_REQUEUE_:
             STRACE("futex(FUTEX_REQUEUE, %#x, %d, %#x)", uaddr, val, uaddr2);
-            return futex_wakelike(op & FUTEX_CMD_MASK_, uaddr, val, timeout_or_val2, uaddr2);
+            return futex_wakelike(cmd, uaddr, val, timeout_or_val2, uaddr2, 0);
+        case FUTEX_CMP_REQUEUE_:
+            STRACE("futex(FUTEX_CMP_REQUEUE, %#x, %d, %#x, %d)", uaddr, val, uaddr2, val3);
+            return futex_wakelike(cmd, uaddr, val, timeout_or_val2, uaddr2, val3);
+        case FUTEX_WAKE_OP_:
+            STRACE("futex(FUTEX_WAKE_OP, %#x, %d, %d, %#x, %#x)", uaddr, val, timeout_or_val2, uaddr2, val3);
+            if (uaddr2 % sizeof(dword_t) != 0)
+                return _EINVAL;
+            return futex_wakelike(cmd, uaddr, val, timeout_or_val2, uaddr2, val3);
+        case FUTEX_LOCK_PI_:
+            STRACE("futex(FUTEX_LOCK_PI, %#x, %#x)", uaddr, timeout_or_val2);
+            return futex_lock_pi(uaddr, deadline_ptr, false);
+        case FUTEX_TRYLOCK_PI_:
+            STRACE("futex(FUTEX_TRYLOCK_PI, %#x)", uaddr);
+            return futex_lock_pi(uaddr, NULL, true);
+        case FUTEX_UNLOCK_PI_:
+            STRACE("futex(FUTEX_UNLOCK_PI, %#x)", uaddr);
+            return futex_unlock_pi(uaddr);
     }
     STRACE("futex(%#x, %d, %d, timeout=%#x, %#x, %d) ", uaddr, op, val, timeout_or_val2, uaddr2, val3);
     FIXME("unsupported futex operation %d", op);
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
@@ -11,33 +12,185 @@
 #include "kernel/errno.h"
 #include "kernel/signal.h"
 #include "kernel/memory.h"
+#include "kernel/page_pool.h"
 #include "asbestos/asbestos.h"
 #include "kernel/vdso.h"
 #include "kernel/task.h"
 #include "fs/fd.h"
+#include "fs/inode.h"
 
 // increment the change count
-static void mem_changed(struct mem *mem);
+static void mem_changed(struct mem *mem, page_t start, pages_t pages);
 static struct mmu_ops mem_mmu_ops;
 
+#if MEM_FLAT
+// Every page is kept at mem->mmu.flat plus its guest address, so the gadgets
+// can get to it with an add. pt_map moves the memory it's given there, pages
+// that aren't mapped are left inaccessible, and host protections follow the
+// page flags, so anything the gadgets shouldn't be able to do faults.
+//
+// Two address spaces can't have the same private memory in their flat
+// regions, so forking moves it out to somewhere neither of them can see
+// (mem_flat_detach) and both sides get copy-on-write pages of it that are
+// inaccessible on the host. The first access from either side, read or write,
+// faults and breaks copy-on-write like usual, which brings in a copy, or the
+// memory itself if nothing else is using it anymore.
+#define MEM_FLAT_SIZE (1ull << 32)
+
+static char *mem_flat(struct mem *mem, page_t page) {
+    return mem->mmu.flat + ((uintptr_t) page << PAGE_BITS);
+}
+
+static int mem_flat_prot(unsigned flags) {
+    return P_WRITABLE(flags) ? PROT_READ | PROT_WRITE : PROT_READ;
+}
+
+static void mem_flat_release(struct mem *mem, page_t start, pages_t pages) {
+    if (mmap(mem_flat(mem, start), (size_t) pages << PAGE_BITS, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED)
+        die("releasing guest memory failed: %s", strerror(errno));
+}
+
+// Move memory to where it's going to be mapped, or copy it if it can't be
+// moved
+static void mem_flat_place(struct mem *mem, page_t start, pages_t pages, char *memory, size_t offset, unsigned flags) {
+    char *dest = mem_flat(mem, start);
+    size_t size = (size_t) pages << PAGE_BITS;
+    if (memory == (char *) vdso_data || (uintptr_t) (memory + offset) % real_page_size != 0 ||
+            mremap(memory + offset, size, size, MREMAP_MAYMOVE | MREMAP_FIXED, dest) == MAP_FAILED) {
+        if (mmap(dest, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+            die("mapping guest memory failed: %s", strerror(errno));
+        memcpy(dest, memory + offset, size);
+        if (memory != (char *) vdso_data)
+            munmap(memory, size + offset);
+    } else if (offset != 0) {
+        munmap(memory, offset);
+    }
+    mprotect(dest, size, mem_flat_prot(flags));
+}
+
+// Map shared pages start to start + pages of src into dst too. They all have
+// the same flags.
+static int mem_flat_share(struct mem *src, struct mem *dst, page_t start, pages_t pages, unsigned flags) {
+    // the memory is MAP_SHARED on the host, so it can be mapped again
+    for (page_t page = start; page < start + pages; page++) {
+        if (mremap(mem_flat(src, page), 0, PAGE_SIZE, MREMAP_MAYMOVE | MREMAP_FIXED, mem_flat(dst, page)) == MAP_FAILED)
+            return errno_map();
+    }
+    mprotect(mem_flat(dst, start), (size_t) pages << PAGE_BITS, mem_flat_prot(flags));
+    return 0;
+}
+
+// Move the memory for some pages to somewhere else in the flat region
+static void mem_flat_move(struct mem *mem, page_t src, page_t dst, pages_t pages) {
+    size_t size = (size_t) pages << PAGE_BITS;
+    // mremap can only move one host mapping at a time, and mprotect splits them
+    if (mremap(mem_flat(mem, src), size, size, MREMAP_MAYMOVE | MREMAP_FIXED, mem_flat(mem, dst)) == MAP_FAILED) {
+        for (pages_t i = 0; i < pages; i++) {
+            if (mremap(mem_flat(mem, src + i), PAGE_SIZE, PAGE_SIZE, MREMAP_MAYMOVE | MREMAP_FIXED, mem_flat(mem, dst + i)) == MAP_FAILED)
+                die("moving guest memory failed: %s", strerror(errno));
+        }
+    }
+    // mremap leaves nothing behind, not even the reservation
+    mem_flat_release(mem, src, pages);
+}
+
+// Move pages with the same data out of the flat region and give them a data
+// of their own that's detached, with the pages made copy-on-write
+static int mem_flat_detach(struct mem *mem, page_t start, pages_t pages) {
+    struct pt_entry *first = mem_pt(mem, start);
+    struct data *old = first->data;
+    struct data *data = malloc(sizeof(struct data));
+    if (data == NULL)
+        return _ENOMEM;
+    size_t size = (size_t) pages << PAGE_BITS;
+    // mremap doesn't move anything unless it's told where to
+    char *memory = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED) {
+        free(data);
+        return errno_map();
+    }
+    if (mremap(mem_flat(mem, start), size, size, MREMAP_MAYMOVE | MREMAP_FIXED, memory) == MAP_FAILED) {
+        // mremap can only move one host mapping at a time, and there's one
+        // for each run of pages with the same protection
+        for (pages_t i = 0; i < pages; i++) {
+            if (mremap(mem_flat(mem, start + i), PAGE_SIZE, PAGE_SIZE, MREMAP_MAYMOVE | MREMAP_FIXED,
+                        memory + ((size_t) i << PAGE_BITS)) == MAP_FAILED)
+                die("moving guest memory failed: %s", strerror(errno));
+        }
+    }
+    mem_flat_release(mem, start, pages);
+    *data = (struct data) {
+        .data = memory,
+        .size = size,
+        .refcount = pages,
+        .fd = old->fd != NULL ? fd_retain(old->fd) : NULL,
+        .file_offset = old->file_offset + first->offset,
+        .name = old->name,
+        .detached = true,
+    };
+    for (page_t page = start; page < start + pages; page++) {
+        struct pt_entry *pt = mem_pt(mem, page);
+        pt->data = data;
+        pt->offset = (size_t) (page - start) << PAGE_BITS;
+        pt->flags |= P_COW;
+        // the host protection went with the memory, and compiled code gets
+        // thrown out when the copy-on-write is broken
+        pt->code = false;
+    }
+    data_release(old, pages);
+    return 0;
+}
+
+static struct data *mem_flat_copy_data(struct mem *src, struct mem *dst, struct data *data) {
+    struct data *copy = malloc(sizeof(struct data));
+    if (copy == NULL)
+        return NULL;
+    *copy = (struct data) {
+        .data = (char *) data->data - src->mmu.flat + dst->mmu.flat,
+        .size = data->size,
+        .fd = data->fd != NULL ? fd_retain(data->fd) : NULL,
+        .file_offset = data->file_offset,
+        .name = data->name,
+    };
+    return copy;
+}
+#endif
+
 void mem_init(struct mem *mem) {
     mem->pgdir = calloc(MEM_PGDIR_SIZE, sizeof(struct pt_entry *));
     mem->pgdir_used = 0;
+    mem->ranges = NULL;
+    mem->ranges_count = mem->ranges_capacity = 0;
     mem->mmu.ops = &mem_mmu_ops;
     mem->mmu.asbestos = asbestos_new(&mem->mmu);
     mem->mmu.changes = 0;
+    mem->mmu.flat = NULL;
+#if MEM_FLAT
+    if (real_page_size != PAGE_SIZE)
+        die("flat memory needs %d byte pages", PAGE_SIZE);
+    mem->mmu.flat = mmap(NULL, MEM_FLAT_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem->mmu.flat == MAP_FAILED)
+        die("reserving guest address space failed: %s", strerror(errno));
+#endif
     wrlock_init(&mem->lock);
+    lock_init(&mem->cow_lock);
+    mem->foreign_readers = 0;
 }
 
 void mem_destroy(struct mem *mem) {
     write_wrlock(&mem->lock);
     pt_unmap_always(mem, 0, MEM_PAGES);
+#if MEM_FLAT
+    munmap(mem->mmu.flat, MEM_FLAT_SIZE);
+#endif
     asbestos_free(mem->mmu.asbestos);
     for (int i = 0; i < MEM_PGDIR_SIZE; i++) {
         if (mem->pgdir[i] != NULL)
             free(mem->pgdir[i]);
     }
     free(mem->pgdir);
+    free(mem->ranges);
     write_wrunlock(&mem->lock);
     wrlock_destroy(&mem->lock);
 }
@@ -78,29 +231,121 @@ void mem_next_page(struct mem *mem, page_t *page) {
         *page = (*page - PGDIR_BOTTOM(*page)) + MEM_PGDIR_SIZE;
 }
 
-page_t pt_find_hole(struct mem *mem, pages_t size) {
-    page_t hole_end = 0; // this can never be used before initializing but gcc doesn't realize
-    bool in_hole = false;
-    for (page_t page = 0xf7ffd; page > 0x40000; page--) {
-        // I don't know how this works but it does
-        if (!in_hole && mem_pt(mem, page) == NULL) {
-            in_hole = true;
-            hole_end = page + 1;
+// Index of the first range that ends after page, or ranges_count
+static unsigned mem_range_after(struct mem *mem, page_t page) {
+    unsigned low = 0;
+    unsigned high = mem->ranges_count;
+    while (low < high) {
+        unsigned mid = low + (high - low) / 2;
+        if (mem->ranges[mid].end > page)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+    return low;
+}
+
+// Make sure there's room for extra more ranges
+static int mem_ranges_reserve(struct mem *mem, unsigned extra) {
+    if (mem->ranges_count + extra <= mem->ranges_capacity)
+        return 0;
+    unsigned capacity = mem->ranges_capacity ? mem->ranges_capacity * 2 : 16;
+    while (capacity < mem->ranges_count + extra)
+        capacity *= 2;
+    struct mem_range *ranges = realloc(mem->ranges, capacity * sizeof(struct mem_range));
+    if (ranges == NULL)
+        return _ENOMEM;
+    mem->ranges = ranges;
+    mem->ranges_capacity = capacity;
+    return 0;
+}
+
+static void mem_ranges_delete(struct mem *mem, unsigned i, unsigned count) {
+    memmove(&mem->ranges[i], &mem->ranges[i + count],
+            (mem->ranges_count - i - count) * sizeof(struct mem_range));
+    mem->ranges_count -= count;
+}
+
+static int mem_ranges_add(struct mem *mem, page_t start, page_t end) {
+    if (mem_ranges_reserve(mem, 1) < 0)
+        return _ENOMEM;
+    // everything from the first range that touches start to the last range
+    // that touches end gets merged
+    unsigned i = start == 0 ? 0 : mem_range_after(mem, start - 1);
+    unsigned j = i;
+    while (j < mem->ranges_count && mem->ranges[j].start <= end)
+        j++;
+    if (i == j) {
+        memmove(&mem->ranges[i + 1], &mem->ranges[i], (mem->ranges_count - i) * sizeof(struct mem_range));
+        mem->ranges_count++;
+        mem->ranges[i] = (struct mem_range) {start, end};
+        return 0;
+    }
+    if (mem->ranges[i].start > start)
+        mem->ranges[i].start = start;
+    mem->ranges[i].end = mem->ranges[j - 1].end > end ? mem->ranges[j - 1].end : end;
+    mem_ranges_delete(mem, i + 1, j - i - 1);
+    return 0;
+}
+
+static int mem_ranges_remove(struct mem *mem, page_t start, page_t end) {
+    unsigned i = mem_range_after(mem, start);
+    if (i == mem->ranges_count || mem->ranges[i].start >= end)
+        return 0;
+    if (mem->ranges[i].start < start) {
+        if (mem->ranges[i].end > end) {
+            // punching a hole in the middle
+            if (mem_ranges_reserve(mem, 1) < 0)
+                return _ENOMEM;
+            memmove(&mem->ranges[i + 1], &mem->ranges[i], (mem->ranges_count - i) * sizeof(struct mem_range));
+            mem->ranges_count++;
+            mem->ranges[i].end = start;
+            mem->ranges[i + 1].start = end;
+            return 0;
         }
-        if (mem_pt(mem, page) != NULL)
-            in_hole = false;
-        else if (hole_end - page == size)
-            return page;
+        mem->ranges[i].end = start;
+        i++;
+    }
+    unsigned j = i;
+    while (j < mem->ranges_count && mem->ranges[j].end <= end)
+        j++;
+    mem_ranges_delete(mem, i, j - i);
+    if (i < mem->ranges_count && mem->ranges[i].start < end)
+        mem->ranges[i].start = end;
+    return 0;
+}
+
+page_t mem_next_mapped(struct mem *mem, page_t page) {
+    unsigned i = mem_range_after(mem, page);
+    if (i == mem->ranges_count)
+        return MEM_PAGES;
+    return mem->ranges[i].start > page ? mem->ranges[i].start : page;
+}
+
+// Holes are handed out from the top down, starting just under the stack
+#define HOLE_TOP 0xf7ffe
+#define HOLE_BOTTOM 0x40001
+
+page_t pt_find_hole(struct mem *mem, pages_t size) {
+    unsigned i = mem_range_after(mem, HOLE_TOP - 1);
+    page_t hole_end = HOLE_TOP;
+    if (i < mem->ranges_count && mem->ranges[i].start < hole_end)
+        hole_end = mem->ranges[i].start;
+    while (hole_end > HOLE_BOTTOM) {
+        page_t hole_start = i > 0 ? mem->ranges[i - 1].end : 0;
+        if (hole_start < HOLE_BOTTOM)
+            hole_start = HOLE_BOTTOM;
+        if (hole_end > hole_start && hole_end - hole_start >= size)
+            return hole_end - size;
+        if (i == 0)
+            break;
+        hole_end = mem->ranges[--i].start;
     }
     return BAD_PAGE;
 }
 
 bool pt_is_hole(struct mem *mem, page_t start, pages_t pages) {
-    for (page_t page = start; page < start + pages; page++) {
-        if (mem_pt(mem, page) != NULL)
-            return false;
-    }
-    return true;
+    return mem_next_mapped(mem, start) >= start + pages;
 }
 
 int pt_map(struct mem *mem, page_t start, pages_t pages, void *memory, size_t offset, unsigned flags) {
@@ -123,54 +368,151 @@ int pt_map(struct mem *mem, page_t start, pages_t pages, void *memory, size_t of
 #endif
     };
 
+    int err = pt_map_data(mem, start, pages, data, offset, flags);
+    if (err < 0) {
+        free(data);
+        return err;
+    }
+#if MEM_FLAT
+    mem_flat_place(mem, start, pages, memory, offset, flags);
+    data->data = mem_flat(mem, start) - offset;
+#endif
+    return 0;
+}
+
+int pt_map_data(struct mem *mem, page_t start, pages_t pages, struct data *data, size_t offset, unsigned flags) {
+    // so adding the range afterwards can't fail
+    if (mem_ranges_reserve(mem, 2) < 0)
+        return _ENOMEM;
+    if (!pt_is_hole(mem, start, pages))
+        pt_unmap_always(mem, start, pages);
     for (page_t page = start; page < start + pages; page++) {
-        if (mem_pt(mem, page) != NULL)
-            pt_unmap(mem, page, 1);
         data->refcount++;
         struct pt_entry *pt = mem_pt_new(mem, page);
         pt->data = data;
         pt->offset = ((page - start) << PAGE_BITS) + offset;
         pt->flags = flags;
+        pt->code = false;
     }
+    mem_ranges_add(mem, start, start + pages);
     return 0;
 }
 
 int pt_unmap(struct mem *mem, page_t start, pages_t pages) {
-    for (page_t page = start; page < start + pages; page++)
-        if (mem_pt(mem, page) == NULL)
-            return -1;
+    unsigned i = mem_range_after(mem, start);
+    if (i == mem->ranges_count || mem->ranges[i].start > start || mem->ranges[i].end < start + pages)
+        return -1;
     return pt_unmap_always(mem, start, pages);
 }
 
+void data_release(struct data *data, unsigned refs) {
+    if (atomic_fetch_sub(&data->refcount, refs) != refs)
+        return;
+#if MEM_FLAT
+    if (data->detached)
+        munmap(data->data, data->size);
+#else
+    if (data->pooled) {
+        page_pool_free(data->data, data->size >> PAGE_BITS);
+    } else if (data->data != vdso_data) {
+        // vdso wasn't allocated with mmap, it's just in our data segment
+        int err = munmap(data->data, data->size);
+        if (err != 0)
+            die("munmap(%p, %lu) failed: %s", data->data, data->size, strerror(errno));
+    }
+#endif
+    if (data->fd != NULL) {
+        fd_close(data->fd);
+    }
+    free(data);
+}
+
 int pt_unmap_always(struct mem *mem, page_t start, pages_t pages) {
-    for (page_t page = start; page < start + pages; mem_next_page(mem, &page)) {
-        struct pt_entry *pt = mem_pt(mem, page);
-        if (pt == NULL)
-            continue;
-        asbestos_invalidate_page(mem->mmu.asbestos, page);
-        struct data *data = pt->data;
-        mem_pt_del(mem, page);
-        if (--data->refcount == 0) {
-            // vdso wasn't allocated with mmap, it's just in our data segment
-            if (data->data != vdso_data) {
-                int err = munmap(data->data, data->size);
-                if (err != 0)
-                    die("munmap(%p, %lu) failed: %s", data->data, data->size, strerror(errno));
-            }
-            if (data->fd != NULL) {
-                fd_close(data->fd);
-            }
-            free(data);
+    page_t end = start + pages;
+    // in case this splits a range
+    if (mem_ranges_reserve(mem, 1) < 0)
+        return _ENOMEM;
+#if MEM_FLAT
+    bool unmapped = false;
+#endif
+    for (unsigned i = mem_range_after(mem, start); i < mem->ranges_count && mem->ranges[i].start < end; i++) {
+        page_t range_end = mem->ranges[i].end < end ? mem->ranges[i].end : end;
+        for (page_t page = mem->ranges[i].start > start ? mem->ranges[i].start : start; page < range_end; page++) {
+            struct pt_entry *pt = mem_pt(mem, page);
+            asbestos_invalidate_page(mem->mmu.asbestos, page);
+            struct data *data = pt->data;
+            mem_pt_del(mem, page);
+#if MEM_FLAT
+            unmapped = true;
+#endif
+            data_release(data, 1);
         }
     }
-    mem_changed(mem);
+    mem_ranges_remove(mem, start, end);
+#if MEM_FLAT
+    if (unmapped)
+        mem_flat_release(mem, start, pages);
+#endif
+    mem_changed(mem, start, pages);
     return 0;
 }
 
+#if MEM_HUGE_PAGES
+// Anonymous mappings at least this big get asked to be backed by host huge
+// pages, so a big heap doesn't need a host TLB entry for every page of it
+#define HUGE_PAGE_SIZE (2 << 20)
+
+static int pt_map_huge(struct mem *mem, page_t start, pages_t pages, int map_flags, unsigned flags) {
+    size_t size = (size_t) pages << PAGE_BITS;
+#if MEM_FLAT
+    // pt_map moves the memory to where the guest sees it, so advise it there
+    int err = pt_map(mem, start, pages, mmap(NULL, size, PROT_READ | PROT_WRITE, map_flags, -1, 0), 0, flags);
+    if (err == 0)
+        madvise(mem_flat(mem, start), size, MADV_HUGEPAGE);
+    return err;
+#else
+    // over-allocate so there's a huge page aligned region of the right size
+    char *memory = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, map_flags, -1, 0);
+    if (memory == MAP_FAILED)
+        return errno_map();
+    char *aligned = (char *) (((uintptr_t) memory + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+    if (aligned != memory)
+        munmap(memory, aligned - memory);
+    munmap(aligned + size, memory + HUGE_PAGE_SIZE - aligned);
+    madvise(aligned, size, MADV_HUGEPAGE);
+    return pt_map(mem, start, pages, aligned, 0, flags);
+#endif
+}
+#endif
+
 int pt_map_nothing(struct mem *mem, page_t start, pages_t pages, unsigned flags) {
     if (pages == 0) return 0;
+    int map_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if MEM_FLAT
+    // so it can be mapped into a forked address space too
+    if (flags & P_SHARED)
+        map_flags = MAP_SHARED | MAP_ANONYMOUS;
+#endif
+#if MEM_HUGE_PAGES
+    if ((size_t) pages << PAGE_BITS >= HUGE_PAGE_SIZE)
+        return pt_map_huge(mem, start, pages, map_flags, flags | P_ANONYMOUS);
+#endif
+#if !MEM_FLAT
+    // pt_map moves memory around in flat mode, which would punch holes in
+    // the pool
+    void *pooled = page_pool_alloc(pages, true);
+    if (pooled != NULL) {
+        int err = pt_map(mem, start, pages, pooled, 0, flags | P_ANONYMOUS);
+        if (err < 0) {
+            page_pool_free(pooled, pages);
+            return err;
+        }
+        mem_pt(mem, start)->data->pooled = true;
+        return 0;
+    }
+#endif
     void *memory = mmap(NULL, pages * PAGE_SIZE,
-            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+            PROT_READ | PROT_WRITE, map_flags, 0, 0);
     return pt_map(mem, start, pages, memory, 0, flags | P_ANONYMOUS);
 }
 
@@ -180,10 +522,15 @@ int pt_set_flags(struct mem *mem, page_t start, pages_t pages, int flags) {
             return _ENOMEM;
     for (page_t page = start; page < start + pages; page++) {
         struct pt_entry *entry = mem_pt(mem, page);
+#if !MEM_FLAT
         int old_flags = entry->flags;
-        entry->flags = flags;
-        // check if protection is increasing
-        if ((flags & ~old_flags) & (P_READ|P_WRITE)) {
+#endif
+        // keep track of whether it's copy-on-write, shared, etc.
+        entry->flags = (entry->flags & ~P_RWX) | flags;
+#if !MEM_FLAT
+        // check if protection is increasing (pooled memory is always
+        // writable, and might get reused by something else later)
+        if ((flags & ~old_flags) & (P_READ|P_WRITE) && !entry->data->pooled) {
             void *data = (char *) entry->data->data + entry->offset;
             // force to be page aligned
             data = (void *) ((uintptr_t) data & ~(real_page_size - 1));
@@ -192,33 +539,378 @@ int pt_set_flags(struct mem *mem, page_t start, pages_t pages, int flags) {
             if (mprotect(data, real_page_size, prot) < 0)
                 return errno_map();
         }
+#endif
+    }
+#if MEM_FLAT
+    // pages fork moved out stay inaccessible until they're brought back
+    page_t run = start;
+    for (page_t page = start; page <= start + pages; page++) {
+        if (page < start + pages && !mem_pt(mem, page)->data->detached)
+            continue;
+        if (page > run && mprotect(mem_flat(mem, run), (size_t) (page - run) << PAGE_BITS, mem_flat_prot(flags)) < 0)
+            return errno_map();
+        run = page + 1;
+    }
+    // that undid mem_mmu_protect_code
+    if (flags & P_WRITE)
+        asbestos_invalidate_write(mem->mmu.asbestos, start, start + pages);
+#endif
+    mem_changed(mem, start, pages);
+    return 0;
+}
+
+int pt_move(struct mem *mem, page_t src, page_t dst, pages_t pages) {
+    // removing can split a range and adding can make a new one
+    if (mem_ranges_reserve(mem, 2) < 0)
+        return _ENOMEM;
+    int err = 0;
+    pages_t moved = 0;
+    while (moved < pages) {
+        struct data *old_data = mem_pt(mem, src + moved)->data;
+        pages_t run = 1;
+        while (moved + run < pages && mem_pt(mem, src + moved + run)->data == old_data)
+            run++;
+        struct data *data = old_data;
+#if MEM_FLAT
+        // the memory moves too, and a data's memory has to stay lined up
+        // with its pages, so the moved pages get a data of their own, unless
+        // fork already moved the memory out
+        if (!old_data->detached) {
+            data = mem_flat_copy_data(mem, mem, old_data);
+            if (data == NULL) {
+                err = _ENOMEM;
+                break;
+            }
+            data->data = mem_flat(mem, dst + moved) - mem_pt(mem, src + moved)->offset;
+            data->refcount = run;
+        }
+        mem_flat_move(mem, src + moved, dst + moved, run);
+#endif
+        for (page_t page = src + moved; page < src + moved + run; page++) {
+            struct pt_entry *pt = mem_pt(mem, page);
+            asbestos_invalidate_page(mem->mmu.asbestos, page);
+            struct pt_entry *new_pt = mem_pt_new(mem, page - src + dst);
+            new_pt->data = data;
+            new_pt->offset = pt->offset;
+            new_pt->flags = pt->flags;
+            // the host protection moves with the memory
+            new_pt->code = pt->code;
+            mem_pt_del(mem, page);
+        }
+#if MEM_FLAT
+        if (data != old_data)
+            data_release(old_data, run);
+#endif
+        moved += run;
+    }
+    mem_ranges_remove(mem, src, src + moved);
+    mem_ranges_add(mem, dst, dst + moved);
+    mem_changed(mem, src, moved);
+    return err;
+}
+
+// Replace some host memory with zeroes, letting the host have it back
+static void mem_discard(void *memory, size_t size) {
+#ifdef __linux__
+    madvise(memory, size, MADV_DONTNEED);
+#else
+    // MADV_DONTNEED doesn't have to zero anything elsewhere
+    mmap(memory, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+#endif
+}
+
+int pt_discard(struct mem *mem, page_t start, pages_t pages) {
+    for (page_t page = start; page < start + pages; page++)
+        if (mem_pt(mem, page) == NULL)
+            return _ENOMEM;
+    page_t page = start;
+    while (page < start + pages) {
+        struct pt_entry *pt = mem_pt(mem, page);
+        // do runs of pages with contiguous memory all at once
+        page_t end = page + 1;
+        while (end < start + pages) {
+            struct pt_entry *next = mem_pt(mem, end);
+            if (next->data != pt->data || next->flags != pt->flags ||
+                    next->offset != pt->offset + ((end - page) << PAGE_BITS))
+                break;
+            end++;
+        }
+        // shared memory keeps its contents, and file mappings would have to
+        // be read in again, so only private anonymous memory gets dropped
+        if (pt->flags & P_ANONYMOUS && !(pt->flags & P_SHARED)) {
+            asbestos_invalidate_range(mem->mmu.asbestos, page, end);
+#if MEM_FLAT
+            if (pt->data->detached) {
+                // the memory might still be in use elsewhere, so get new memory
+                int err = pt_map_nothing(mem, page, end - page, pt->flags & ~P_COW);
+                if (err < 0)
+                    return err;
+            } else {
+                mem_discard(mem_flat(mem, page), (size_t) (end - page) << PAGE_BITS);
+            }
+#else
+            if (pt->flags & P_COW || real_page_size != PAGE_SIZE) {
+                // the memory might still be in use elsewhere, so get new memory
+                int err = pt_map_nothing(mem, page, end - page, pt->flags & ~P_COW);
+                if (err < 0)
+                    return err;
+            } else {
+                mem_discard((char *) pt->data->data + pt->offset, (size_t) (end - page) << PAGE_BITS);
+            }
+#endif
+        }
+        page = end;
     }
-    mem_changed(mem);
     return 0;
 }
 
 int pt_copy_on_write(struct mem *src, struct mem *dst, page_t start, page_t pages) {
-    for (page_t page = start; page < start + pages; mem_next_page(src, &page)) {
-        struct pt_entry *entry = mem_pt(src, page);
-        if (entry == NULL)
-            continue;
-        if (pt_unmap_always(dst, page, 1) < 0)
+#if MEM_FLAT
+    // map runs of shared pages with the same flags all at once
+    page_t run_start = 0;
+    pages_t run_pages = 0;
+    unsigned run_flags = 0;
+    struct data *src_data = NULL;
+    struct data *dst_data = NULL;
+#endif
+    page_t end = start + pages;
+    for (unsigned i = mem_range_after(src, start); i < src->ranges_count && src->ranges[i].start < end; i++) {
+        page_t range_start = src->ranges[i].start > start ? src->ranges[i].start : start;
+        page_t range_end = src->ranges[i].end < end ? src->ranges[i].end : end;
+        if (!pt_is_hole(dst, range_start, range_end - range_start) &&
+                pt_unmap_always(dst, range_start, range_end - range_start) < 0)
             return -1;
-        if (!(entry->flags & P_SHARED))
-            entry->flags |= P_COW;
-        entry->data->refcount++;
-        struct pt_entry *dst_entry = mem_pt_new(dst, page);
-        dst_entry->data = entry->data;
-        dst_entry->offset = entry->offset;
-        dst_entry->flags = entry->flags;
-    }
-    mem_changed(src);
-    mem_changed(dst);
+        if (mem_ranges_add(dst, range_start, range_end) < 0)
+            return _ENOMEM;
+        for (page_t page = range_start; page < range_end; page++) {
+            struct pt_entry *entry = mem_pt(src, page);
+#if MEM_FLAT
+            struct data *data;
+            if (entry->flags & P_SHARED) {
+                if (entry->data != src_data) {
+                    src_data = entry->data;
+                    dst_data = mem_flat_copy_data(src, dst, src_data);
+                    if (dst_data == NULL)
+                        return _ENOMEM;
+                }
+                if (run_pages != 0 && (page != run_start + run_pages || entry->flags != run_flags)) {
+                    int err = mem_flat_share(src, dst, run_start, run_pages, run_flags);
+                    if (err < 0)
+                        return err;
+                    run_pages = 0;
+                }
+                if (run_pages++ == 0) {
+                    run_start = page;
+                    run_flags = entry->flags;
+                }
+                data = dst_data;
+            } else {
+                if (!entry->data->detached) {
+                    // the rest of the pages with this data go too
+                    page_t detach_end = page + 1;
+                    while (detach_end < range_end && mem_pt(src, detach_end)->data == entry->data)
+                        detach_end++;
+                    int err = mem_flat_detach(src, page, detach_end - page);
+                    if (err < 0)
+                        return err;
+                }
+                data = entry->data;
+            }
+            data->refcount++;
+            struct pt_entry *dst_entry = mem_pt_new(dst, page);
+            dst_entry->data = data;
+#else
+            if (!(entry->flags & P_SHARED))
+                entry->flags |= P_COW;
+            entry->data->refcount++;
+            struct pt_entry *dst_entry = mem_pt_new(dst, page);
+            dst_entry->data = entry->data;
+#endif
+            dst_entry->offset = entry->offset;
+            dst_entry->flags = entry->flags;
+            dst_entry->code = false;
+        }
+    }
+#if MEM_FLAT
+    if (run_pages != 0) {
+        int err = mem_flat_share(src, dst, run_start, run_pages, run_flags);
+        if (err < 0)
+            return err;
+    }
+#endif
+    mem_changed(src, start, pages);
+    mem_changed(dst, start, pages);
     return 0;
 }
 
-static void mem_changed(struct mem *mem) {
-    mem->mmu.changes++;
+static void mem_changed(struct mem *mem, page_t start, pages_t pages) {
+    mmu_changed(&mem->mmu, start, start + pages);
+}
+
+// Copy-on-write pages get copied this many at a time, as long as the pages
+// next to the one being written came from the same mapping. Each one costs a
+// host fault in flat mode, so it copies more at once.
+#if MEM_FLAT
+#define MEM_COW_BATCH 64
+#else
+#define MEM_COW_BATCH 8
+#endif
+
+// If no other task uses the address space or is looking at it, nothing else
+// could have a copy-on-write page in its TLB or a pointer into its data, so it
+// can be replaced without stopping everything with the write lock. Must be
+// called with cow_lock.
+static bool mem_single_user(struct mem *mem) {
+    return container_of(mem, struct mm, mem)->refcount == 1 && mem->foreign_readers == 0;
+}
+
+void mem_read_lock(struct mem *mem) {
+    bool foreign = mem != current->mem;
+    if (foreign) {
+        lock(&mem->cow_lock);
+        mem->foreign_readers++;
+        unlock(&mem->cow_lock);
+    }
+    read_wrlock(&mem->lock);
+}
+
+void mem_read_unlock(struct mem *mem) {
+    read_wrunlock(&mem->lock);
+    if (mem != current->mem) {
+        lock(&mem->cow_lock);
+        mem->foreign_readers--;
+        unlock(&mem->cow_lock);
+    }
+}
+
+static bool mem_cow_neighbor(struct mem *mem, page_t page, struct pt_entry *entry, page_t entry_page) {
+    struct pt_entry *pt = mem_pt(mem, page);
+    return pt != NULL && pt->data == entry->data && pt->flags == entry->flags &&
+        pt->offset + ((size_t) entry_page << PAGE_BITS) == entry->offset + ((size_t) page << PAGE_BITS);
+}
+
+// Give mem its own copy of a copy-on-write page, and of whichever of the pages
+// around it in the same MEM_COW_BATCH aligned group can come along. Needs
+// either the write lock, or the read lock and cow_lock if mem_single_user
+// (never in flat mode, since pt_map moves memory and ranges around).
+static int mem_cow_break(struct mem *mem, page_t page) {
+    struct pt_entry *entry = mem_pt(mem, page);
+    struct data *old = entry->data;
+    page_t group = page & ~(MEM_COW_BATCH - 1);
+    page_t group_end = group + MEM_COW_BATCH;
+#if MEM_FLAT
+    // If this is all that's left using memory fork moved out, all of it comes
+    // back at once, see below. It has to be all of it, or there would be a
+    // hole in the middle of it that the host could put something else in.
+    bool move_back = false;
+    if (old->detached && old->refcount == old->size >> PAGE_BITS && entry->offset >> PAGE_BITS <= page) {
+        page_t first = page - (entry->offset >> PAGE_BITS);
+        page_t last = first + (old->size >> PAGE_BITS);
+        move_back = last <= MEM_PAGES;
+        for (page_t p = first; p < last && move_back; p++)
+            move_back = p == page || mem_cow_neighbor(mem, p, entry, page);
+        if (move_back) {
+            group = first;
+            group_end = last;
+        }
+    }
+#endif
+    page_t start = page;
+    while (start > group && mem_cow_neighbor(mem, start - 1, entry, page))
+        start--;
+    page_t end = page + 1;
+    while (end < group_end && mem_cow_neighbor(mem, end, entry, page))
+        end++;
+    pages_t pages = end - start;
+    unsigned flags = entry->flags & ~P_COW;
+    asbestos_invalidate_range(mem->mmu.asbestos, start, end);
+
+    // if these are the only pages left using private anonymous data, it's
+    // already ours. Not shared memory, which is supposed to stay shared, or
+    // a file mapping ptrace is writing to, or the vdso, which is part of ish
+    // itself.
+    if (old->refcount == pages && (flags & P_ANONYMOUS) && !(flags & P_SHARED) &&
+            old->data != vdso_data && !old->detached) {
+        for (page_t p = start; p < end; p++)
+            mem_pt(mem, p)->flags = flags;
+#if MEM_FLAT
+        mprotect(mem_flat(mem, start), (size_t) pages << PAGE_BITS, mem_flat_prot(flags));
+#endif
+        mem_changed(mem, start, pages);
+        return 0;
+    }
+
+#if MEM_FLAT
+    size_t size = (size_t) pages << PAGE_BITS;
+    if (move_back) {
+        // the pages already have the right offsets into it
+        if (mremap(old->data, size, size, MREMAP_MAYMOVE | MREMAP_FIXED, mem_flat(mem, start)) != MAP_FAILED) {
+            mprotect(mem_flat(mem, start), size, mem_flat_prot(flags));
+            old->data = mem_flat(mem, start);
+            old->detached = false;
+            for (page_t p = start; p < end; p++)
+                mem_pt(mem, p)->flags = flags;
+            mem_changed(mem, start, pages);
+            return 0;
+        }
+    }
+    if (!old->detached) {
+        // the copy can't go straight where the original is
+        char *copy = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (copy == MAP_FAILED)
+            return errno_map();
+        memcpy(copy, (char *) old->data + mem_pt(mem, start)->offset, size);
+        // pt_map moves it to where it belongs
+        return pt_map(mem, start, pages, copy, 0, flags);
+    }
+#endif
+    struct data *data = malloc(sizeof(struct data));
+    if (data == NULL)
+        return _ENOMEM;
+#if MEM_FLAT
+    // detached pages have nothing in the flat region, so copy right into it.
+    // All of it gets written, so fault it in now instead of a page at a time.
+    char *copy = mmap(mem_flat(mem, start), size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_POPULATE, -1, 0);
+    bool pooled = false;
+    if (copy == MAP_FAILED) {
+        free(data);
+        return errno_map();
+    }
+#else
+    char *copy = page_pool_alloc(pages, false);
+    bool pooled = copy != NULL;
+    if (!pooled) {
+        copy = mmap(NULL, pages << PAGE_BITS, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (copy == MAP_FAILED) {
+            free(data);
+            return errno_map();
+        }
+    }
+#endif
+    memcpy(copy, (char *) old->data + mem_pt(mem, start)->offset, pages << PAGE_BITS);
+#if MEM_FLAT
+    if (!P_WRITABLE(flags))
+        mprotect(copy, size, PROT_READ);
+#endif
+    *data = (struct data) {
+        .data = copy,
+        .size = pages << PAGE_BITS,
+        .refcount = pages,
+        .pooled = pooled,
+    };
+    for (page_t p = start; p < end; p++) {
+        struct pt_entry *pt = mem_pt(mem, p);
+        // The new offset is never past the old one, so a reader that sees the
+        // new offset with the old data still gets valid memory
+        pt->offset = (p - start) << PAGE_BITS;
+        atomic_thread_fence(memory_order_release);
+        pt->data = data;
+        pt->flags = flags;
+    }
+    data_release(old, pages);
+    mem_changed(mem, start, pages);
+    return 0;
 }
 
 // This version will return NULL instead of making necessary pagetable changes.
@@ -229,7 +921,21 @@ static void *mem_ptr_nofault(struct mem *mem, addr_t addr, int type) {
         return NULL;
     if (type == MEM_WRITE && !P_WRITABLE(entry->flags))
         return NULL;
-    return entry->data->data + entry->offset + PGOFFSET(addr);
+    // see mem_cow_break
+    struct data *data = entry->data;
+    atomic_thread_fence(memory_order_acquire);
+    return data->data + entry->offset + PGOFFSET(addr);
+}
+
+// Switch from the read lock to the write lock and back. Anything looked up
+// with the read lock can change in between.
+static void mem_upgrade_lock(struct mem *mem) {
+    read_wrunlock(&mem->lock);
+    write_wrlock(&mem->lock);
+}
+static void mem_downgrade_lock(struct mem *mem) {
+    write_wrunlock(&mem->lock);
+    read_wrlock(&mem->lock);
 }
 
 void *mem_ptr(struct mem *mem, addr_t addr, int type) {
@@ -241,9 +947,7 @@ void *mem_ptr(struct mem *mem, addr_t addr, int type) {
     if (entry == NULL) {
         // page does not exist
         // look to see if the next VM region is willing to grow down
-        page_t p = page + 1;
-        while (p < MEM_PAGES && mem_pt(mem, p) == NULL)
-            p++;
+        page_t p = mem_next_mapped(mem, page + 1);
         if (p >= MEM_PAGES)
             return NULL;
         if (!(mem_pt(mem, p)->flags & P_GROWSDOWN))
@@ -251,15 +955,9 @@ void *mem_ptr(struct mem *mem, addr_t addr, int type) {
 
         // Changing memory maps must be done with the write lock. But this is
         // called with the read lock.
-        // This locking stuff is copy/pasted for all the code in this function
-        // which changes memory maps.
-        // TODO: factor the lock/unlock code here into a new function. Do this
-        // next time you touch this function.
-        read_wrunlock(&mem->lock);
-        write_wrlock(&mem->lock);
+        mem_upgrade_lock(mem);
         pt_map_nothing(mem, page, 1, P_WRITE | P_GROWSDOWN);
-        write_wrunlock(&mem->lock);
-        read_wrlock(&mem->lock);
+        mem_downgrade_lock(mem);
 
         entry = mem_pt(mem, page);
     }
@@ -273,34 +971,128 @@ void *mem_ptr(struct mem *mem, addr_t addr, int type) {
             entry->flags |= P_WRITE | P_COW;
         }
         // get rid of any compiled blocks in this page
-        asbestos_invalidate_page(mem->mmu.asbestos, page);
+        asbestos_invalidate_write(mem->mmu.asbestos, page, page + 1);
         // if page is cow, ~~milk~~ copy it
         if (entry->flags & P_COW) {
-            void *data = (char *) entry->data->data + entry->offset;
-            void *copy = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
-                    MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
-
-            // copy/paste from above
-            read_wrunlock(&mem->lock);
-            write_wrlock(&mem->lock);
-            memcpy(copy, data, PAGE_SIZE);
-            pt_map(mem, page, 1, copy, 0, entry->flags &~ P_COW);
-            write_wrunlock(&mem->lock);
-            read_wrlock(&mem->lock);
+            lock(&mem->cow_lock);
+#if MEM_FLAT
+            bool single_user = false;
+#else
+            bool single_user = mem_single_user(mem);
+#endif
+            if (!single_user) {
+                unlock(&mem->cow_lock);
+                mem_upgrade_lock(mem);
+            }
+            // it might have been copied or unmapped while the lock was dropped
+            entry = mem_pt(mem, page);
+            if (entry != NULL && entry->flags & P_COW)
+                mem_cow_break(mem, page);
+            if (single_user)
+                unlock(&mem->cow_lock);
+            else
+                mem_downgrade_lock(mem);
         }
     }
 
+#if MEM_FLAT
+    // Memory fork moved out is only readable from outside the flat region,
+    // which the gadgets don't know about, so bring it back for them
+    if (entry != NULL && type == MEM_READ && entry->data->detached) {
+        mem_upgrade_lock(mem);
+        entry = mem_pt(mem, page);
+        if (entry != NULL && entry->data->detached)
+            mem_cow_break(mem, page);
+        mem_downgrade_lock(mem);
+        old_ptr = NULL;
+    }
+#endif
+
     void *ptr = mem_ptr_nofault(mem, addr, type);
     assert(old_ptr == NULL || old_ptr == ptr || type == MEM_WRITE_PTRACE);
     return ptr;
 }
 
+void *mem_ptr_range(struct mem *mem, addr_t addr, size_t count, int type, size_t *len) {
+    // the first page gets everything mem_ptr does, and the run continues
+    // through pages that don't need any of it
+    char *ptr = mem_ptr(mem, addr, type);
+    if (ptr == NULL)
+        return NULL;
+    size_t run = PAGE_SIZE - PGOFFSET(addr);
+    page_t page = PAGE(addr) + 1;
+    while (run < count && page < MEM_PAGES) {
+        struct pt_entry *entry = mem_pt(mem, page);
+        if (entry == NULL || (type != MEM_READ && !P_WRITABLE(entry->flags)))
+            break;
+        struct data *data = entry->data;
+        atomic_thread_fence(memory_order_acquire);
+        if ((char *) data->data + entry->offset != ptr + run)
+            break;
+        run += PAGE_SIZE;
+        page++;
+    }
+    if (type != MEM_READ && page > PAGE(addr) + 1)
+        asbestos_invalidate_write(mem->mmu.asbestos, PAGE(addr) + 1, page);
+    *len = run < count ? run : count;
+    return ptr;
+}
+
 static void *mem_mmu_translate(struct mmu *mmu, addr_t addr, int type) {
     return mem_ptr_nofault(container_of(mmu, struct mem, mmu), addr, type);
 }
 
+static bool mem_mmu_file_page(struct mmu *mmu, page_t page, struct mmu_file_page *file) {
+    struct pt_entry *pt = mem_pt(container_of(mmu, struct mem, mmu), page);
+    if (pt == NULL || pt->flags & P_WRITE)
+        return false;
+    struct fd *fd = pt->data->fd;
+    if (fd == NULL || fd->inode == NULL || fd->mount == NULL)
+        return false;
+    // FNV-1a of the mount source and inode number
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const char *c = fd->mount->source; c != NULL && *c != '\0'; c++)
+        hash = (hash ^ (uint8_t) *c) * 0x100000001b3;
+    hash = (hash ^ fd->inode->number) * 0x100000001b3;
+    file->file = hash;
+    file->offset = pt->data->file_offset + pt->offset;
+    file->data = (char *) pt->data->data + pt->offset;
+    return true;
+}
+
+#if MEM_FLAT
+// The gadgets write to flat memory without asking, so pages code gets compiled
+// from are made read only on the host. Writing to one then faults, and the
+// fault goes through mem_ptr like a write to a CoW page, which invalidates the
+// page and makes it writable again. Once a page is mapped, pt->code is only
+// changed with asbestos->lock held, and is set whenever the page is read only
+// for this reason.
+static void mem_mmu_protect_code(struct mmu *mmu, page_t page) {
+    struct mem *mem = container_of(mmu, struct mem, mmu);
+    struct pt_entry *pt = mem_pt(mem, page);
+    if (pt == NULL || !P_WRITABLE(pt->flags) || pt->code)
+        return;
+    pt->code = true;
+    mprotect(mem_flat(mem, page), PAGE_SIZE, PROT_READ);
+}
+
+static void mem_mmu_unprotect_code(struct mmu *mmu, page_t page) {
+    struct mem *mem = container_of(mmu, struct mem, mmu);
+    struct pt_entry *pt = mem_pt(mem, page);
+    if (pt == NULL || !pt->code)
+        return;
+    pt->code = false;
+    mprotect(mem_flat(mem, page), PAGE_SIZE, mem_flat_prot(pt->flags));
+}
+#endif
+
 static struct mmu_ops mem_mmu_ops = {
     .translate = mem_mmu_translate,
+    .file_page = mem_mmu_file_page,
+#if MEM_FLAT
+    .protect_code = mem_mmu_protect_code,
+    .unprotect_code = mem_mmu_unprotect_code,
+#endif
 };
 
 int mem_segv_reason(struct mem *mem, addr_t addr) {
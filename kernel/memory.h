@@ -12,10 +12,23 @@
 struct mem {
     struct pt_entry **pgdir;
     int pgdir_used;
+    // Mapped pages as sorted ranges, with touching ranges merged, so finding
+    // holes and the next mapping doesn't mean looking at every page
+    struct mem_range {
+        page_t start;
+        page_t end;
+    } *ranges;
+    unsigned ranges_count;
+    unsigned ranges_capacity;
 
     struct mmu mmu;
 
     wrlock_t lock;
+    // protects breaking copy-on-write with only the read lock, see mem_ptr
+    lock_t cow_lock;
+    // tasks in mem_read_lock that use some other memory, protected by
+    // cow_lock
+    unsigned foreign_readers;
 };
 #define MEM_PGDIR_SIZE (1 << 10)
 
@@ -23,11 +36,19 @@ struct mem {
 void mem_init(struct mem *mem);
 // Uninitialize the address space
 void mem_destroy(struct mem *mem);
+// Take the read lock for a memory that might not be current's. Anything that
+// looks at another task's memory has to use these instead of read_wrlock,
+// since mem_ptr only takes the read lock to break copy-on-write when nobody
+// else could be looking.
+void mem_read_lock(struct mem *mem);
+void mem_read_unlock(struct mem *mem);
 // Return the pagetable entry for the given page
 struct pt_entry *mem_pt(struct mem *mem, page_t page);
 // Increment *page, skipping over unallocated page directories. Intended to be
 // used as the incremenent in a for loop to traverse mappings.
 void mem_next_page(struct mem *mem, page_t *page);
+// Return the first mapped page at or after page, or MEM_PAGES if there isn't one
+page_t mem_next_mapped(struct mem *mem, page_t page);
 
 #define BYTES_ROUND_DOWN(bytes) (PAGE(bytes) << PAGE_BITS)
 #define BYTES_ROUND_UP(bytes) (PAGE_ROUND_UP(bytes) << PAGE_BITS)
@@ -43,6 +64,11 @@ struct data {
     struct fd *fd;
     size_t file_offset;
     const char *name;
+    // from page_pool_alloc instead of mmap
+    bool pooled;
+    // flat memory only: moved out of the flat region by a fork, so it isn't
+    // in anyone's, and gets unmapped like normal memory
+    bool detached;
 #if LEAK_DEBUG
     int pid;
     addr_t dest;
@@ -52,6 +78,9 @@ struct pt_entry {
     struct data *data;
     size_t offset;
     unsigned flags;
+    // flat memory only: read only on the host because code was compiled from
+    // it, see mem_mmu_protect_code
+    bool code;
     struct list blocks[2];
 };
 // page flags
@@ -77,19 +106,34 @@ page_t pt_find_hole(struct mem *mem, pages_t size);
 // ownership of memory. It will be freed with:
 // munmap(memory, pages * PAGE_SIZE)
 int pt_map(struct mem *mem, page_t start, pages_t pages, void *memory, size_t offset, unsigned flags);
+// Map pages from data that's already mapped somewhere, starting offset bytes
+// into it. Adds a reference to data for each page. Not for flat memory.
+int pt_map_data(struct mem *mem, page_t start, pages_t pages, struct data *data, size_t offset, unsigned flags);
+// Drop refs references to data, freeing it if they were the last
+void data_release(struct data *data, unsigned refs);
 // Map empty space into fake memory
 int pt_map_nothing(struct mem *mem, page_t page, pages_t pages, unsigned flags);
 // Unmap fake memory, return -1 if any part of the range isn't mapped and 0 otherwise
 int pt_unmap(struct mem *mem, page_t start, pages_t pages);
 // like pt_unmap but doesn't care if part of the range isn't mapped
 int pt_unmap_always(struct mem *mem, page_t start, pages_t pages);
-// Set the flags on memory
+// Set the protection flags (P_RWX) on memory
 int pt_set_flags(struct mem *mem, page_t start, pages_t pages, int flags);
+// Move pages from src to dst, which must be a hole that doesn't overlap src,
+// without copying the memory behind them
+int pt_move(struct mem *mem, page_t src, page_t dst, pages_t pages);
+// Make private anonymous pages read as zero and let the host have their memory
+// back, for MADV_DONTNEED. Returns _ENOMEM if part of the range isn't mapped.
+int pt_discard(struct mem *mem, page_t start, pages_t pages);
 // Copy pages from src memory to dst memory using copy-on-write
 int pt_copy_on_write(struct mem *src, struct mem *dst, page_t start, page_t pages);
 
 // Must call with mem read-locked.
 void *mem_ptr(struct mem *mem, addr_t addr, int type);
+// Like mem_ptr, but also sets *len to how many of the count bytes starting at
+// addr are contiguous on the host from the returned pointer, so big copies
+// don't have to go a page at a time. Must call with mem read-locked.
+void *mem_ptr_range(struct mem *mem, addr_t addr, size_t count, int type, size_t *len);
 int mem_segv_reason(struct mem *mem, addr_t addr);
 
 extern size_t real_page_size;
@@ -80,8 +80,6 @@ static addr_t do_mmap(addr_t addr, dword_t len, dword_t prot, dword_t flags, fd_
             return _ENODEV;
         if ((err = fd->ops->mmap(fd, current->mem, page, pages, offset, prot, flags)) < 0)
             return err;
-        mem_pt(current->mem, page)->data->fd = fd_retain(fd);
-        mem_pt(current->mem, page)->data->file_offset = offset;
     }
     return page << PAGE_BITS;
 }
@@ -133,48 +131,80 @@ int_t sys_munmap(addr_t addr, uint_t len) {
 #define MREMAP_MAYMOVE_ 1
 #define MREMAP_FIXED_ 2
 
-int_t sys_mremap(addr_t addr, dword_t old_len, dword_t new_len, dword_t flags) {
-    STRACE("mremap(%#x, %#x, %#x, %d)", addr, old_len, new_len, flags);
-    if (PGOFFSET(addr) != 0)
-        return _EINVAL;
-    if (flags & ~(MREMAP_MAYMOVE_ | MREMAP_FIXED_))
-        return _EINVAL;
-    if (flags & MREMAP_FIXED_) {
-        FIXME("missing MREMAP_FIXED");
-        return _EINVAL;
-    }
-    pages_t old_pages = PAGE(old_len);
-    pages_t new_pages = PAGE(new_len);
-
-    // shrinking always works
-    if (new_pages <= old_pages) {
-        int err = pt_unmap(current->mem, PAGE(addr) + new_pages, old_pages - new_pages);
-        if (err < 0)
-            return _EFAULT;
-        return addr;
-    }
-
-    struct pt_entry *entry = mem_pt(current->mem, PAGE(addr));
+static int_t do_mremap(struct mem *mem, page_t page, pages_t old_pages, pages_t new_pages, dword_t flags, page_t new_page) {
+    // the whole old range has to be one mapping
+    struct pt_entry *entry = mem_pt(mem, page);
     if (entry == NULL)
         return _EFAULT;
     dword_t pt_flags = entry->flags;
-    for (page_t page = PAGE(addr); page < PAGE(addr) + old_pages; page++) {
-        entry = mem_pt(current->mem, page);
-        if (entry == NULL && entry->flags != pt_flags)
+    for (page_t p = page; p < page + old_pages; p++) {
+        entry = mem_pt(mem, p);
+        if (entry == NULL || (entry->flags & ~P_COW) != (pt_flags & ~P_COW))
             return _EFAULT;
     }
-    if (!(pt_flags & P_ANONYMOUS)) {
+    if (new_pages > old_pages && !(pt_flags & P_ANONYMOUS)) {
         FIXME("mremap grow on file mappings");
         return _EFAULT;
     }
-    page_t extra_start = PAGE(addr) + old_pages;
-    pages_t extra_pages = new_pages - old_pages;
-    if (!pt_is_hole(current->mem, extra_start, extra_pages))
-        return _ENOMEM;
-    int err = pt_map_nothing(current->mem, extra_start, extra_pages, pt_flags);
+
+    if (flags & MREMAP_FIXED_) {
+        if (new_page < page + old_pages && page < new_page + new_pages)
+            return _EINVAL;
+        pt_unmap_always(mem, new_page, new_pages);
+    } else {
+        // shrinking always works
+        if (new_pages <= old_pages) {
+            pt_unmap_always(mem, page + new_pages, old_pages - new_pages);
+            return page << PAGE_BITS;
+        }
+        if (pt_is_hole(mem, page + old_pages, new_pages - old_pages)) {
+            int err = pt_map_nothing(mem, page + old_pages, new_pages - old_pages, pt_flags & ~P_COW);
+            if (err < 0)
+                return err;
+            return page << PAGE_BITS;
+        }
+        if (!(flags & MREMAP_MAYMOVE_))
+            return _ENOMEM;
+        new_page = pt_find_hole(mem, new_pages);
+        if (new_page == BAD_PAGE)
+            return _ENOMEM;
+    }
+
+    if (new_pages < old_pages) {
+        pt_unmap_always(mem, page + new_pages, old_pages - new_pages);
+        old_pages = new_pages;
+    }
+    // the pages move, the memory behind them stays put
+    int err = pt_move(mem, page, new_page, old_pages);
     if (err < 0)
         return err;
-    return addr;
+    if (new_pages > old_pages) {
+        err = pt_map_nothing(mem, new_page + old_pages, new_pages - old_pages, pt_flags & ~P_COW);
+        if (err < 0)
+            return err;
+    }
+    return new_page << PAGE_BITS;
+}
+
+int_t sys_mremap(addr_t addr, dword_t old_len, dword_t new_len, dword_t flags, addr_t new_addr) {
+    STRACE("mremap(%#x, %#x, %#x, %d, %#x)", addr, old_len, new_len, flags, new_addr);
+    if (PGOFFSET(addr) != 0)
+        return _EINVAL;
+    if (flags & ~(MREMAP_MAYMOVE_ | MREMAP_FIXED_))
+        return _EINVAL;
+    if (flags & MREMAP_FIXED_ && (!(flags & MREMAP_MAYMOVE_) || PGOFFSET(new_addr) != 0))
+        return _EINVAL;
+    pages_t old_pages = PAGE_ROUND_UP(old_len);
+    pages_t new_pages = PAGE_ROUND_UP(new_len);
+    if (new_pages == 0)
+        return _EINVAL;
+    if (PAGE(addr) + old_pages > MEM_PAGES || (flags & MREMAP_FIXED_ && PAGE(new_addr) + new_pages > MEM_PAGES))
+        return _EINVAL;
+
+    write_wrlock(&current->mem->lock);
+    int_t res = do_mremap(current->mem, PAGE(addr), old_pages, new_pages, flags, PAGE(new_addr));
+    write_wrunlock(&current->mem->lock);
+    return res;
 }
 
 int_t sys_mprotect(addr_t addr, uint_t len, int_t prot) {
@@ -190,9 +220,21 @@ int_t sys_mprotect(addr_t addr, uint_t len, int_t prot) {
     return err;
 }
 
-dword_t sys_madvise(addr_t UNUSED(addr), dword_t UNUSED(len), dword_t UNUSED(advice)) {
-    // portable applications should not rely on linux's destructive semantics for MADV_DONTNEED.
-    return 0;
+#define MADV_DONTNEED_ 4
+#define MADV_FREE_ 8
+
+dword_t sys_madvise(addr_t addr, dword_t len, dword_t advice) {
+    STRACE("madvise(%#x, %#x, %d)", addr, len, advice);
+    if (PGOFFSET(addr) != 0)
+        return _EINVAL;
+    // everything else is only a hint. MADV_FREE lets the memory be dropped
+    // any time before it's written again, so right away is fine.
+    if (advice != MADV_DONTNEED_ && advice != MADV_FREE_)
+        return 0;
+    write_wrlock(&current->mem->lock);
+    int err = pt_discard(current->mem, PAGE(addr), PAGE_ROUND_UP(len));
+    write_wrunlock(&current->mem->lock);
+    return err;
 }
 
 dword_t sys_mbind(addr_t UNUSED(addr), dword_t UNUSED(len), int_t UNUSED(mode),
@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "kernel/memory.h"
+#include "kernel/page_pool.h"
+#include "util/sync.h"
+
+#define PAGE_POOL_ARENA_PAGES 512
+// Past this many free pages, freed pages are given back to the host
+#define PAGE_POOL_KEEP_PAGES 4096
+// Blocks are 1, 2, 4, 8, or 16 pages
+#define PAGE_POOL_CLASSES 5
+
+// Free blocks are kept in arrays instead of being linked through the blocks
+// themselves, so blocks given back to the host don't get touched again. The
+// low bit of each entry is set if the block is known to be zeroed.
+struct page_pool_class {
+    uintptr_t *blocks;
+    unsigned count;
+    unsigned capacity;
+};
+
+static lock_t page_pool_lock = LOCK_INITIALIZER;
+static struct page_pool_class page_pool_classes[PAGE_POOL_CLASSES];
+static char *page_pool_arena;
+static pages_t page_pool_arena_left;
+static struct page_pool_stats page_pool_stats;
+
+static unsigned page_pool_class(pages_t pages) {
+    unsigned class = 0;
+    while ((1u << class) < pages)
+        class++;
+    return class;
+}
+
+static bool page_pool_push(unsigned class, char *block, bool zeroed) {
+    struct page_pool_class *c = &page_pool_classes[class];
+    if (c->count == c->capacity) {
+        unsigned capacity = c->capacity ? c->capacity * 2 : 64;
+        uintptr_t *blocks = realloc(c->blocks, capacity * sizeof(*blocks));
+        if (blocks == NULL)
+            return false;
+        c->blocks = blocks;
+        c->capacity = capacity;
+    }
+    c->blocks[c->count++] = (uintptr_t) block | zeroed;
+    page_pool_stats.free_pages += 1 << class;
+    return true;
+}
+
+static char *page_pool_carve(unsigned class) {
+    pages_t pages = 1 << class;
+    if (page_pool_arena_left < pages) {
+        // the rest of the old arena becomes smaller blocks
+        while (page_pool_arena_left > 0) {
+            unsigned c = page_pool_class(page_pool_arena_left + 1) - 1;
+            if (c >= PAGE_POOL_CLASSES)
+                c = PAGE_POOL_CLASSES - 1;
+            page_pool_push(c, page_pool_arena, true);
+            page_pool_arena += (size_t) 1 << c << PAGE_BITS;
+            page_pool_arena_left -= 1 << c;
+        }
+        char *arena = mmap(NULL, PAGE_POOL_ARENA_PAGES << PAGE_BITS, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (arena == MAP_FAILED)
+            return NULL;
+        page_pool_stats.arenas++;
+        page_pool_arena = arena;
+        page_pool_arena_left = PAGE_POOL_ARENA_PAGES;
+    }
+    char *block = page_pool_arena;
+    page_pool_arena += pages << PAGE_BITS;
+    page_pool_arena_left -= pages;
+    page_pool_stats.carved++;
+    return block;
+}
+
+void *page_pool_alloc(pages_t pages, bool zero) {
+    if (pages == 0 || pages > PAGE_POOL_MAX_PAGES)
+        return NULL;
+    // Blocks are only guest page aligned, and pt_map needs host page aligned
+    // memory, so the pool is no use when host pages are bigger (16K on iOS
+    // and arm64 macOS)
+    if (real_page_size != PAGE_SIZE)
+        return NULL;
+    unsigned class = page_pool_class(pages);
+    struct page_pool_class *c = &page_pool_classes[class];
+    char *block;
+    bool zeroed = true;
+    lock(&page_pool_lock);
+    if (c->count > 0) {
+        uintptr_t entry = c->blocks[--c->count];
+        block = (char *) (entry & ~(uintptr_t) 1);
+        zeroed = entry & 1;
+        page_pool_stats.free_pages -= 1 << class;
+        page_pool_stats.hits++;
+    } else {
+        block = page_pool_carve(class);
+    }
+    unlock(&page_pool_lock);
+    if (block != NULL && zero && !zeroed)
+        memset(block, 0, pages << PAGE_BITS);
+    return block;
+}
+
+void page_pool_free(void *memory, pages_t pages) {
+    unsigned class = page_pool_class(pages);
+    size_t size = (size_t) 1 << class << PAGE_BITS;
+    bool zeroed = false;
+    lock(&page_pool_lock);
+    if (page_pool_stats.free_pages >= PAGE_POOL_KEEP_PAGES &&
+            (uintptr_t) memory % real_page_size == 0 && size % real_page_size == 0 &&
+            madvise(memory, size, MADV_DONTNEED) == 0) {
+#if defined(__linux__)
+        // anywhere else this is only a hint
+        zeroed = true;
+#endif
+        page_pool_stats.returned++;
+    }
+    if (!page_pool_push(class, memory, zeroed))
+        munmap(memory, size);
+    unlock(&page_pool_lock);
+}
+
+void page_pool_get_stats(struct page_pool_stats *stats) {
+    lock(&page_pool_lock);
+    *stats = page_pool_stats;
+    unlock(&page_pool_lock);
+}
@@ -0,0 +1,30 @@
+#ifndef KERNEL_PAGE_POOL_H
+#define KERNEL_PAGE_POOL_H
+#include <stdbool.h>
+#include <stdint.h>
+#include "emu/mmu.h"
+
+// Guest pages carved out of big host arenas, so mapping and unmapping a few
+// pages at a time doesn't take a host syscall. Memory from the pool is always
+// readable and writable on the host.
+
+// Bigger allocations should just use mmap
+#define PAGE_POOL_MAX_PAGES 16
+
+// Returns NULL if pages is more than PAGE_POOL_MAX_PAGES, host pages aren't
+// the same size as guest pages, or the host is out of memory. If zero is false,
+// the pages can have anything in them.
+void *page_pool_alloc(pages_t pages, bool zero);
+// pages has to be the same as what was allocated
+void page_pool_free(void *memory, pages_t pages);
+
+struct page_pool_stats {
+    uint64_t hits; // allocations that reused freed pages
+    uint64_t carved; // allocations that took fresh pages from an arena
+    uint64_t arenas; // arenas mapped from the host
+    uint64_t returned; // frees that gave the pages back to the host
+    uint64_t free_pages;
+};
+void page_pool_get_stats(struct page_pool_stats *stats);
+
+#endif
@@ -97,14 +97,20 @@ void task_destroy(struct task *task) {
 
 void task_run_current(void) {
     struct cpu_state *cpu = &current->cpu;
-    struct tlb tlb = {};
-    tlb_refresh(&tlb, &current->mem->mmu);
+    // with the victim table it's too big for a thread's stack
+    struct tlb *tlb = calloc(1, sizeof(struct tlb));
+    if (tlb == NULL)
+        die("could not allocate tlb");
+    // this only stops when do_exit calls pthread_exit
+    pthread_cleanup_push(free, tlb);
+    tlb_refresh(tlb, &current->mem->mmu);
     while (true) {
         read_wrlock(&current->mem->lock);
-        int interrupt = cpu_run_to_interrupt(cpu, &tlb);
+        int interrupt = cpu_run_to_interrupt(cpu, tlb);
         read_wrunlock(&current->mem->lock);
         handle_interrupt(interrupt);
     }
+    pthread_cleanup_pop(true);
 }
 
 static void *task_thread(void *task) {
@@ -3,40 +3,36 @@
 
 static int __user_read_task(struct task *task, addr_t addr, void *buf, size_t count) {
     char *cbuf = (char *) buf;
-    addr_t p = addr;
-    while (p < addr + count) {
-        addr_t chunk_end = (PAGE(p) + 1) << PAGE_BITS;
-        if (chunk_end > addr + count)
-            chunk_end = addr + count;
-        const char *ptr = mem_ptr(task->mem, p, MEM_READ);
+    size_t done = 0;
+    while (done < count) {
+        size_t len;
+        const char *ptr = mem_ptr_range(task->mem, addr + done, count - done, MEM_READ, &len);
         if (ptr == NULL)
             return 1;
-        memcpy(&cbuf[p - addr], ptr, chunk_end - p);
-        p = chunk_end;
+        memcpy(&cbuf[done], ptr, len);
+        done += len;
     }
     return 0;
 }
 
 static int __user_write_task(struct task *task, addr_t addr, const void *buf, size_t count, bool ptrace) {
     const char *cbuf = (const char *) buf;
-    addr_t p = addr;
-    while (p < addr + count) {
-        addr_t chunk_end = (PAGE(p) + 1) << PAGE_BITS;
-        if (chunk_end > addr + count)
-            chunk_end = addr + count;
-        char *ptr = mem_ptr(task->mem, p, ptrace ? MEM_WRITE_PTRACE : MEM_WRITE);
+    size_t done = 0;
+    while (done < count) {
+        size_t len;
+        char *ptr = mem_ptr_range(task->mem, addr + done, count - done, ptrace ? MEM_WRITE_PTRACE : MEM_WRITE, &len);
         if (ptr == NULL)
             return 1;
-        memcpy(ptr, &cbuf[p - addr], chunk_end - p);
-        p = chunk_end;
+        memcpy(ptr, &cbuf[done], len);
+        done += len;
     }
     return 0;
 }
 
 int user_read_task(struct task *task, addr_t addr, void *buf, size_t count) {
-    read_wrlock(&task->mem->lock);
+    mem_read_lock(task->mem);
     int res = __user_read_task(task, addr, buf, count);
-    read_wrunlock(&task->mem->lock);
+    mem_read_unlock(task->mem);
     return res;
 }
 
@@ -45,16 +41,16 @@ int user_read(addr_t addr, void *buf, size_t count) {
 }
 
 int user_write_task(struct task *task, addr_t addr, const void *buf, size_t count) {
-    read_wrlock(&task->mem->lock);
+    mem_read_lock(task->mem);
     int res = __user_write_task(task, addr, buf, count, false);
-    read_wrunlock(&task->mem->lock);
+    mem_read_unlock(task->mem);
     return res;
 }
 
 int user_write_task_ptrace(struct task *task, addr_t addr, const void *buf, size_t count) {
-    read_wrlock(&task->mem->lock);
+    mem_read_lock(task->mem);
     int res = __user_write_task(task, addr, buf, count, true);
-    read_wrunlock(&task->mem->lock);
+    mem_read_unlock(task->mem);
     return res;
 }
 
@@ -62,36 +58,64 @@ int user_write(addr_t addr, const void *buf, size_t count) {
     return user_write_task(current, addr, buf, count);
 }
 
-int user_read_string(addr_t addr, char *buf, size_t max) {
-    if (addr == 0)
-        return 1;
+int user_read_iovec(const struct iovec_ *iovec, unsigned iovec_count, void *buf, size_t size) {
+    char *cbuf = (char *) buf;
     read_wrlock(&current->mem->lock);
-    size_t i = 0;
-    while (i < max) {
-        if (__user_read_task(current, addr + i, &buf[i], sizeof(buf[i]))) {
+    for (unsigned i = 0; i < iovec_count && size > 0; i++) {
+        size_t len = iovec[i].len < size ? iovec[i].len : size;
+        if (__user_read_task(current, iovec[i].base, cbuf, len)) {
             read_wrunlock(&current->mem->lock);
             return 1;
         }
-        if (buf[i] == '\0')
-            break;
-        i++;
+        cbuf += len;
+        size -= len;
     }
     read_wrunlock(&current->mem->lock);
     return 0;
 }
 
-int user_write_string(addr_t addr, const char *buf) {
+int user_write_iovec(const struct iovec_ *iovec, unsigned iovec_count, const void *buf, size_t size) {
+    const char *cbuf = (const char *) buf;
+    read_wrlock(&current->mem->lock);
+    for (unsigned i = 0; i < iovec_count && size > 0; i++) {
+        size_t len = iovec[i].len < size ? iovec[i].len : size;
+        if (__user_write_task(current, iovec[i].base, cbuf, len, false)) {
+            read_wrunlock(&current->mem->lock);
+            return 1;
+        }
+        cbuf += len;
+        size -= len;
+    }
+    read_wrunlock(&current->mem->lock);
+    return 0;
+}
+
+int user_read_string(addr_t addr, char *buf, size_t max) {
     if (addr == 0)
         return 1;
     read_wrlock(&current->mem->lock);
     size_t i = 0;
-    do {
-        if (__user_write_task(current, addr + i, &buf[i], sizeof(buf[i]), false)) {
+    while (i < max) {
+        size_t len;
+        const char *ptr = mem_ptr_range(current->mem, addr + i, max - i, MEM_READ, &len);
+        if (ptr == NULL) {
             read_wrunlock(&current->mem->lock);
             return 1;
         }
-        i++;
-    } while (buf[i - 1] != '\0');
+        const char *end = memchr(ptr, '\0', len);
+        if (end != NULL)
+            len = end - ptr + 1;
+        memcpy(&buf[i], ptr, len);
+        i += len;
+        if (end != NULL)
+            break;
+    }
     read_wrunlock(&current->mem->lock);
     return 0;
 }
+
+int user_write_string(addr_t addr, const char *buf) {
+    if (addr == 0)
+        return 1;
+    return user_write(addr, buf, strlen(buf) + 1);
+}
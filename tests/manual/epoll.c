@@ -0,0 +1,98 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+// Like a server with lots of idle connections: many eventfds are registered
+// with one epoll, and only one of them is ready at a time, so epoll_wait
+// should take the same time no matter how many there are. Then the opposite:
+// lots of pipes that are always writable, which all have to come back from
+// every epoll_wait and poll without any getting lost or the call hanging.
+
+#define ROUNDS 20000
+
+static double run(int count) {
+    int epoll = epoll_create1(0);
+    int *fds = malloc(count * sizeof(int));
+    for (int i = 0; i < count; i++) {
+        fds[i] = eventfd(0, EFD_NONBLOCK);
+        struct epoll_event event = {.events = EPOLLIN, .data.u32 = i};
+        if (fds[i] < 0 || epoll_ctl(epoll, EPOLL_CTL_ADD, fds[i], &event) < 0) {
+            perror("setup");
+            exit(1);
+        }
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < ROUNDS; i++) {
+        uint64_t val = 1;
+        write(fds[(i * 7) % count], &val, sizeof(val));
+        struct epoll_event events[16];
+        int n = epoll_wait(epoll, events, 16, -1);
+        if (n != 1) {
+            printf("expected 1 event, got %d\n", n);
+            exit(1);
+        }
+        read(fds[events[0].data.u32], &val, sizeof(val));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for (int i = 0; i < count; i++)
+        close(fds[i]);
+    free(fds);
+    close(epoll);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%d fds: %.3fs\n", count, secs);
+    return secs;
+}
+
+#define ALWAYS_READY 32
+
+static void run_always_ready(void) {
+    int epoll = epoll_create1(0);
+    struct pollfd polls[ALWAYS_READY + 1];
+    for (int i = 0; i < ALWAYS_READY; i++) {
+        int p[2];
+        if (pipe(p) < 0) {
+            perror("pipe");
+            exit(1);
+        }
+        struct epoll_event event = {.events = EPOLLOUT, .data.u32 = i};
+        epoll_ctl(epoll, EPOLL_CTL_ADD, p[1], &event);
+        polls[i] = (struct pollfd) {.fd = p[1], .events = POLLOUT};
+    }
+    // and one that's never ready, so there's something for the real poll to
+    // look for
+    int idle[2];
+    pipe(idle);
+    struct epoll_event event = {.events = EPOLLIN, .data.u32 = ALWAYS_READY};
+    epoll_ctl(epoll, EPOLL_CTL_ADD, idle[0], &event);
+    polls[ALWAYS_READY] = (struct pollfd) {.fd = idle[0], .events = POLLIN};
+
+    for (int i = 0; i < 100; i++) {
+        struct epoll_event events[ALWAYS_READY * 2];
+        int n = epoll_wait(epoll, events, ALWAYS_READY * 2, -1);
+        if (n != ALWAYS_READY) {
+            printf("expected %d events, got %d\n", ALWAYS_READY, n);
+            exit(1);
+        }
+        n = poll(polls, ALWAYS_READY + 1, -1);
+        if (n != ALWAYS_READY) {
+            printf("expected %d ready, got %d\n", ALWAYS_READY, n);
+            exit(1);
+        }
+    }
+    printf("%d always ready fds: ok\n", ALWAYS_READY);
+}
+
+int main() {
+    run(1);
+    run(100);
+    run(1000);
+    run_always_ready();
+}
@@ -0,0 +1,37 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Forks over and over with a big heap, and both sides write to every page
+// afterwards, like a shell running commands. Each write is a copy-on-write
+// fault, so this is mostly a benchmark of those.
+
+#define HEAP_PAGES 1024
+#define PAGE 4096
+
+int main(int argc, const char *argv[]) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 50;
+    char *heap = malloc(HEAP_PAGES * PAGE);
+    for (int p = 0; p < HEAP_PAGES; p++)
+        heap[p * PAGE] = p;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int round = 0; round < rounds; round++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            for (int p = 0; p < HEAP_PAGES; p++)
+                heap[p * PAGE + 1] = round;
+            _exit(0);
+        }
+        waitpid(pid, NULL, 0);
+        // nothing shares the heap anymore
+        for (int p = 0; p < HEAP_PAGES; p++)
+            heap[p * PAGE + 2] = round;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%d forks: %.3fs\n", rounds, secs);
+}
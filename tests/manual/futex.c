@@ -0,0 +1,200 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Threads fight over a mutex, meet at a condition variable barrier, and pass
+// items through a small queue. All of it ends up in futex wait and wake, and
+// the barrier's broadcasts requeue waiters onto the mutex. The same contention
+// on a priority inheritance mutex goes through FUTEX_LOCK_PI and UNLOCK_PI,
+// and then several threads queue up on one held PI mutex, one of them with a
+// timeout that runs out around when it gets unlocked. The rest all have to get
+// it; a lost wakeup shows up as a hang. Pairs of threads on their own mutexes
+// show whether unrelated futexes get in each other's way. The number of
+// threads is the first argument.
+
+#define MAX_THREADS 64
+#define ITERS 50000
+#define ROUNDS 5000
+#define QUEUE_SIZE 8
+#define PI_ROUNDS 500
+
+static int threads = 4;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static long counter;
+
+static struct {
+    pthread_mutex_t mutex;
+    long counter;
+} pairs[MAX_THREADS / 2];
+
+static pthread_mutex_t pi_mutex;
+static int pi_acquired, pi_timeouts;
+
+static pthread_mutex_t barrier_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t barrier_cond = PTHREAD_COND_INITIALIZER;
+static int arrived, generation;
+
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_not_full = PTHREAD_COND_INITIALIZER;
+static int queued;
+
+static void *contend(void *data) {
+    for (int i = 0; i < ITERS; i++) {
+        pthread_mutex_lock(&mutex);
+        counter++;
+        pthread_mutex_unlock(&mutex);
+    }
+    return NULL;
+}
+
+static void *contend_pair(void *data) {
+    int pair = (long) data / 2;
+    for (int i = 0; i < ITERS; i++) {
+        pthread_mutex_lock(&pairs[pair].mutex);
+        pairs[pair].counter++;
+        pthread_mutex_unlock(&pairs[pair].mutex);
+    }
+    return NULL;
+}
+
+static void *contend_pi(void *data) {
+    for (int i = 0; i < ITERS; i++) {
+        pthread_mutex_lock(&pi_mutex);
+        counter++;
+        pthread_mutex_unlock(&pi_mutex);
+    }
+    return NULL;
+}
+
+static void *pi_wait(void *data) {
+    pthread_mutex_lock(&pi_mutex);
+    pi_acquired++;
+    pthread_mutex_unlock(&pi_mutex);
+    return NULL;
+}
+
+static void *pi_wait_timed(void *data) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long) data;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    if (pthread_mutex_timedlock(&pi_mutex, &deadline) != 0) {
+        // only one of these runs at a time
+        pi_timeouts++;
+        return NULL;
+    }
+    pi_acquired++;
+    pthread_mutex_unlock(&pi_mutex);
+    return NULL;
+}
+
+static void pi_handoff(void) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int round = 0; round < PI_ROUNDS; round++) {
+        pthread_mutex_lock(&pi_mutex);
+        pthread_t waiters[MAX_THREADS];
+        // the timed one goes first so it's the one the unlock picks, with a
+        // timeout from 0.7ms to 1.5ms against the 1ms the mutex is held for
+        pthread_create(&waiters[0], NULL, pi_wait_timed, (void *) (700000L + (round % 40) * 20000));
+        for (int i = 1; i < threads; i++)
+            pthread_create(&waiters[i], NULL, pi_wait, NULL);
+        nanosleep(&(struct timespec) {.tv_nsec = 1000000}, NULL);
+        pthread_mutex_unlock(&pi_mutex);
+        for (int i = 0; i < threads; i++)
+            pthread_join(waiters[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("pi handoff: %.3fs, %d timeouts\n", secs, pi_timeouts);
+}
+
+static void *barrier(void *data) {
+    for (int round = 0; round < ROUNDS; round++) {
+        pthread_mutex_lock(&barrier_mutex);
+        int gen = generation;
+        if (++arrived == threads) {
+            arrived = 0;
+            generation++;
+            pthread_cond_broadcast(&barrier_cond);
+        } else {
+            while (gen == generation)
+                pthread_cond_wait(&barrier_cond, &barrier_mutex);
+        }
+        pthread_mutex_unlock(&barrier_mutex);
+    }
+    return NULL;
+}
+
+static void *producer(void *data) {
+    for (int i = 0; i < ITERS; i++) {
+        pthread_mutex_lock(&queue_mutex);
+        while (queued == QUEUE_SIZE)
+            pthread_cond_wait(&queue_not_full, &queue_mutex);
+        queued++;
+        pthread_cond_signal(&queue_not_empty);
+        pthread_mutex_unlock(&queue_mutex);
+    }
+    return NULL;
+}
+
+static void *consumer(void *data) {
+    for (int i = 0; i < ITERS; i++) {
+        pthread_mutex_lock(&queue_mutex);
+        while (queued == 0)
+            pthread_cond_wait(&queue_not_empty, &queue_mutex);
+        queued--;
+        pthread_cond_signal(&queue_not_full);
+        pthread_mutex_unlock(&queue_mutex);
+    }
+    return NULL;
+}
+
+static double run(const char *name, void *(*even)(void *), void *(*odd)(void *)) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t workers[MAX_THREADS];
+    for (int i = 0; i < threads; i++)
+        pthread_create(&workers[i], NULL, i % 2 ? odd : even, (void *) (long) i);
+    for (int i = 0; i < threads; i++)
+        pthread_join(workers[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%s: %.3fs\n", name, secs);
+    return secs;
+}
+
+int main(int argc, const char *argv[]) {
+    threads = argc > 1 ? atoi(argv[1]) : 4;
+    // half of them produce for the other half
+    if (threads < 2 || threads > MAX_THREADS || threads % 2 != 0) {
+        printf("need an even number of threads up to %d\n", MAX_THREADS);
+        return 1;
+    }
+    run("mutex", contend, contend);
+    for (int i = 0; i < threads / 2; i++)
+        pthread_mutex_init(&pairs[i].mutex, NULL);
+    run("pairs", contend_pair, contend_pair);
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+    pthread_mutex_init(&pi_mutex, &attr);
+    run("pi mutex", contend_pi, contend_pi);
+    pi_handoff();
+    run("barrier", barrier, barrier);
+    run("queue", producer, consumer);
+    long paired = 0;
+    for (int i = 0; i < threads / 2; i++)
+        paired += pairs[i].counter;
+    if (counter != 2 * threads * ITERS || paired != threads * ITERS ||
+            generation != ROUNDS || queued != 0 || pi_acquired + pi_timeouts != threads * PI_ROUNDS) {
+        printf("wrong results\n");
+        return 1;
+    }
+}
@@ -0,0 +1,45 @@
+#!/bin/bash
+# Time a shell loop that starts lots of short lived processes, with and
+# without the on-disk translation cache (ish -j).
+#
+# Usage: jit-cache-bench.sh [ish] [fakefs or root directory] [iterations] [command...]
+# Defaults to the build and filesystem used by tests/e2e. If a command is
+# given, it's run instead of the shell loop, for roots that don't have a shell.
+# Each case is run $REPEAT times (default 11) and the median is printed, since
+# single runs are noisier than the difference being measured.
+cd "$(dirname "$0")/../.."
+ISH=${1:-./build/ish}
+FS=${2:-./e2e_out/testfs}
+N=${3:-200}
+REPEAT=${REPEAT:-11}
+shift $(( $# < 3 ? $# : 3 ))
+
+CACHE=$(mktemp -d)
+trap 'rm -rf "$CACHE"' EXIT
+SCRIPT="i=0; while [ \$i -lt $N ]; do /bin/true; echo \$i | grep -q x; i=\$((i+1)); done"
+if [ $# -eq 0 ]; then
+    set -- /bin/sh -c "$SCRIPT"
+fi
+if [ -d "$FS" ]; then
+    ROOT=(-r "$FS")
+else
+    ROOT=(-f "$FS")
+fi
+
+run() {
+    local times=()
+    for (( r = 0; r < REPEAT; r++ )); do
+        if [ "$1" = cold ]; then
+            rm -rf "${CACHE:?}"/*
+        fi
+        local start=$(date +%s%N)
+        "$ISH" "${@:2}" >/dev/null || exit 1
+        times+=($(( ($(date +%s%N) - start) / 1000 )))
+    done
+    local sorted=($(printf '%s\n' "${times[@]}" | sort -n))
+    echo "$(( sorted[REPEAT / 2] / 1000 )).$(printf %03d $(( sorted[REPEAT / 2] % 1000 ))) ms"
+}
+
+echo -n "no cache:   "; run none "${ROOT[@]}" "$@"
+echo -n "cold cache: "; run cold -j "$CACHE" "${ROOT[@]}" "$@"
+echo -n "warm cache: "; run warm -j "$CACHE" "${ROOT[@]}" "$@"
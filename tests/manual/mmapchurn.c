@@ -0,0 +1,58 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+
+// Threads walk a heap while the main thread keeps mapping and unmapping
+// memory somewhere else, like a program calling malloc and free a lot. None
+// of the unmapped memory is in the heap, so none of the walkers' TLB entries
+// should have to go.
+
+#define HEAP_PAGES 512
+#define ROUNDS 20000
+#define PAGE 4096
+
+static char *heap;
+static volatile int running;
+
+static void *walker(void *data) {
+    int n = (int) (long) data;
+    unsigned sum = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int p = 0; p < HEAP_PAGES; p++)
+            sum += heap[p * PAGE + n];
+        // give the main thread a chance to change something
+        sched_yield();
+    }
+    __atomic_fetch_sub(&running, 1, __ATOMIC_SEQ_CST);
+    return (void *) (long) sum;
+}
+
+int main(int argc, const char *argv[]) {
+    int n = argc > 1 ? atoi(argv[1]) : 3;
+    heap = mmap(NULL, HEAP_PAGES * PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    for (int p = 0; p < HEAP_PAGES; p++)
+        heap[p * PAGE] = p;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t threads[n];
+    running = n;
+    for (int i = 0; i < n; i++)
+        pthread_create(&threads[i], NULL, walker, (void *) (long) i);
+    int churns = 0;
+    while (running > 0) {
+        char *p = mmap(NULL, 16 * PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        p[0] = 1;
+        munmap(p, 16 * PAGE);
+        churns++;
+        sched_yield();
+    }
+    for (int i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%d threads, %d munmaps: %.3fs\n", n, churns, secs);
+}
@@ -0,0 +1,57 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Runs the same indirect-call-heavy loop on 1, 2, 4, ... threads. Each call
+// goes back to the dispatcher, so this shows how well block lookup scales
+// when every thread shares one address space.
+
+#define F(n) __attribute__((noinline)) static int f##n(int x) { return x * (n | 1) + (x >> 3) + n; }
+#define F10(n) F(n##0) F(n##1) F(n##2) F(n##3) F(n##4) F(n##5) F(n##6) F(n##7) F(n##8) F(n##9)
+#define F100(n) F10(n##0) F10(n##1) F10(n##2) F10(n##3) F10(n##4) F10(n##5) F10(n##6) F10(n##7) F10(n##8) F10(n##9)
+F100(1) F100(2) F100(3)
+#define P(n) f##n,
+#define P10(n) P(n##0) P(n##1) P(n##2) P(n##3) P(n##4) P(n##5) P(n##6) P(n##7) P(n##8) P(n##9)
+#define P100(n) P10(n##0) P10(n##1) P10(n##2) P10(n##3) P10(n##4) P10(n##5) P10(n##6) P10(n##7) P10(n##8) P10(n##9)
+static int (*table[])(int) = {P100(1) P100(2) P100(3)};
+#define TABLE_SIZE (sizeof(table) / sizeof(table[0]))
+
+#define LOOPS 2000000
+
+static void *thread(void *data) {
+    int x = (int) (long) data;
+    unsigned seed = x + 1;
+    for (int i = 0; i < LOOPS; i++) {
+        seed = seed * 1103515245 + 12345;
+        x = table[(seed >> 8) % TABLE_SIZE](x);
+        // come back from a syscall every so often too
+        if (i % 1024 == 0)
+            getpid();
+    }
+    return (void *) (long) x;
+}
+
+int main(int argc, const char *argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    // scaling can't be judged without knowing how many threads can really run
+    // at once
+    printf("%ld cpus\n", sysconf(_SC_NPROCESSORS_ONLN));
+    double one_thread = 0;
+    for (int n = 1; n <= max_threads; n *= 2) {
+        pthread_t threads[n];
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < n; i++)
+            pthread_create(&threads[i], NULL, thread, (void *) (long) i);
+        for (int i = 0; i < n; i++)
+            pthread_join(threads[i], NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        double rate = (double) n * LOOPS / secs;
+        if (n == 1)
+            one_thread = rate;
+        printf("%d threads: %.3fs, %.1fM calls/s, %.2fx one thread\n", n, secs, rate / 1e6, rate / one_thread);
+    }
+}
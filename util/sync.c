@@ -28,18 +28,8 @@ static bool is_signal_pending(lock_t *lock) {
     return pending;
 }
 
-int wait_for(cond_t *cond, lock_t *lock, struct timespec *timeout) {
-    if (is_signal_pending(lock))
-        return _EINTR;
-    int err = wait_for_ignore_signals(cond, lock, timeout);
-    if (err < 0)
-        return _ETIMEDOUT;
-    if (is_signal_pending(lock))
-        return _EINTR;
-    return 0;
-}
-
-int wait_for_ignore_signals(cond_t *cond, lock_t *lock, struct timespec *timeout) {
+// timeout is relative, or an absolute CLOCK_MONOTONIC time if absolute is set
+static int wait_ignore_signals(cond_t *cond, lock_t *lock, struct timespec *timeout, bool absolute) {
     if (current) {
         lock(&current->waiting_cond_lock);
         current->waiting_cond = cond;
@@ -55,17 +45,32 @@ int wait_for_ignore_signals(cond_t *cond, lock_t *lock, struct timespec *timeout
         pthread_cond_wait(&cond->cond, &lock->m);
     } else {
 #if __linux__
-        struct timespec abs_timeout;
-        clock_gettime(CLOCK_MONOTONIC, &abs_timeout);
-        abs_timeout.tv_sec += timeout->tv_sec;
-        abs_timeout.tv_nsec += timeout->tv_nsec;
-        if (abs_timeout.tv_nsec > 1000000000) {
-            abs_timeout.tv_sec++;
-            abs_timeout.tv_nsec -= 1000000000;
+        struct timespec abs_timeout = *timeout;
+        if (!absolute) {
+            clock_gettime(CLOCK_MONOTONIC, &abs_timeout);
+            abs_timeout.tv_sec += timeout->tv_sec;
+            abs_timeout.tv_nsec += timeout->tv_nsec;
+            if (abs_timeout.tv_nsec >= 1000000000) {
+                abs_timeout.tv_sec++;
+                abs_timeout.tv_nsec -= 1000000000;
+            }
         }
         rc = pthread_cond_timedwait(&cond->cond, &lock->m, &abs_timeout);
 #elif __APPLE__
-        rc = pthread_cond_timedwait_relative_np(&cond->cond, &lock->m, timeout);
+        struct timespec rel_timeout = *timeout;
+        if (absolute) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            rel_timeout.tv_sec -= now.tv_sec;
+            rel_timeout.tv_nsec -= now.tv_nsec;
+            if (rel_timeout.tv_nsec < 0) {
+                rel_timeout.tv_sec--;
+                rel_timeout.tv_nsec += 1000000000;
+            }
+            if (rel_timeout.tv_sec < 0)
+                rel_timeout.tv_sec = rel_timeout.tv_nsec = 0;
+        }
+        rc = pthread_cond_timedwait_relative_np(&cond->cond, &lock->m, &rel_timeout);
 #else
 #error Unimplemented pthread_cond_wait relative timeout.
 #endif
@@ -85,6 +90,29 @@ int wait_for_ignore_signals(cond_t *cond, lock_t *lock, struct timespec *timeout
     return 0;
 }
 
+static int wait_interruptible(cond_t *cond, lock_t *lock, struct timespec *timeout, bool absolute) {
+    if (is_signal_pending(lock))
+        return _EINTR;
+    int err = wait_ignore_signals(cond, lock, timeout, absolute);
+    if (err < 0)
+        return _ETIMEDOUT;
+    if (is_signal_pending(lock))
+        return _EINTR;
+    return 0;
+}
+
+int wait_for(cond_t *cond, lock_t *lock, struct timespec *timeout) {
+    return wait_interruptible(cond, lock, timeout, false);
+}
+
+int wait_until(cond_t *cond, lock_t *lock, struct timespec *deadline) {
+    return wait_interruptible(cond, lock, deadline, true);
+}
+
+int wait_for_ignore_signals(cond_t *cond, lock_t *lock, struct timespec *timeout) {
+    return wait_ignore_signals(cond, lock, timeout, false);
+}
+
 void notify(cond_t *cond) {
     pthread_cond_broadcast(&cond->cond);
 }
@@ -94,6 +94,9 @@ void cond_destroy(cond_t *cond);
 // _ETIMEDOUT if waiting stopped because the timout expired, 0 otherwise.
 // Will never return _ETIMEDOUT if timeout is NULL.
 int must_check wait_for(cond_t *cond, lock_t *lock, struct timespec *timeout);
+// Same as wait_for, except deadline is an absolute CLOCK_MONOTONIC time, and
+// only works on conditions set up with cond_init
+int must_check wait_until(cond_t *cond, lock_t *lock, struct timespec *deadline);
 // Same as wait_for, except it will never return _EINTR
 int wait_for_ignore_signals(cond_t *cond, lock_t *lock, struct timespec *timeout);
 // Wake up all waiters.
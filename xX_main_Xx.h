@@ -7,6 +7,7 @@
 #include "kernel/fs.h"
 #include "fs/devices.h"
 #include "fs/real.h"
+#include "asbestos/cache.h"
 #ifdef __APPLE__
 #include <sys/resource.h>
 #define IOPOL_TYPE_VFS_HFS_CASE_SENSITIVITY 1
@@ -18,6 +19,7 @@ void real_tty_reset_term(void);
 static void exit_handler(struct task *task, int code) {
     if (task->parent != NULL)
         return;
+    fiber_cache_sync();
     real_tty_reset_term();
     if (code & 0xff)
         raise(code & 0xff);
@@ -50,7 +52,7 @@ static inline int xX_main_Xx(int argc, char *const argv[], const char *envp) {
     const char *workdir = NULL;
     const struct fs_ops *fs = &realfs;
     const char *console = "/dev/tty1";
-    while ((opt = getopt(argc, argv, "+r:f:d:c:")) != -1) {
+    while ((opt = getopt(argc, argv, "+r:f:d:c:j:")) != -1) {
         switch (opt) {
             case 'r':
             case 'f':
@@ -64,6 +66,12 @@ static inline int xX_main_Xx(int argc, char *const argv[], const char *envp) {
             case 'c':
                 console = optarg;
                 break;
+            case 'j':
+                if (fiber_cache_init(optarg) < 0) {
+                    perror(optarg);
+                    exit(1);
+                }
+                break;
 
         }
     }